@@ -0,0 +1,509 @@
+/*
+ * queue-bench.c
+ *
+ * Microbenchmarks for the buffer handoff at the core of the runtime.  Each
+ * benchmark wires up bare stages and pins by hand, without modules or
+ * fg_network_run(), and has its threads drive fg_pin_accept_buffer() and
+ * fg_pin_convey_buffer() directly:
+ *
+ *   pingpong    one buffer bouncing between two threads; round-trip latency
+ *   stream      producer to consumer and back, against the buffer count
+ *   recycle     one producer feeding N consumers, which all return buffers
+ *               to the producer's one source queue (N:1 contention)
+ *   fanin       N producers into one consumer's pin array
+ *   crossnode   pingpong with the threads pinned to the same or different
+ *               NUMA nodes
+ *
+ * Results go to stdout as JSON, one object with a "results" array, so runs
+ * before and after a change to the queue, wait strategy or scheduler can be
+ * compared mechanically.
+ *
+ * Usage: queue-bench [-n handoffs] [-b benchmark]
+ */
+
+#define _GNU_SOURCE /* for CPU_SET() and pthread_setaffinity_np() */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+
+#include "fg_internal.h"
+
+#define BENCH_BUFSIZE 4096
+#define BENCH_STACK_SIZE (256 * 1024)
+
+struct worker {
+    FG_pin *in;                 /* input pin, or pin array */
+    FG_pin **out;               /* output pins, used round robin */
+    int out_count;
+    long iterations;
+    int cpu;                    /* -1 for no affinity */
+    pthread_t thread;
+};
+
+void usage(const char *argv0);
+FG_stage *bench_stage(const char *name, int outputs, int array_in);
+void add_source_buffers(FG_pin *pin, int count);
+void destroy_stage(FG_stage *stage);
+void *worker_func(void *data);
+uint64_t run_workers(struct worker *workers, int count);
+void result(const char *name, const char *params, long handoffs,
+        uint64_t ns);
+int numa_cpus(int node, int *cpus, int max);
+
+void bench_pingpong(long n);
+void bench_stream(long n);
+void bench_recycle(long n);
+void bench_fanin(long n);
+void bench_crossnode(long n);
+
+static FG_network bench_nw;     /* stages only look at its flags */
+static int first_result = 1;
+
+static const struct {
+    const char *name;
+    void (*func)(long n);
+} benchmarks[] = { { "pingpong",  bench_pingpong  },
+                   { "stream",    bench_stream    },
+                   { "recycle",   bench_recycle   },
+                   { "fanin",     bench_fanin     },
+                   { "crossnode", bench_crossnode },
+                   { NULL }
+                 };
+
+int main(int argc, char *argv[])
+{
+    const char *only = NULL;
+    long n = 200000;
+    int c, i;
+
+    while((c = getopt(argc, argv, "n:b:h")) != -1) {
+        switch(c) {
+            case 'n': n = atol(optarg); break;
+            case 'b': only = optarg; break;
+            default:
+                usage(argv[0]);
+                exit(c == 'h' ? 0 : 1);
+        }
+    }
+
+    if(n < 1) {
+        usage(argv[0]);
+        exit(1);
+    }
+
+    /* the benchmarks time the handoff, not the logging */
+    fg_log_set_domains(0);
+
+    printf("{\"benchmark\": \"queue-bench\", \"handoffs\": %ld, "
+            "\"cpus\": %ld, \"results\": [", n, sysconf(_SC_NPROCESSORS_ONLN));
+
+    for(i = 0; benchmarks[i].name; i++) {
+        if(!only || strcmp(only, benchmarks[i].name) == 0)
+            benchmarks[i].func(n);
+    }
+
+    printf("\n]}\n");
+
+    return 0;
+}
+
+void usage(const char *argv0)
+{
+    int i;
+
+    printf("Usage: %s [-n handoffs] [-b benchmark]\n", argv0);
+    printf("  benchmarks:");
+    for(i = 0; benchmarks[i].name; i++)
+        printf(" %s", benchmarks[i].name);
+    printf("\n");
+}
+
+/* One buffer, two threads: A accepts it from its source pin and conveys it
+ * to B, whose unconnected output returns it to A.  Each iteration is a round
+ * trip of two handoffs. */
+void bench_pingpong(long n)
+{
+    FG_stage *a, *b;
+    struct worker w[2];
+    char params[64];
+    uint64_t ns;
+
+    a = bench_stage("a", 1, 0);
+    b = bench_stage("b", 1, 0);
+    fg_pin_connect(a, "out0", b, "in");
+    add_source_buffers(fg_stage_pin_get_by_name(a, "in"), 1);
+
+    memset(w, 0, sizeof(w));
+    w[0].in = fg_stage_pin_get_by_name(a, "in");
+    w[0].out = a->pins + 1;
+    w[0].out_count = 1;
+    w[1].in = fg_stage_pin_get_by_name(b, "in");
+    w[1].out = b->pins + 1;
+    w[1].out_count = 1;
+    w[0].iterations = w[1].iterations = n / 2;
+    w[0].cpu = w[1].cpu = -1;
+
+    ns = run_workers(w, 2);
+    snprintf(params, sizeof(params), "\"round_trip_ns\": %.1f",
+            (double) ns / (n / 2));
+    result("pingpong", params, n / 2 * 2, ns);
+
+    destroy_stage(a);
+    destroy_stage(b);
+}
+
+/* the same loop with more buffers in flight, which is what the buffer count
+ * buys a pipeline */
+void bench_stream(long n)
+{
+    FG_stage *a, *b;
+    struct worker w[2];
+    char params[64];
+    uint64_t ns;
+    int bufcount;
+
+    for(bufcount = 1; bufcount <= 256; bufcount *= 4) {
+        a = bench_stage("a", 1, 0);
+        b = bench_stage("b", 1, 0);
+        fg_pin_connect(a, "out0", b, "in");
+        add_source_buffers(fg_stage_pin_get_by_name(a, "in"), bufcount);
+
+        memset(w, 0, sizeof(w));
+        w[0].in = fg_stage_pin_get_by_name(a, "in");
+        w[0].out = a->pins + 1;
+        w[0].out_count = 1;
+        w[1].in = fg_stage_pin_get_by_name(b, "in");
+        w[1].out = b->pins + 1;
+        w[1].out_count = 1;
+        w[0].iterations = w[1].iterations = n / 2;
+        w[0].cpu = w[1].cpu = -1;
+
+        ns = run_workers(w, 2);
+        snprintf(params, sizeof(params), "\"bufcount\": %d", bufcount);
+        result("stream", params, n / 2 * 2, ns);
+
+        destroy_stage(a);
+        destroy_stage(b);
+    }
+}
+
+/* One producer hands buffers round robin to N consumers, which all convey
+ * them back into the producer's single source queue. */
+void bench_recycle(long n)
+{
+    FG_stage *p, **c;
+    struct worker *w;
+    char name[32], params[64];
+    uint64_t ns;
+    long per;
+    int consumers, i;
+
+    for(consumers = 1; consumers <= 16; consumers *= 2) {
+        per = n / 2 / consumers;
+        if(per < 1)
+            break;
+
+        p = bench_stage("p", consumers, 0);
+        c = (FG_stage **) calloc(consumers, sizeof(FG_stage *));
+        w = (struct worker *) calloc(consumers + 1, sizeof(struct worker));
+
+        for(i=0; i<consumers; i++) {
+            snprintf(name, sizeof(name), "c%d", i);
+            c[i] = bench_stage(name, 1, 0);
+            snprintf(name, sizeof(name), "out%d", i);
+            fg_pin_connect(p, name, c[i], "in");
+
+            w[i + 1].in = fg_stage_pin_get_by_name(c[i], "in");
+            w[i + 1].out = c[i]->pins + 1;
+            w[i + 1].out_count = 1;
+            w[i + 1].iterations = per;
+            w[i + 1].cpu = -1;
+        }
+
+        add_source_buffers(fg_stage_pin_get_by_name(p, "in"), 4 * consumers);
+        w[0].in = fg_stage_pin_get_by_name(p, "in");
+        w[0].out = p->pins + 1;
+        w[0].out_count = consumers;
+        w[0].iterations = per * consumers;
+        w[0].cpu = -1;
+
+        ns = run_workers(w, consumers + 1);
+        snprintf(params, sizeof(params), "\"consumers\": %d", consumers);
+        result("recycle", params, per * consumers * 2, ns);
+
+        for(i=0; i<consumers; i++)
+            destroy_stage(c[i]);
+        destroy_stage(p);
+        free(c);
+        free(w);
+    }
+}
+
+/* N producers, each with buffers of its own, convey into one consumer's pin
+ * array; the consumer reads the array round robin, as merge stages do, and
+ * returns each buffer to its producer. */
+void bench_fanin(long n)
+{
+    FG_stage *c, **p;
+    FG_pin *array;
+    struct worker *w;
+    char name[32], params[64];
+    uint64_t ns;
+    long per;
+    int producers, i;
+
+    for(producers = 2; producers <= 1024; producers *= 2) {
+        per = n / 2 / producers;
+        if(per < 1)
+            break;
+
+        c = bench_stage("c", 1, 1);
+        p = (FG_stage **) calloc(producers, sizeof(FG_stage *));
+        w = (struct worker *) calloc(producers + 1, sizeof(struct worker));
+
+        for(i=0; i<producers; i++) {
+            snprintf(name, sizeof(name), "p%d", i);
+            p[i] = bench_stage(name, 1, 0);
+            fg_pin_connect(p[i], "out0", c, "in");
+            add_source_buffers(fg_stage_pin_get_by_name(p[i], "in"), 2);
+
+            w[i + 1].in = fg_stage_pin_get_by_name(p[i], "in");
+            w[i + 1].out = p[i]->pins + 1;
+            w[i + 1].out_count = 1;
+            w[i + 1].iterations = per;
+            w[i + 1].cpu = -1;
+        }
+
+        array = fg_stage_pin_get_by_name(c, "in");
+        w[0].in = array;
+        w[0].out = c->pins + 1;
+        w[0].out_count = 1;
+        w[0].iterations = per * producers;
+        w[0].cpu = -1;
+
+        ns = run_workers(w, producers + 1);
+        snprintf(params, sizeof(params), "\"producers\": %d", producers);
+        result("fanin", params, per * producers * 2, ns);
+
+        for(i=0; i<producers; i++)
+            destroy_stage(p[i]);
+        destroy_stage(c);
+        free(p);
+        free(w);
+    }
+}
+
+/* pingpong between two cores of one NUMA node, then between nodes */
+void bench_crossnode(long n)
+{
+    FG_stage *a, *b;
+    struct worker w[2];
+    int cpus0[2], cpus1[1];
+    int n0, n1, pass;
+    uint64_t ns;
+
+    n0 = numa_cpus(0, cpus0, 2);
+    n1 = numa_cpus(1, cpus1, 1);
+
+    for(pass = 0; pass < 2; pass++) {
+        if(pass == 0 && n0 < 2) {
+            printf("%s\n  {\"name\": \"crossnode\", \"placement\": "
+                    "\"same-node\", \"skipped\": \"fewer than 2 cpus on node "
+                    "0\"}", first_result ? "" : ",");
+            first_result = 0;
+            continue;
+        }
+        if(pass == 1 && (n0 < 1 || n1 < 1)) {
+            printf("%s\n  {\"name\": \"crossnode\", \"placement\": "
+                    "\"cross-node\", \"skipped\": \"single NUMA node\"}",
+                    first_result ? "" : ",");
+            first_result = 0;
+            continue;
+        }
+
+        a = bench_stage("a", 1, 0);
+        b = bench_stage("b", 1, 0);
+        fg_pin_connect(a, "out0", b, "in");
+        add_source_buffers(fg_stage_pin_get_by_name(a, "in"), 1);
+
+        memset(w, 0, sizeof(w));
+        w[0].in = fg_stage_pin_get_by_name(a, "in");
+        w[0].out = a->pins + 1;
+        w[0].out_count = 1;
+        w[0].cpu = cpus0[0];
+        w[1].in = fg_stage_pin_get_by_name(b, "in");
+        w[1].out = b->pins + 1;
+        w[1].out_count = 1;
+        w[1].cpu = pass == 0 ? cpus0[1] : cpus1[0];
+        w[0].iterations = w[1].iterations = n / 2;
+
+        ns = run_workers(w, 2);
+        result("crossnode", pass == 0 ? "\"placement\": \"same-node\""
+                : "\"placement\": \"cross-node\"", n / 2 * 2, ns);
+
+        destroy_stage(a);
+        destroy_stage(b);
+    }
+}
+
+/* a stage with one input pin "in" (a pin array if array_in) and output pins
+ * "out0", "out1", ...; it belongs to no real network */
+FG_stage *bench_stage(const char *name, int outputs, int array_in)
+{
+    FG_stage *stage;
+    char pin_name[32];
+    int i;
+
+    stage = (FG_stage *) calloc(1, sizeof(FG_stage));
+    stage->name = strdup(name);
+    stage->nw = &bench_nw;
+    stage->pins = (FG_pin **) calloc(outputs + 2, sizeof(FG_pin *));
+
+    stage->pins[0] = fg_pin_create("in", stage,
+            array_in ? PIN_ARRAY_IN : PIN_IN);
+    for(i=0; i<outputs; i++) {
+        snprintf(pin_name, sizeof(pin_name), "out%d", i);
+        stage->pins[i + 1] = fg_pin_create(pin_name, stage, PIN_OUT);
+    }
+
+    return stage;
+}
+
+/* what fg_network_fix() does for unconnected input pins */
+void add_source_buffers(FG_pin *pin, int count)
+{
+    FG_buf *buf;
+    int i;
+
+    pin->queue = fg_queue_create();
+    pin->queue->reader = pin;
+
+    for(i=0; i<count; i++) {
+        buf = fg_buffer_create(i, BENCH_BUFSIZE);
+        buf->datalen = BENCH_BUFSIZE;
+        buf->origin = pin;
+        fg_queue_write(pin->queue, buf);
+    }
+}
+
+void destroy_stage(FG_stage *stage)
+{
+    FG_pin **pin;
+
+    for(pin = stage->pins; *pin; pin++)
+        fg_pin_destroy(*pin);
+    free(stage->pins);
+    free(stage->name);
+    free(stage);
+}
+
+void *worker_func(void *data)
+{
+    struct worker *w = (struct worker *) data;
+    FG_buf *buf;
+    int width;
+    long i;
+
+    width = w->in->direction == PIN_ARRAY_IN
+        ? fg_pin_array_get_width(w->in) : 0;
+
+    for(i=0; i<w->iterations; i++) {
+        if(width)
+            buf = fg_pin_array_accept_buffer(w->in, i % width);
+        else
+            buf = fg_pin_accept_buffer(w->in);
+
+        fg_pin_convey_buffer(w->out[i % w->out_count], buf);
+    }
+
+    return NULL;
+}
+
+/* starts all workers, pinned if asked, and returns the wall-clock time until
+ * the last one finished */
+uint64_t run_workers(struct worker *workers, int count)
+{
+    pthread_attr_t attr;
+    cpu_set_t set;
+    uint64_t start;
+    int i;
+
+    start = fg_now_ns();
+
+    for(i=0; i<count; i++) {
+        pthread_attr_init(&attr);
+        pthread_attr_setstacksize(&attr, BENCH_STACK_SIZE);
+        if(workers[i].cpu >= 0) {
+            CPU_ZERO(&set);
+            CPU_SET(workers[i].cpu, &set);
+            pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+        }
+
+        if(pthread_create(&workers[i].thread, &attr, worker_func,
+                    workers + i) != 0) {
+            perror("pthread_create");
+            exit(1);
+        }
+        pthread_attr_destroy(&attr);
+    }
+
+    for(i=0; i<count; i++)
+        pthread_join(workers[i].thread, NULL);
+
+    return fg_now_ns() - start;
+}
+
+void result(const char *name, const char *params, long handoffs,
+        uint64_t ns)
+{
+    printf("%s\n  {\"name\": \"%s\", %s, \"handoffs\": %ld, \"ns\": %llu, "
+            "\"ns_per_handoff\": %.1f, \"handoffs_per_s\": %.0f}",
+            first_result ? "" : ",", name, params, handoffs,
+            (unsigned long long) ns, (double) ns / handoffs,
+            handoffs / (ns / 1e9));
+    first_result = 0;
+    fflush(stdout);
+}
+
+/* up to max online cpus of a NUMA node, from sysfs; returns how many */
+int numa_cpus(int node, int *cpus, int max)
+{
+    char path[128];
+    FILE *f;
+    int lo, hi, count = 0;
+    char sep;
+
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist",
+            node);
+    f = fopen(path, "r");
+    if(!f) {
+        /* no NUMA support: everything is node 0 */
+        if(node == 0)
+            for(; count < max && count < sysconf(_SC_NPROCESSORS_ONLN);
+                    count++)
+                cpus[count] = count;
+        return count;
+    }
+
+    /* e.g. "0-3,8-11" */
+    while(count < max && fscanf(f, "%d", &lo) == 1) {
+        hi = lo;
+        if(fscanf(f, "%c", &sep) == 1 && sep == '-') {
+            if(fscanf(f, "%d", &hi) != 1)
+                break;
+            if(fscanf(f, "%c", &sep) != 1)
+                sep = '\n';
+        }
+        for(; lo <= hi && count < max; lo++)
+            cpus[count++] = lo;
+        if(sep != ',')
+            break;
+    }
+
+    fclose(f);
+
+    return count;
+}
@@ -0,0 +1,605 @@
+/*
+ * sort-bench.c
+ *
+ * End-to-end sort benchmark on a single node.  Generates a dataset of
+ * 64-byte records with 8-byte keys (the layout the dsort module assumes) from
+ * a seed, then runs and times, each in a process of its own:
+ *
+ *   sort    read-file -> sort -> write-file, as bin/sort does; each buffer
+ *           comes out sorted, which makes runs a buffer long
+ *   pass1   dsort pass 1: read-file -> sort -> run-writer, a run per buffer,
+ *           all in one run file
+ *   pass2   dsort pass 2: run-reader, with a connection per run, into a
+ *           merge, then write-file
+ *   verify  what bin/sort-verify checks, plus that the output holds exactly
+ *           the records that were generated
+ *
+ * On one node dsort's scatter and gather stages have nobody to exchange
+ * records with, so pass1 connects the sort straight to the writer in their
+ * place and no MPI is involved.
+ *
+ * The same seed, size and distribution always give the same dataset, so
+ * runtime changes, buffer sizes and counts can be compared on equal terms.
+ * Results go to stdout as JSON: MB/s and peak RSS for each pass, and the
+ * statistics of every stage.
+ *
+ * Usage: sort-bench [-s size] [-d distribution] [-p param] [-S seed]
+ *                   [-b bufsize] [-c bufcount] [-w dir] [-k]
+ */
+
+#define _GNU_SOURCE /* for open_memstream() */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+#include "fg_internal.h"
+#include "fg_rand.h"
+#include "fg_runfile.h"
+
+/* record layout; see modules/dsort_module.c */
+#define KEYLEN 8
+#define RECLEN 64
+
+/* pass2 reads each run up to this much at a time, two buffers per run */
+#define RUN_READ_SIZE (1024 * 1024)
+
+#define GEN_CHUNK (4 * 1024 * 1024)
+
+enum dist {
+    DIST_UNIFORM,
+    DIST_ZERO,
+    DIST_SORTED,
+    DIST_REVERSE,
+    DIST_NORMAL,
+    DIST_POISSON
+};
+
+static const char *dist_names[] = { "uniform", "zero", "sorted", "reverse",
+                                    "normal", "poisson", NULL };
+
+struct bench {
+    uint64_t size;              /* bytes, a multiple of RECLEN */
+    enum dist dist;
+    double param;               /* stddev or lambda */
+    uint64_t seed;
+    uint64_t bufsize;
+    uint32_t bufcount;
+    char *dir;
+    int keep;
+
+    uint64_t checksum;          /* of the records generated */
+    int runs;                   /* runs written by pass1 */
+};
+
+/* part of a file to verify; length -1 for the rest of it */
+struct segment {
+    const char *file;
+    off_t offset;
+    off_t length;
+};
+
+void usage(const char *argv0);
+uint64_t parse_size(const char *s);
+int64_t gen_key(struct bench *b, uint64_t i);
+uint64_t rec_hash(const char *rec);
+void generate(struct bench *b, const char *filename);
+char *path(struct bench *b, const char *name);
+void run_pass(struct bench *b, const char *name,
+        FG_network *(*build)(struct bench *b));
+void print_stats(FILE *f, FG_network *nw);
+FG_network *build_sort(struct bench *b);
+FG_network *build_pass1(struct bench *b);
+FG_network *build_pass2(struct bench *b);
+int verify(struct bench *b, const char *name, struct segment *segs,
+        int count, uint64_t run_len);
+
+static int first_result = 1;
+static int main_argc;           /* for fg_init() in the passes */
+static char **main_argv;
+
+int main(int argc, char *argv[])
+{
+    struct bench b;
+    struct fg_runfile_entry *dir = NULL;
+    struct segment *runs, out;
+    char *runfile;
+    int c, i, fd, ok = 1;
+
+    main_argc = argc;
+    main_argv = argv;
+
+    memset(&b, 0, sizeof(b));
+    b.size = 256 * 1024 * 1024;
+    b.dist = DIST_UNIFORM;
+    b.param = -1;
+    b.seed = 1;
+    b.bufsize = 8 * 1024 * 1024;
+    b.bufcount = 4;
+    b.dir = ".";
+
+    while((c = getopt(argc, argv, "s:d:p:S:b:c:w:kh")) != -1) {
+        switch(c) {
+            case 's': b.size = parse_size(optarg); break;
+            case 'p': b.param = atof(optarg); break;
+            case 'S': b.seed = strtoull(optarg, NULL, 0); break;
+            case 'b': b.bufsize = parse_size(optarg); break;
+            case 'c': b.bufcount = atoi(optarg); break;
+            case 'w': b.dir = optarg; break;
+            case 'k': b.keep = 1; break;
+            case 'd':
+                for(i = 0; dist_names[i]; i++)
+                    if(strcmp(optarg, dist_names[i]) == 0)
+                        break;
+                if(!dist_names[i]) {
+                    fprintf(stderr, "unknown distribution: %s\n", optarg);
+                    exit(1);
+                }
+                b.dist = (enum dist) i;
+                break;
+            default:
+                usage(argv[0]);
+                exit(c == 'h' ? 0 : 1);
+        }
+    }
+
+    /* the merge stage only copies whole records */
+    b.size -= b.size % RECLEN;
+    b.bufsize -= b.bufsize % RECLEN;
+
+    if(optind != argc || b.size == 0 || b.bufsize == 0 || b.bufcount < 1) {
+        usage(argv[0]);
+        exit(1);
+    }
+
+
+    if(b.param < 0)
+        b.param = b.dist == DIST_POISSON ? 4.0 : 1e15;
+
+    printf("{\"benchmark\": \"sort-bench\", \"bytes\": %llu, "
+            "\"records\": %llu, \"distribution\": \"%s\", \"param\": %g, "
+            "\"seed\": %llu, \"bufsize\": %llu, \"bufcount\": %u, "
+            "\"results\": [", (unsigned long long) b.size,
+            (unsigned long long) (b.size / RECLEN), dist_names[b.dist],
+            b.param, (unsigned long long) b.seed,
+            (unsigned long long) b.bufsize, b.bufcount);
+    fflush(stdout);
+
+    generate(&b, path(&b, "sort-bench.in"));
+
+    run_pass(&b, "sort", build_sort);
+    out.file = path(&b, "sort-bench-sort.out");
+    out.offset = 0;
+    out.length = -1;
+    ok &= verify(&b, "verify-sort", &out, 1, b.bufsize);
+
+    run_pass(&b, "pass1", build_pass1);
+    runfile = strdup(path(&b, "sort-bench.runs"));
+    fd = open(runfile, O_RDONLY);
+    b.runs = fd < 0 ? -1 : fg_runfile_read_dir(fd, &dir);
+    if(fd >= 0)
+        close(fd);
+    if(b.runs < 0) {
+        fprintf(stderr, "pass1 left no run file\n");
+        exit(1);
+    }
+
+    runs = (struct segment *) calloc(b.runs + 1, sizeof(struct segment));
+    for(i = 0; i < b.runs; i++) {
+        runs[i].file = runfile;
+        runs[i].offset = dir[i].offset;
+        runs[i].length = dir[i].length;
+    }
+    ok &= verify(&b, "verify-pass1", runs, b.runs, b.bufsize);
+
+    run_pass(&b, "pass2", build_pass2);
+    out.file = path(&b, "sort-bench.out");
+    ok &= verify(&b, "verify-pass2", &out, 1, b.size);
+
+    printf("\n], \"ok\": %s}\n", ok ? "true" : "false");
+
+    if(!b.keep) {
+        unlink(runfile);
+        unlink(path(&b, "sort-bench.in"));
+        unlink(path(&b, "sort-bench-sort.out"));
+        unlink(path(&b, "sort-bench.out"));
+    }
+
+    free(runs);
+    free(dir);
+    free(runfile);
+
+    return ok ? 0 : 1;
+}
+
+void usage(const char *argv0)
+{
+    int i;
+
+    printf("Usage: %s [-s size] [-d distribution] [-p param] [-S seed]\n"
+            "          [-b bufsize] [-c bufcount] [-w dir] [-k]\n", argv0);
+    printf("  -s  dataset size, with an optional K, M or G suffix "
+            "(default 256M)\n");
+    printf("  -d  key distribution:");
+    for(i = 0; dist_names[i]; i++)
+        printf(" %s", dist_names[i]);
+    printf("\n      (default uniform)\n");
+    printf("  -p  standard deviation for normal keys (default 1e15), "
+            "lambda for\n      poisson keys (default 4)\n");
+    printf("  -S  seed (default 1)\n");
+    printf("  -b  buffer size, and so run length (default 8M)\n");
+    printf("  -c  buffers per source pin (default 4)\n");
+    printf("  -w  directory for the data files (default .)\n");
+    printf("  -k  keep the data files\n");
+}
+
+uint64_t parse_size(const char *s)
+{
+    char *end;
+    uint64_t n;
+
+    n = strtoull(s, &end, 0);
+    switch(*end) {
+        case 'G': case 'g': n <<= 10;   /* fall through */
+        case 'M': case 'm': n <<= 10;   /* fall through */
+        case 'K': case 'k': n <<= 10;
+    }
+
+    return n;
+}
+
+/* Each record's key depends only on the seed and the record's index, never
+ * on what was generated before it, so datasets are the same however they
+ * are written out. */
+int64_t gen_key(struct bench *b, uint64_t i)
+{
+    switch(b->dist) {
+        case DIST_ZERO:
+            return 0;
+        case DIST_SORTED:
+            return (int64_t) i;
+        case DIST_REVERSE:
+            return -(int64_t) i;
+        case DIST_NORMAL:
+            return (int64_t) (fg_rand_normal(b->seed, i) * b->param);
+        case DIST_POISSON:
+            return fg_rand_poisson(b->seed, i, b->param);
+        default:
+            return (int64_t) fg_rand_u64(b->seed, i);
+    }
+}
+
+/* records are identified by key and index, so the sum of their hashes
+ * doesn't depend on order but does notice a lost, duplicated or mangled
+ * record */
+uint64_t rec_hash(const char *rec)
+{
+    return fg_rand_mix(*((uint64_t *) rec)
+            ^ fg_rand_mix(*((uint64_t *) (rec + KEYLEN))));
+}
+
+void generate(struct bench *b, const char *filename)
+{
+    char *chunk, *rec;
+    uint64_t i, n, start;
+    size_t len;
+    int fd;
+
+    fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(fd < 0) {
+        perror(filename);
+        exit(1);
+    }
+
+    chunk = (char *) malloc(GEN_CHUNK);
+    n = b->size / RECLEN;
+    b->checksum = 0;
+    start = fg_now_ns();
+
+    for(i = 0; i < n; ) {
+        for(len = 0; len < GEN_CHUNK && i < n; len += RECLEN, i++) {
+            rec = chunk + len;
+            *((int64_t *) rec) = gen_key(b, i);
+            memset(rec + KEYLEN, (int) (i & 0xff), RECLEN - KEYLEN);
+            *((uint64_t *) (rec + KEYLEN)) = i;
+            b->checksum += rec_hash(rec);
+        }
+
+        if(write(fd, chunk, len) != (ssize_t) len) {
+            perror(filename);
+            exit(1);
+        }
+    }
+
+    close(fd);
+    free(chunk);
+
+    printf("%s\n  {\"name\": \"generate\", \"seconds\": %.3f, "
+            "\"mb_per_s\": %.1f}", first_result ? "" : ",",
+            (fg_now_ns() - start) / 1e9,
+            b->size / ((fg_now_ns() - start) / 1e9) / (1024 * 1024));
+    first_result = 0;
+    fflush(stdout);
+}
+
+/* a file in the data directory; the result is only good until the next
+ * call */
+char *path(struct bench *b, const char *name)
+{
+    static char buf[BUFSIZ];
+
+    snprintf(buf, sizeof(buf), "%s/%s", b->dir, name);
+    return buf;
+}
+
+/* Runs a pass in a child process, so its peak RSS is its own and nothing
+ * one pass leaves behind (threads, buffers, loaded modules) skews the next.
+ * The child sends back its run time and stage statistics through a pipe. */
+void run_pass(struct bench *b, const char *name,
+        FG_network *(*build)(struct bench *b))
+{
+    FG_network *nw;
+    struct rusage ru;
+    FILE *f;
+    char buf[BUFSIZ];
+    char *stats = NULL;
+    size_t stats_len = 0;
+    FILE *s;
+    unsigned long long run_ns = 0;
+    int fds[2];
+    int status, failed;
+    pid_t pid;
+    ssize_t n;
+
+    if(pipe(fds) < 0) {
+        perror("pipe");
+        exit(1);
+    }
+
+    fflush(stdout);
+    pid = fork();
+    if(pid < 0) {
+        perror("fork");
+        exit(1);
+    }
+
+    if(pid == 0) {
+        close(fds[0]);
+        f = fdopen(fds[1], "w");
+
+        fg_init(&main_argc, &main_argv);
+        if(!getenv("FG_LOG"))
+            fg_log_set_domains(0);
+
+        nw = build(b);
+        if(!nw || fg_network_fix(nw) != 0) {
+            fprintf(stderr, "%s: failed to build network\n", name);
+            _exit(1);
+        }
+
+        fg_network_set_print_stats(nw, 0);
+        fg_network_run(nw);
+        print_stats(f, nw);
+        fclose(f);
+
+        failed = fg_network_failed(nw);
+        fg_network_destroy(nw);
+        fg_fini();
+        _exit(failed);
+    }
+
+    close(fds[1]);
+    s = open_memstream(&stats, &stats_len);
+    while((n = read(fds[0], buf, sizeof(buf))) > 0)
+        fwrite(buf, 1, n, s);
+    fclose(s);
+    close(fds[0]);
+
+    if(wait4(pid, &status, 0, &ru) < 0 || !WIFEXITED(status)
+            || WEXITSTATUS(status) != 0 || sscanf(stats, "%llu", &run_ns) != 1
+            || run_ns == 0) {
+        fprintf(stderr, "%s failed\n", name);
+        exit(1);
+    }
+
+    printf(",\n  {\"name\": \"%s\", \"seconds\": %.3f, \"mb_per_s\": %.1f, "
+            "\"peak_rss_kb\": %ld, \"stages\": %s}", name, run_ns / 1e9,
+            b->size / (run_ns / 1e9) / (1024 * 1024), ru.ru_maxrss,
+            strchr(stats, '['));
+    fflush(stdout);
+
+    free(stats);
+}
+
+/* the run time on the first line, then the stages as a JSON array */
+void print_stats(FILE *f, FG_network *nw)
+{
+    FG_network_stats *stats;
+    FG_stage_stats *ss;
+    FG_pin_stats *ps;
+    int i, j;
+
+    stats = fg_network_get_stats(nw);
+    fprintf(f, "%llu\n[", (unsigned long long) stats->run_ns);
+
+    for(i = 0; i < stats->stage_count; i++) {
+        ss = stats->stages + i;
+        fprintf(f, "%s\n    {\"name\": \"%s\", \"calls\": %llu, "
+                "\"func_ns\": %llu, \"starved_ns\": %llu, "
+                "\"backpressure_ns\": %llu, \"pins\": [", i ? "," : "",
+                ss->name, (unsigned long long) ss->func_calls,
+                (unsigned long long) ss->func_ns,
+                (unsigned long long) ss->starved_ns,
+                (unsigned long long) ss->backpressure_ns);
+
+        for(j = 0; j < ss->pin_count; j++) {
+            ps = ss->pins + j;
+            fprintf(f, "%s{\"name\": \"%s\", \"dir\": \"%s\", "
+                    "\"buffers\": %llu, \"bytes\": %llu}", j ? ", " : "",
+                    ps->name, ps->direction ? "out" : "in",
+                    (unsigned long long) ps->buffers,
+                    (unsigned long long) ps->bytes);
+        }
+
+        fprintf(f, "]}");
+    }
+
+    fprintf(f, "]");
+    fg_network_stats_free(stats);
+}
+
+FG_network *build_sort(struct bench *b)
+{
+    FG_network *nw;
+    FG_stage *rs, *ss, *ws;
+
+    nw = fg_network_create("sort", b->bufcount, b->bufsize);
+
+    rs = fg_stage_create(nw, "read-file", "read");
+    ss = fg_stage_create(nw, "sort", "sort");
+    ws = fg_stage_create(nw, "write-file", "write");
+    if(!rs || !ss || !ws)
+        return NULL;
+
+    fg_stage_set_param(rs, "filename", path(b, "sort-bench.in"));
+    fg_stage_set_param(ws, "filename", path(b, "sort-bench-sort.out"));
+
+    fg_pin_connect(rs, "data_out", ss, "data_in");
+    fg_pin_connect(ss, "data_out", ws, "data_in");
+
+    return nw;
+}
+
+FG_network *build_pass1(struct bench *b)
+{
+    FG_network *nw;
+    FG_stage *rs, *ss, *ws;
+
+    nw = fg_network_create("dsort-pass1", b->bufcount, b->bufsize);
+
+    rs = fg_stage_create(nw, "read-file", "read");
+    ss = fg_stage_create(nw, "sort", "sort");
+    ws = fg_stage_create(nw, "run-writer", "write");
+    if(!rs || !ss || !ws)
+        return NULL;
+
+    fg_stage_set_param(rs, "filename", path(b, "sort-bench.in"));
+    fg_stage_set_param(ws, "filename", path(b, "sort-bench.runs"));
+
+    fg_pin_connect(rs, "data_out", ss, "data_in");
+    fg_pin_connect(ss, "data_out", ws, "data_in");
+
+    return nw;
+}
+
+/* As bin/dsort-pass2.c does, a connection of the run reader per run feeds
+ * the merge. */
+FG_network *build_pass2(struct bench *b)
+{
+    FG_network *nw;
+    FG_stage *ms, *rs, *ws;
+    FG_pin *pin;
+    int i;
+
+    nw = fg_network_create("dsort-pass2", b->bufcount, b->bufsize);
+
+    rs = fg_stage_create(nw, "run-reader", "read");
+    ms = fg_stage_create(nw, "merge", "merge");
+    ws = fg_stage_create(nw, "write-file", "write");
+    if(!rs || !ms || !ws)
+        return NULL;
+
+    fg_stage_set_param(rs, "filename", path(b, "sort-bench.runs"));
+    fg_stage_set_param(rs, "reclen", "64");
+    fg_stage_set_param(ws, "filename", path(b, "sort-bench.out"));
+
+    for(i = 0; i < b->runs; i++)
+        fg_pin_connect(rs, "data_out", ms, "data_in");
+    fg_pin_connect(ms, "data_out", ws, "data_in");
+
+    pin = fg_stage_pin_get_by_name(rs, "buf_in");
+    fg_pin_set_buffer_size(pin, b->bufsize < RUN_READ_SIZE ? b->bufsize
+            : RUN_READ_SIZE);
+    fg_pin_set_buffer_count(pin, 2 * b->runs);
+
+    pin = fg_stage_pin_get_by_name(ms, "buf_in");
+    fg_pin_set_buffer_count(pin, 2);
+
+    return nw;
+}
+
+/* Checks that keys never decrease within each run of run_len bytes, over
+ * the segments taken in order, each of which starts a run too, and that
+ * they hold the records generated.  Prints the result and returns whether
+ * it passed. */
+int verify(struct bench *b, const char *name, struct segment *segs,
+        int count, uint64_t run_len)
+{
+    char *buffer;
+    uint64_t checksum = 0, offset = 0, errors = 0, start, run_start;
+    int64_t cur_key = INT64_MIN, new_key;
+    ssize_t n, i;
+    off_t pos, left;
+    int fd, f;
+
+    buffer = (char *) malloc(GEN_CHUNK);
+    start = fg_now_ns();
+
+    for(f = 0; f < count; f++) {
+        fd = open(segs[f].file, O_RDONLY);
+        if(fd < 0) {
+            perror(segs[f].file);
+            errors++;
+            continue;
+        }
+
+        run_start = offset;
+        pos = segs[f].offset;
+        left = segs[f].length;
+
+        /* GEN_CHUNK is a multiple of RECLEN, and so is every segment */
+        while(left != 0 && (n = pread(fd, buffer, left > 0 && left < GEN_CHUNK
+                        ? left : GEN_CHUNK, pos)) > 0) {
+            pos += n;
+            if(left > 0)
+                left -= n;
+
+            for(i = 0; i + RECLEN <= n; i += RECLEN, offset += RECLEN) {
+                if((offset - run_start) % run_len == 0)
+                    cur_key = INT64_MIN;
+
+                new_key = *((int64_t *) (buffer + i));
+                if(new_key < cur_key && errors++ == 0)
+                    fprintf(stderr, "%s: ERROR @ %llu of %s\n", name,
+                            (unsigned long long) offset, segs[f].file);
+
+                cur_key = new_key;
+                checksum += rec_hash(buffer + i);
+            }
+        }
+
+        close(fd);
+    }
+
+    free(buffer);
+
+    if(offset != b->size || checksum != b->checksum) {
+        fprintf(stderr, "%s: %llu bytes, expected %llu; checksum %s\n", name,
+                (unsigned long long) offset, (unsigned long long) b->size,
+                checksum == b->checksum ? "matches" : "differs");
+        errors++;
+    }
+
+    printf(",\n  {\"name\": \"%s\", \"seconds\": %.3f, \"mb_per_s\": %.1f, "
+            "\"ok\": %s}", name, (fg_now_ns() - start) / 1e9,
+            offset / ((fg_now_ns() - start) / 1e9) / (1024 * 1024),
+            errors ? "false" : "true");
+    fflush(stdout);
+
+    return errors == 0;
+}
@@ -9,6 +9,7 @@
 int main(int argc, char *argv[])
 {
     FG_network *nw;
+    int failed;
 
     /* unbuffered stdout makes debugging easier */
     setbuf(stdout, NULL);
@@ -18,10 +19,11 @@ int main(int argc, char *argv[])
     nw = fg_network_from_config("test network", argv[1]);
     fg_network_fix(nw);
     fg_network_run(nw);
+    failed = fg_network_failed(nw);
     fg_network_destroy(nw);
 
     fg_fini();
 
-    return 0;
+    return failed;
 }
 
@@ -133,8 +133,8 @@ void calc_splitters(splitter *splitters, const char *filename, int rank,
     int fd;
     struct stat sbuf;
     long file_size;
-    int nrecs;
-    int i, idx;
+    int64_t nrecs, idx;
+    int i;
 
     fd = open(filename, O_RDONLY);
 
@@ -149,9 +149,10 @@ void calc_splitters(splitter *splitters, const char *filename, int rank,
     nrecs = file_size / reclen;
 
     for(i=0; i<os_ratio; i++) {
-        idx = random() % nrecs;
-        lseek(fd, idx * reclen, SEEK_SET);
-        read(fd, &(splitters + i)->key, keylen);
+        /* random() gives only 31 bits, too few to reach every record of a
+         * big file */
+        idx = (((int64_t) random() << 31) | random()) % nrecs;
+        pread(fd, &(splitters + i)->key, keylen, idx * (off_t) reclen);
         (splitters + i)->proc = rank;
         (splitters + i)->index = idx;
         /* printf("splitter %d: %ld (%016lx) @ %ld, %ld\n", i,
@@ -161,8 +162,8 @@ void calc_splitters(splitter *splitters, const char *filename, int rank,
 
     close(fd);
 
-    printf("read %ld bytes (%d records) from %s\n", file_size, nrecs,
-            filename);
+    printf("read %ld bytes (%lld records) from %s\n", file_size,
+            (long long) nrecs, filename);
 }
 
 void scatter_splitters(splitter *splitters, int os_ratio)
@@ -6,9 +6,11 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <sys/stat.h>
 
 #include "FG.h"
+#include "fg_runfile.h"
 
 #define succeed_or_bail(x) if(!x) { fprintf(stderr, "Aborting @ %s:%d\n", __FILE__, __LINE__); exit(1); }
 
@@ -23,7 +25,7 @@ int main(int argc, char *argv[])
     char cfg_filename[BUFSIZ];
     char filename[BUFSIZ];
     FILE *f;
-    int n;
+    int n, fd;
 
     /* unbuffered stdout makes debugging multithreaded code easier */
     setbuf(stdout, NULL);
@@ -59,9 +61,9 @@ int main(int argc, char *argv[])
     s = fg_network_get_stage_by_name(nw, "scatter");
     fg_stage_set_param(s, "splitter_filename", splitter_filename);
 
-    snprintf(buf, sizeof(buf), "%d-%%d.out", rank);
+    snprintf(buf, sizeof(buf), "%d.runs", rank);
     s = fg_network_get_stage_by_name(nw, "w");
-    fg_stage_set_param(s, "filename_fmt", buf);
+    fg_stage_set_param(s, "filename", buf);
 
     printf("\n");
 
@@ -80,13 +82,15 @@ int main(int argc, char *argv[])
         exit(1);
     }
 
-    /* count number of files (sorted runs) produced on this node */
-    n = 0;
-    do {
-        sprintf(filename, "%d-%d.out", rank, n);
-        n++;
-    } while(access(filename, F_OK) == 0);
-    n--;
+    /* count the sorted runs produced on this node */
+    sprintf(filename, "%d.runs", rank);
+    fd = open(filename, O_RDONLY);
+    n = fd < 0 ? -1 : fg_runfile_read_dir(fd, NULL);
+    if(n < 0) {
+        fprintf(stderr, "cannot read runs from %s\n", filename);
+        exit(1);
+    }
+    close(fd);
 
     /* generate config file for pass 2 on this node */
     snprintf(cfg_filename, sizeof(cfg_filename), "pass2-%d.fcg", rank);
@@ -94,13 +98,13 @@ int main(int argc, char *argv[])
     fprintf(f, "stage merge m\n"
                "stage write-file w\n"
                "set w.filename %d.out\n"
-               "loop %d stage read-file r$\n"
-               "loop %d set r$.filename %d-$.out\n"
-               "loop %d stage sort s$\n"
-               "loop %d connect r$.data_out s$.data_in\n"
-               "loop %d connect s$.data_out m.data_in\n"
+               "stage run-reader r\n"
+               "set r.filename %d.runs\n"
+               "set r.reclen 64\n"
+               "set_bufcount r.buf_in %d\n"
+               "loop %d connect r.data_out m.data_in\n"
                "connect m.data_out w.data_in\n",
-               rank, n, n, rank, n, n, n);
+               rank, rank, 2 * n, n);
     fclose(f);
 
     return 0;
@@ -16,7 +16,7 @@ int main(int argc, char *argv[])
     FG_network *nw;
     FG_stage *read_stage, *sort_stage0, *scatter_stage;
     FG_stage *gather_stage, *sort_stage1, *write_stage;
-    int rc;
+    int rc, failed;
     int rank;
     char buf[BUFSIZ];
     char splitter_filename[BUFSIZ];
@@ -60,10 +60,11 @@ int main(int argc, char *argv[])
     sort_stage1 = fg_stage_create(nw, "sort", "sort");
     succeed_or_bail(sort_stage1);
 
-    snprintf(buf, sizeof(buf), "%d-%%d.out", rank);
-    write_stage = fg_stage_create(nw, "multiwrite-file", "write");
+    /* every buffer is a sorted run; they all go in one run file */
+    snprintf(buf, sizeof(buf), "%d.runs", rank);
+    write_stage = fg_stage_create(nw, "run-writer", "write");
     succeed_or_bail(write_stage);
-    fg_stage_set_param(write_stage, "filename_fmt", buf);
+    fg_stage_set_param(write_stage, "filename", buf);
 
     printf("\n");
 
@@ -78,6 +79,7 @@ int main(int argc, char *argv[])
     printf("\n");
     fg_network_fix(nw);
     fg_network_run(nw);
+    failed = fg_network_failed(nw);
     fg_network_destroy(nw);
 
     /* clean up */
@@ -89,6 +91,6 @@ int main(int argc, char *argv[])
         exit(1);
     }
 
-    return 0;
+    return failed;
 }
 
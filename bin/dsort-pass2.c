@@ -4,22 +4,24 @@
 
 #include <stdio.h>
 #include <stdlib.h>
-#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 #include "FG.h"
+#include "fg_runfile.h"
 
 #define succeed_or_bail(x) if(!x) { fprintf(stderr, "Aborting @ %s:%d\n", __FILE__, __LINE__); exit(1); }
 
 int main(int argc, char *argv[])
 {
     FG_network *nw;
-    FG_stage *ms, *rs, *ws, *ss;
+    FG_stage *ms, *rs, *ws;
     FG_pin *pin;
     int rank;
-    int i;
+    int i, fd, failed;
+    int64_t runs;
     char buf[BUFSIZ];
     char in_filename[BUFSIZ];
-    struct stat sbuf;
 
     rank = atoi(argv[1]);
 
@@ -30,6 +32,16 @@ int main(int argc, char *argv[])
 
     fg_init(&argc, &argv);
 
+    /* the runs pass 1 wrote, sorted already */
+    snprintf(in_filename, sizeof(in_filename), "%d.runs", rank);
+    fd = open(in_filename, O_RDONLY);
+    runs = fd < 0 ? -1 : fg_runfile_read_dir(fd, NULL);
+    if(runs < 0) {
+        fprintf(stderr, "cannot read runs from %s\n", in_filename);
+        exit(1);
+    }
+    close(fd);
+
     /* instantiate network and stages */
     nw = fg_network_create("nw", 3, 8 * 1024 * 1024);
     succeed_or_bail(nw);
@@ -38,45 +50,41 @@ int main(int argc, char *argv[])
     succeed_or_bail(ms);
 
     snprintf(buf, sizeof(buf), "%d.out", rank);
-    ws = fg_stage_create(nw, "write-file", "write");
+    ws = fg_stage_create(nw, "write-behind-file", "write");
     succeed_or_bail(ws);
     fg_stage_set_param(ws, "filename", buf);
 
-    i = 0;
-    snprintf(in_filename, sizeof(in_filename), "%d-%d.out", rank, i);
-    while(stat(in_filename, &sbuf) == 0) {
-        snprintf(buf, sizeof(buf), "read-part%d", i);
-        rs = fg_stage_create(nw, "read-file", buf);
-        succeed_or_bail(rs);
-        fg_stage_set_param(rs, "filename", in_filename);
+    rs = fg_stage_create(nw, "run-reader", "read");
+    succeed_or_bail(rs);
+    fg_stage_set_param(rs, "filename", in_filename);
+    fg_stage_set_param(rs, "reclen", "64");
 
-        snprintf(buf, sizeof(buf), "sort-part%d", i);
-        ss = fg_stage_create(nw, "sort", buf);
-        succeed_or_bail(ss);
-
-        fg_pin_connect(rs, "data_out", ss, "data_in");
-        fg_pin_connect(ss, "data_out", ms, "data_in");
-
-        i++;
-        snprintf(in_filename, sizeof(in_filename), "%d-%d.out", rank, i);
-    }
+    /* a connection per run; run i arrives on merge.data_in[i] */
+    for(i = 0; i < runs; i++)
+        fg_pin_connect(rs, "data_out", ms, "data_in");
 
     /* connect stages */
     fg_pin_connect(ms, "data_out", ws, "data_in");
 
-    /* set buffer counts and sizes */
+    /* set buffer counts and sizes: two per run, so the next piece of a run
+     * is read while the merge works through the last */
+    pin = fg_stage_pin_get_by_name(rs, "buf_in");
+    fg_pin_set_buffer_count(pin, 2 * runs);
+
+    /* and enough merge output that write-behind-file can have its depth (4)
+     * of writes outstanding while the merge fills the rest */
     pin = fg_stage_pin_get_by_name(ms, "buf_in");
-    fg_pin_set_buffer_size(pin, 256 * 1024 * 1024);
-    fg_pin_set_buffer_count(pin, 2);
+    fg_pin_set_buffer_size(pin, 64 * 1024 * 1024);
+    fg_pin_set_buffer_count(pin, 8);
 
     /* run network */
     fg_network_fix(nw);
     fg_network_run(nw);
+    failed = fg_network_failed(nw);
     fg_network_destroy(nw);
 
     /* clean up */
     fg_fini();
 
-    return 0;
+    return failed;
 }
-
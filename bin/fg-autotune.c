@@ -0,0 +1,610 @@
+/*
+ * fg-autotune.c
+ *
+ * Offline tuner for buffer counts and sizes.  Builds a network from a config
+ * file and runs it, reads each run's stage statistics to see which source
+ * pins' stages wait for buffers and which pins' consumers wait for data,
+ * adjusts those pins first, keeps what runs faster, and prints the result as
+ * set_bufsize and set_bufcount lines that can be pasted into the config
+ * file.
+ *
+ * Usage: fg-autotune [options] config-file
+ *
+ * Each trial rebuilds the network from scratch, so the config file (plus any
+ * -P overrides) should point the network at a small sample input.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+
+#include "fg_internal.h"
+
+/* HACK: magic numbers! */
+#define MAX_PINS 64
+#define MAX_OVERRIDES 32
+#define MAX_EXCLUDES 32
+
+struct tuned_pin {
+    char *stage_name;
+    char *pin_name;
+    uint64_t bufsize;
+    uint32_t bufcount;
+};
+
+/* what a trial's statistics say about a tuned pin, as fractions of the run:
+ * how long its stage waited for empty buffers to come back (back pressure),
+ * and how long the stages it feeds waited for data (starvation) */
+struct pin_signals {
+    double backpressure;
+    double starved;
+};
+
+/* one adjustment to try, ranked by score */
+struct move {
+    int pin;
+    uint64_t bufsize;
+    uint32_t bufcount;
+    double score;
+};
+
+static struct {
+    const char *cfg_filename;
+    char *overrides[MAX_OVERRIDES];     /* "stage.param=value" */
+    int override_count;
+    char *excludes[MAX_EXCLUDES];       /* "stage.pin" */
+    int exclude_count;
+    uint64_t mem_budget;                /* 0 = unlimited */
+    uint64_t min_size, max_size;
+    uint32_t min_count, max_count;
+    uint32_t align;
+    int reps;
+    int steps;
+    int verbose;
+
+    struct tuned_pin pins[MAX_PINS];
+    struct pin_signals signals[MAX_PINS];   /* of the best trial so far */
+    int pin_count;
+    int trial_count;
+} at;
+
+void usage(const char *progname);
+uint64_t parse_size(const char *s);
+FG_network *build_network(void);
+int is_excluded(const char *stage_name, const char *pin_name);
+void find_source_pins(void);
+uint64_t memory_footprint(void);
+int find_moves(struct move *moves);
+int compare_moves(const void *a, const void *b);
+double run_trial(struct pin_signals *signals);
+double timed_run(struct pin_signals *signals);
+void collect_signals(FG_network *nw, struct pin_signals *signals);
+void quiet(int on);
+
+int main(int argc, char *argv[])
+{
+    struct move moves[4 * MAX_PINS];
+    struct pin_signals signals[MAX_PINS];
+    struct tuned_pin *tp;
+    uint64_t old_size, undo_size = 0;
+    uint32_t old_count, undo_count = 0;
+    double t, best_time, baseline;
+    int c, i, m, step, nmoves, kept, undo_pin = -1;
+
+    at.min_size = 4096;
+    at.max_size = 256 * 1024 * 1024;
+    at.min_count = 1;
+    at.max_count = 16;
+    at.align = 64;
+    at.reps = 3;
+    at.steps = 16;
+
+    while((c = getopt(argc, argv, "m:s:S:c:C:a:r:p:P:x:vh")) != -1) {
+        switch(c) {
+            case 'm': at.mem_budget = parse_size(optarg); break;
+            case 's': at.min_size = parse_size(optarg); break;
+            case 'S': at.max_size = parse_size(optarg); break;
+            case 'c': at.min_count = atoi(optarg); break;
+            case 'C': at.max_count = atoi(optarg); break;
+            case 'a': at.align = parse_size(optarg); break;
+            case 'r': at.reps = atoi(optarg); break;
+            case 'p': at.steps = atoi(optarg); break;
+            case 'P':
+                if(at.override_count == MAX_OVERRIDES) {
+                    fprintf(stderr, "too many -P options\n");
+                    exit(1);
+                }
+                at.overrides[at.override_count++] = optarg;
+                break;
+            case 'x':
+                if(at.exclude_count == MAX_EXCLUDES) {
+                    fprintf(stderr, "too many -x options\n");
+                    exit(1);
+                }
+                at.excludes[at.exclude_count++] = optarg;
+                break;
+            case 'v': at.verbose = 1; break;
+            default:
+                usage(argv[0]);
+                exit(c == 'h' ? 0 : 1);
+        }
+    }
+
+    if(optind >= argc || at.min_count == 0 || at.align == 0 || at.reps <= 0
+            || at.min_size > at.max_size || at.min_count > at.max_count) {
+        usage(argv[0]);
+        exit(1);
+    }
+    at.cfg_filename = argv[optind];
+
+    fg_init(&argc, &argv);
+
+    /* the starting point is whatever the config file asks for */
+    find_source_pins();
+    if(at.pin_count == 0) {
+        fprintf(stderr, "no tunable source pins found in %s\n",
+                at.cfg_filename);
+        exit(1);
+    }
+
+    if(at.mem_budget && memory_footprint() > at.mem_budget)
+        fprintf(stderr, "warning: starting configuration uses %llu bytes, "
+                "over the %llu byte budget\n",
+                (unsigned long long) memory_footprint(),
+                (unsigned long long) at.mem_budget);
+
+    baseline = run_trial(at.signals);
+    if(baseline < 0) {
+        fprintf(stderr, "baseline trial failed\n");
+        exit(1);
+    }
+    best_time = baseline;
+    fprintf(stderr, "baseline: %.3f s\n", baseline);
+
+    /* Each step tries adjustments in the order the best trial's statistics
+     * rank them and keeps the first that runs faster: more buffers for a
+     * pin whose stage waited for them, bigger buffers for a pin whose
+     * consumers waited for its stage, and only then fewer or smaller
+     * buffers, which free memory and may cost nothing.  The statistics
+     * choose what to try; wall-clock time alone decides what is kept.  The
+     * move that would undo the last one kept is left out, so noise in the
+     * timings can't send the search back and forth. */
+    for(step = 0; step < at.steps; step++) {
+        nmoves = find_moves(moves);
+        qsort(moves, nmoves, sizeof(struct move), compare_moves);
+
+        kept = 0;
+        for(m = 0; m < nmoves && !kept; m++) {
+            if(moves[m].pin == undo_pin && moves[m].bufsize == undo_size
+                    && moves[m].bufcount == undo_count)
+                continue;
+
+            tp = at.pins + moves[m].pin;
+            old_size = tp->bufsize;
+            old_count = tp->bufcount;
+            tp->bufsize = moves[m].bufsize;
+            tp->bufcount = moves[m].bufcount;
+
+            t = run_trial(signals);
+            if(t < 0) {
+                fprintf(stderr, "  %s.%s %u x %llu: failed\n",
+                        tp->stage_name, tp->pin_name, tp->bufcount,
+                        (unsigned long long) tp->bufsize);
+            } else {
+                fprintf(stderr, "  %s.%s %u x %llu: %.3f s (waited for "
+                        "buffers %.0f%%, consumers starved %.0f%%)%s\n",
+                        tp->stage_name, tp->pin_name, tp->bufcount,
+                        (unsigned long long) tp->bufsize, t,
+                        signals[moves[m].pin].backpressure * 100,
+                        signals[moves[m].pin].starved * 100,
+                        t < best_time ? ", kept" : "");
+            }
+
+            if(t >= 0 && t < best_time) {
+                best_time = t;
+                memcpy(at.signals, signals, sizeof(signals));
+                undo_pin = moves[m].pin;
+                undo_size = old_size;
+                undo_count = old_count;
+                kept = 1;
+            } else {
+                tp->bufsize = old_size;
+                tp->bufcount = old_count;
+            }
+        }
+
+        if(!kept)
+            break;
+    }
+
+    printf("# fg-autotune: %d trials, best %.3f s (baseline %.3f s), "
+            "%llu bytes of buffers\n", at.trial_count, best_time, baseline,
+            (unsigned long long) memory_footprint());
+    for(i = 0; i < at.pin_count; i++) {
+        printf("set_bufsize %s.%s %llu\n", at.pins[i].stage_name,
+                at.pins[i].pin_name, (unsigned long long) at.pins[i].bufsize);
+        printf("set_bufcount %s.%s %u\n", at.pins[i].stage_name,
+                at.pins[i].pin_name, at.pins[i].bufcount);
+    }
+
+    fg_fini();
+
+    return 0;
+}
+
+void usage(const char *progname)
+{
+    printf("usage: %s [options] config-file\n", progname);
+    printf("  -m bytes        memory budget for all tuned buffers\n");
+    printf("  -s/-S bytes     smallest/largest buffer size to try\n");
+    printf("  -c/-C n         smallest/largest buffer count to try\n");
+    printf("  -a bytes        buffer sizes must be a multiple of this "
+            "(default 64)\n");
+    printf("  -r n            runs per trial; the median is used "
+            "(default 3)\n");
+    printf("  -p n            maximum number of adjustments kept "
+            "(default 16)\n");
+    printf("  -P s.p=value    set parameter p of stage s, eg to point the "
+            "network at sample input\n");
+    printf("  -x s.p          leave pin p of stage s alone\n");
+    printf("  -v              show output of the network during trials\n");
+    printf("sizes accept K, M and G suffixes\n");
+}
+
+uint64_t parse_size(const char *s)
+{
+    char *end;
+    uint64_t n;
+
+    n = strtoull(s, &end, 0);
+    switch(*end) {
+        case 'k': case 'K': n <<= 10; break;
+        case 'm': case 'M': n <<= 20; break;
+        case 'g': case 'G': n <<= 30; break;
+    }
+
+    return n;
+}
+
+FG_network *build_network(void)
+{
+    FG_network *nw;
+    FG_stage *stage;
+    FG_pin *pin;
+    char buf[BUFSIZ];
+    char *param, *value;
+    int i;
+
+    nw = fg_network_from_config("autotune", at.cfg_filename);
+    if(!nw)
+        return NULL;
+
+    for(i = 0; i < at.override_count; i++) {
+        snprintf(buf, sizeof(buf), "%s", at.overrides[i]);
+        value = strchr(buf, '=');
+        if(value)
+            *value++ = '\0';
+        param = strrchr(buf, '.');
+        if(!value || !param) {
+            fprintf(stderr, "bad parameter override %s\n", at.overrides[i]);
+            exit(1);
+        }
+        *param++ = '\0';
+
+        stage = fg_network_get_stage_by_name(nw, buf);
+        if(!stage || fg_stage_set_param(stage, param, value) != 0) {
+            fprintf(stderr, "cannot set %s\n", at.overrides[i]);
+            exit(1);
+        }
+    }
+
+    for(i = 0; i < at.pin_count; i++) {
+        stage = fg_network_get_stage_by_name(nw, at.pins[i].stage_name);
+        pin = stage ? fg_stage_pin_get_by_name(stage, at.pins[i].pin_name)
+                    : NULL;
+        if(!pin) {
+            fprintf(stderr, "no pin %s.%s\n", at.pins[i].stage_name,
+                    at.pins[i].pin_name);
+            exit(1);
+        }
+        fg_pin_set_buffer_size(pin, at.pins[i].bufsize);
+        fg_pin_set_buffer_count(pin, at.pins[i].bufcount);
+    }
+
+    return nw;
+}
+
+int is_excluded(const char *stage_name, const char *pin_name)
+{
+    char buf[BUFSIZ];
+    int i;
+
+    snprintf(buf, sizeof(buf), "%s.%s", stage_name, pin_name);
+    for(i = 0; i < at.exclude_count; i++) {
+        if(strcmp(buf, at.excludes[i]) == 0)
+            return 1;
+    }
+
+    return 0;
+}
+
+/* source pins (unconnected input pins) are the ones that own buffers */
+void find_source_pins(void)
+{
+    FG_network *nw;
+    FG_stage **stage;
+    FG_pin **pin;
+    struct tuned_pin *tp;
+
+    quiet(1);
+    nw = build_network();
+    quiet(0);
+    if(!nw)
+        exit(1);
+
+    for(stage = nw->stages; *stage; stage++) {
+        for(pin = (*stage)->pins; *pin; pin++) {
+            if((*pin)->direction != PIN_IN || (*pin)->queue)
+                continue;
+            if(is_excluded((*stage)->name, (*pin)->name))
+                continue;
+            if(at.pin_count == MAX_PINS) {
+                fprintf(stderr, "too many source pins, tuning only the "
+                        "first %d\n", MAX_PINS);
+                break;
+            }
+
+            tp = at.pins + at.pin_count++;
+            tp->stage_name = strdup((*stage)->name);
+            tp->pin_name = strdup((*pin)->name);
+            tp->bufsize = (*pin)->bufsize ? (*pin)->bufsize
+                                          : nw->default_bufsize;
+            tp->bufcount = (*pin)->bufcount ? (*pin)->bufcount
+                                            : nw->default_bufcount;
+        }
+    }
+
+    quiet(1);
+    fg_network_destroy(nw);
+    quiet(0);
+}
+
+uint64_t memory_footprint(void)
+{
+    uint64_t total = 0;
+    int i;
+
+    for(i = 0; i < at.pin_count; i++)
+        total += (uint64_t) at.pins[i].bufsize * at.pins[i].bufcount;
+
+    return total;
+}
+
+/* Brings a move within the limits, drops it if that leaves nothing to try
+ * or it would go over the budget; scores as described in main(). */
+static void add_move(struct move *moves, int *n, int i, uint64_t size,
+        uint32_t count, double score)
+{
+    struct tuned_pin *tp = at.pins + i;
+    uint64_t footprint;
+
+    size = (size + at.align - 1) / at.align * at.align;
+    if(size < at.min_size)
+        size = at.min_size;
+    if(size > at.max_size)
+        size = at.max_size;
+    if(count < at.min_count)
+        count = at.min_count;
+    if(count > at.max_count)
+        count = at.max_count;
+
+    if(size == tp->bufsize && count == tp->bufcount)
+        return;
+
+    footprint = memory_footprint() - tp->bufsize * tp->bufcount
+        + size * count;
+    if(at.mem_budget && footprint > at.mem_budget)
+        return;
+
+    moves[*n].pin = i;
+    moves[*n].bufsize = size;
+    moves[*n].bufcount = count;
+    moves[*n].score = score;
+    (*n)++;
+}
+
+/* the adjustments worth a trial from where the tuned pins are now */
+int find_moves(struct move *moves)
+{
+    struct tuned_pin *tp;
+    struct pin_signals *sig;
+    int i, n = 0;
+
+    for(i = 0; i < at.pin_count; i++) {
+        tp = at.pins + i;
+        sig = at.signals + i;
+
+        add_move(moves, &n, i, tp->bufsize,
+                tp->bufcount < 4 ? tp->bufcount + 1 : tp->bufcount * 2,
+                sig->backpressure);
+        add_move(moves, &n, i, tp->bufsize * 2, tp->bufcount, sig->starved);
+
+        /* shrinking comes after any growth, soonest where there is least
+         * to lose */
+        add_move(moves, &n, i, tp->bufsize,
+                tp->bufcount <= 4 ? tp->bufcount - 1 : tp->bufcount / 2,
+                -1 - sig->backpressure);
+        add_move(moves, &n, i, tp->bufsize / 2, tp->bufcount,
+                -1 - sig->starved);
+    }
+
+    return n;
+}
+
+/* highest score first */
+int compare_moves(const void *a, const void *b)
+{
+    double d = ((const struct move *) b)->score
+        - ((const struct move *) a)->score;
+
+    return d > 0 ? 1 : d < 0 ? -1 : 0;
+}
+
+/* median wall-clock time of at.reps runs of the current configuration, or
+ * -1 if the network could not be built or fixed; signals gets the runs'
+ * statistics, averaged */
+double run_trial(struct pin_signals *signals)
+{
+    double times[at.reps];
+    double t;
+    int i, j;
+
+    memset(signals, 0, at.pin_count * sizeof(struct pin_signals));
+
+    for(i = 0; i < at.reps; i++) {
+        t = timed_run(signals);
+        if(t < 0)
+            return -1;
+
+        /* insertion sort; reps is small */
+        for(j = i; j > 0 && times[j - 1] > t; j--)
+            times[j] = times[j - 1];
+        times[j] = t;
+    }
+
+    for(i = 0; i < at.pin_count; i++) {
+        signals[i].backpressure /= at.reps;
+        signals[i].starved /= at.reps;
+    }
+
+    at.trial_count++;
+
+    return times[at.reps / 2];
+}
+
+/* one run; adds its statistics to signals */
+double timed_run(struct pin_signals *signals)
+{
+    FG_network *nw;
+    struct timespec start, end;
+    int rc;
+
+    quiet(1);
+
+    nw = build_network();
+    if(!nw) {
+        quiet(0);
+        return -1;
+    }
+    fg_network_set_print_stats(nw, at.verbose);
+    rc = fg_network_fix(nw);
+    if(rc == 0) {
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        fg_network_run(nw);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        collect_signals(nw, signals);
+    }
+    fg_network_destroy(nw);
+
+    quiet(0);
+
+    if(rc != 0)
+        return -1;
+
+    return (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+static int stage_index(FG_network *nw, FG_stage *stage)
+{
+    int i;
+
+    for(i = 0; i < nw->stage_count; i++)
+        if(nw->stages[i] == stage)
+            return i;
+
+    return -1;
+}
+
+/* For each tuned pin, the back pressure on its stage and the worst
+ * starvation among the stages its stage's outputs feed, pin arrays
+ * included.  A stage with several source pins shares its back pressure
+ * among them. */
+void collect_signals(FG_network *nw, struct pin_signals *signals)
+{
+    FG_network_stats *stats;
+    FG_stage *stage;
+    FG_pin **pin;
+    FG_queue *q;
+    double starved, f;
+    int i, j, k, n;
+
+    stats = fg_network_get_stats(nw);
+    if(!stats || stats->run_ns == 0) {
+        fg_network_stats_free(stats);
+        return;
+    }
+
+    for(i = 0; i < at.pin_count; i++) {
+        stage = fg_network_get_stage_by_name(nw, at.pins[i].stage_name);
+        k = stage ? stage_index(nw, stage) : -1;
+        if(k < 0)
+            continue;
+
+        signals[i].backpressure += (double) stats->stages[k].backpressure_ns
+            / stats->run_ns;
+
+        starved = 0;
+        for(pin = stage->pins; *pin; pin++) {
+            if((*pin)->direction == PIN_OUT)
+                n = 1;
+            else if((*pin)->direction == PIN_ARRAY_OUT)
+                n = (*pin)->queue_count;
+            else
+                continue;
+
+            for(j = 0; j < n; j++) {
+                q = (*pin)->direction == PIN_OUT ? (*pin)->queue
+                    : (*pin)->queues[j];
+                if(!q || !q->reader
+                        || (k = stage_index(nw, q->reader->stage)) < 0)
+                    continue;
+
+                f = (double) stats->stages[k].starved_ns / stats->run_ns;
+                if(f > starved)
+                    starved = f;
+            }
+        }
+        signals[i].starved += starved;
+    }
+
+    fg_network_stats_free(stats);
+}
+
+/* the network's own chatter on stdout would drown out the results */
+void quiet(int on)
+{
+    static int saved_stdout = -1;
+    int devnull;
+
+    if(at.verbose)
+        return;
+
+    /* log messages are written asynchronously; get them out while stdout
+     * still goes where they belong */
+    fg_log_flush();
+    fflush(stdout);
+    if(on) {
+        saved_stdout = dup(1);
+        devnull = open("/dev/null", O_WRONLY);
+        dup2(devnull, 1);
+        close(devnull);
+    } else if(saved_stdout >= 0) {
+        dup2(saved_stdout, 1);
+        close(saved_stdout);
+        saved_stdout = -1;
+    }
+}
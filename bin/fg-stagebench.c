@@ -0,0 +1,634 @@
+/*
+ * fg-stagebench.c
+ *
+ * Benchmarks one stage in isolation.  Instantiates a stage def by name, feeds
+ * each of its data inputs from a feeder stage that fills buffers from memory
+ * as fast as it can, and drains each of its data outputs into a stage that
+ * does nothing but hand the buffers back.  No disk, no MPI: what's measured
+ * is the stage's own code plus the buffer handoffs around it.
+ *
+ * Pins named buf_in and buf_out are the stage's own buffer plumbing and are
+ * left alone: unconnected, buf_in pins get their own buffers and buf_out
+ * pins return buffers where they came from.  Every other input is fed and
+ * every other output drained; -f restricts feeding to the pins named.  Pin
+ * arrays get -w connections each.
+ *
+ * Buffers hold records of -r bytes whose first 8 bytes are a signed 64-bit
+ * key, as the dsort stages expect: random keys, keys rising through each
+ * input (what merge wants), or all zero.  With -i the buffers are filled
+ * from a file instead, in order and wrapping around at its end; if the file
+ * is a pin capture (see lib/fg_capture.c), each buffer gets the data of the
+ * next buffer captured.
+ *
+ * The report gives buffers/s and bytes/s in and out over the run, and
+ * percentiles of the time the stage spends per call.  Time a call spends
+ * waiting for input or for empty buffers is not counted, so the latency
+ * reflects the stage's work even when the feeders can't keep up.
+ *
+ * Usage: fg-stagebench [options] stage-def
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "fg_internal.h"
+
+/* HACK: magic numbers! */
+#define MAX_PARAMS 32
+#define MAX_FEED_PINS 32
+#define MAX_INPUTS 1024
+
+enum fill { FILL_RANDOM, FILL_SORTED, FILL_ZERO };
+
+static const char *fill_names[] = { "random", "sorted", "zero", NULL };
+
+static struct {
+    const char *stage_def;
+    char *params[MAX_PARAMS];           /* "name=value" */
+    int param_count;
+    const char *feed_pins[MAX_FEED_PINS];
+    int feed_pin_count;
+    uint64_t bufsize;
+    uint32_t bufcount;
+    long buffers;                       /* per fed input */
+    int width;
+    int reclen;
+    enum fill fill;
+    const char *input_file;
+    int json;
+
+    char *data;                         /* buffers are filled from here */
+    uint64_t data_len;
+
+    /* buffers of a pin capture, if the input file is one */
+    struct captured {
+        uint64_t offset;                /* into data */
+        uint32_t len;
+    } *captured;
+    long captured_count;
+} opts;
+
+/* one per fed input */
+struct feeder {
+    long remaining;
+    uint64_t offset;                    /* into opts.data */
+    long next;                          /* of opts.captured */
+    int64_t key;                        /* next key, for FILL_SORTED */
+};
+
+/* per-call times of the stage under test */
+static struct {
+    int (*func)(FG_stage *stage);       /* the stage def's own */
+    FG_stage_def def;                   /* copy with func wrapped */
+    uint64_t *ns;
+    long count;
+    long capacity;
+} timed;
+
+void usage(const char *argv0);
+uint64_t parse_size(const char *s);
+void load_data(void);
+void load_capture(void);
+int feed_func(FG_stage *stage);
+int drain_func(FG_stage *stage);
+int timed_func(FG_stage *stage);
+int is_fed(FG_pin *pin);
+FG_stage *add_feeder(FG_network *nw, int n);
+int cmp_u64(const void *a, const void *b);
+uint64_t percentile(double p);
+void report(FG_network *nw, FG_stage *stage);
+
+FG_pin feed_pins[] = { { "buf_in",   PIN_IN  },
+                       { "data_out", PIN_OUT },
+                       { NULL }
+                     };
+FG_pin drain_pins[] = { { "data_in", PIN_IN  },
+                        { "buf_out", PIN_OUT },
+                        { NULL }
+                      };
+FG_stage_def harness_defs[] = {
+    { "fg-stagebench-feed", "fills buffers from memory", NULL, feed_func,
+        NULL, feed_pins, NULL },
+    { "fg-stagebench-drain", "returns every buffer it gets", NULL, drain_func,
+        NULL, drain_pins, NULL },
+    { NULL }
+};
+
+int main(int argc, char *argv[])
+{
+    FG_network *nw;
+    FG_stage *stage, *s;
+    FG_pin **pin;
+    char name[64];
+    char *eq;
+    int c, i, n = 0, inputs = 0;
+
+    opts.bufsize = 1024 * 1024;
+    opts.bufcount = 4;
+    opts.buffers = 1000;
+    opts.width = 4;
+    opts.reclen = 64;
+    opts.fill = FILL_RANDOM;
+
+    /* unbuffered stdout makes debugging easier */
+    setbuf(stdout, NULL);
+
+    fg_init(&argc, &argv);
+
+    while((c = getopt(argc, argv, "m:p:f:b:c:n:w:r:d:i:jh")) != -1) {
+        switch(c) {
+            case 'm':
+                if(!fg_module_load(optarg)) {
+                    fprintf(stderr, "cannot load module %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'p':
+                if(opts.param_count == MAX_PARAMS || !strchr(optarg, '=')) {
+                    usage(argv[0]);
+                    exit(1);
+                }
+                opts.params[opts.param_count++] = optarg;
+                break;
+            case 'f':
+                if(opts.feed_pin_count == MAX_FEED_PINS) {
+                    usage(argv[0]);
+                    exit(1);
+                }
+                opts.feed_pins[opts.feed_pin_count++] = optarg;
+                break;
+            case 'b': opts.bufsize = parse_size(optarg); break;
+            case 'c': opts.bufcount = atoi(optarg); break;
+            case 'n': opts.buffers = atol(optarg); break;
+            case 'w': opts.width = atoi(optarg); break;
+            case 'r': opts.reclen = atoi(optarg); break;
+            case 'i': opts.input_file = optarg; break;
+            case 'j': opts.json = 1; break;
+            case 'd':
+                for(i = 0; fill_names[i]; i++)
+                    if(strcmp(optarg, fill_names[i]) == 0)
+                        break;
+                if(!fill_names[i]) {
+                    fprintf(stderr, "unknown data: %s\n", optarg);
+                    exit(1);
+                }
+                opts.fill = (enum fill) i;
+                break;
+            default:
+                usage(argv[0]);
+                exit(c == 'h' ? 0 : 1);
+        }
+    }
+
+    if(optind != argc - 1 || opts.bufcount < 1 || opts.buffers < 1
+            || opts.width < 1 || opts.reclen < 8
+            || opts.bufsize < (uint64_t) opts.reclen) {
+        usage(argv[0]);
+        exit(1);
+    }
+    opts.stage_def = argv[optind];
+
+    /* whole records only, as the dsort stages assume */
+    opts.bufsize -= opts.bufsize % opts.reclen;
+
+    /* the harness is timing the stage, not the logging */
+    if(!getenv("FG_LOG"))
+        fg_log_set_domains(0);
+
+    for(i = 0; harness_defs[i].name; i++)
+        if(fg_stage_def_register(harness_defs + i) != 0)
+            exit(1);
+
+    load_data();
+
+    nw = fg_network_create("fg-stagebench", opts.bufcount, opts.bufsize);
+    fg_network_set_print_stats(nw, 0);
+
+    stage = fg_stage_create(nw, opts.stage_def, opts.stage_def);
+    if(!stage) {
+        fprintf(stderr, "no stage definition %s\n", opts.stage_def);
+        exit(1);
+    }
+
+    for(i = 0; i < opts.param_count; i++) {
+        eq = strchr(opts.params[i], '=');
+        *eq = '\0';
+        fg_stage_set_param(stage, opts.params[i], eq + 1);
+    }
+
+    /* time every call of the stage's own function */
+    timed.func = stage->sd->func;
+    timed.def = *stage->sd;
+    timed.def.func = timed_func;
+    stage->sd = &timed.def;
+
+    for(pin = stage->pins; *pin; pin++) {
+        if(((*pin)->direction == PIN_IN || (*pin)->direction == PIN_ARRAY_IN)
+                && strcmp((*pin)->name, "buf_in") != 0)
+            inputs++;
+
+        switch((*pin)->direction) {
+            case PIN_IN:
+                if(is_fed(*pin)) {
+                    s = add_feeder(nw, n++);
+                    fg_pin_connect(s, "data_out", stage, (*pin)->name);
+                }
+                break;
+            case PIN_ARRAY_IN:
+                if(is_fed(*pin)) {
+                    for(i = 0; i < opts.width; i++) {
+                        s = add_feeder(nw, n++);
+                        fg_pin_connect(s, "data_out", stage, (*pin)->name);
+                    }
+                }
+                break;
+            case PIN_OUT:
+                if(strcmp((*pin)->name, "buf_out") != 0) {
+                    snprintf(name, sizeof(name), "drain-%s", (*pin)->name);
+                    s = fg_stage_create(nw, "fg-stagebench-drain", name);
+                    fg_pin_connect(stage, (*pin)->name, s, "data_in");
+                }
+                break;
+            case PIN_ARRAY_OUT:
+                for(i = 0; i < opts.width; i++) {
+                    snprintf(name, sizeof(name), "drain-%s%d", (*pin)->name,
+                            i);
+                    s = fg_stage_create(nw, "fg-stagebench-drain", name);
+                    fg_pin_connect(stage, (*pin)->name, s, "data_in");
+                }
+                break;
+        }
+    }
+
+    if(n == 0 && inputs > 0)
+        fprintf(stderr, "warning: no input of %s is fed\n", stage->name);
+
+    if(fg_network_fix(nw) != 0) {
+        fprintf(stderr, "cannot set up the network\n");
+        exit(1);
+    }
+
+    fg_network_run(nw);
+    report(nw, stage);
+
+    fg_network_destroy(nw);
+    fg_fini();
+
+    free(timed.ns);
+    free(opts.data);
+    free(opts.captured);
+
+    return 0;
+}
+
+void usage(const char *argv0)
+{
+    printf("Usage: %s [options] stage-def\n", argv0);
+    printf("  -m module      load a module that isn't in the search path\n");
+    printf("  -p name=value  set a stage parameter (repeatable)\n");
+    printf("  -f pin         feed only these input pins (repeatable)\n");
+    printf("  -b size        buffer size, K, M or G suffix allowed "
+            "(default 1M)\n");
+    printf("  -c count       buffers per source pin (default 4)\n");
+    printf("  -n count       buffers fed into each input (default 1000)\n");
+    printf("  -w width       connections to each pin array "
+            "(default 4)\n");
+    printf("  -r bytes       record length, key included (default 64)\n");
+    printf("  -d data        keys: random, sorted or zero (default random)\n");
+    printf("  -i file        fill buffers from a file instead\n");
+    printf("  -j             report as JSON\n");
+}
+
+uint64_t parse_size(const char *s)
+{
+    char *end;
+    uint64_t n;
+
+    n = strtoull(s, &end, 0);
+    switch(*end) {
+        case 'G': case 'g': n <<= 10;   /* fall through */
+        case 'M': case 'm': n <<= 10;   /* fall through */
+        case 'K': case 'k': n <<= 10;
+    }
+
+    return n;
+}
+
+/* Prepares what buffers are filled from: the input file, or records enough
+ * for two buffers, so that successive buffers can start at different places
+ * and don't all hold the same records. */
+void load_data(void)
+{
+    struct stat sbuf;
+    uint64_t i;
+    int fd;
+
+    if(opts.input_file) {
+        fd = open(opts.input_file, O_RDONLY);
+        if(fd < 0 || fstat(fd, &sbuf) < 0 || sbuf.st_size == 0) {
+            fprintf(stderr, "cannot read %s\n", opts.input_file);
+            exit(1);
+        }
+
+        opts.data_len = sbuf.st_size;
+        opts.data = (char *) malloc(opts.data_len);
+        if(!opts.data || read(fd, opts.data, opts.data_len)
+                != (ssize_t) opts.data_len) {
+            fprintf(stderr, "cannot read %s\n", opts.input_file);
+            exit(1);
+        }
+
+        close(fd);
+
+        if(opts.data_len >= sizeof(struct fg_capture_header)
+                && memcmp(opts.data, FG_CAPTURE_MAGIC,
+                    strlen(FG_CAPTURE_MAGIC)) == 0)
+            load_capture();
+
+        return;
+    }
+
+    opts.data_len = 2 * opts.bufsize;
+    opts.data = (char *) calloc(opts.data_len, 1);
+
+    srandom(1);
+    for(i = 0; opts.fill == FILL_RANDOM && i < opts.data_len;
+            i += opts.reclen) {
+        *((int64_t *) (opts.data + i)) = ((int64_t) random() << 32)
+            ^ ((int64_t) random() << 1) ^ random();
+    }
+}
+
+/* finds the buffers in a pin capture */
+void load_capture(void)
+{
+    struct fg_capture_record r;
+    uint64_t off;
+    long capacity = 0;
+
+    for(off = sizeof(struct fg_capture_header);
+            off + sizeof(r) <= opts.data_len; off += sizeof(r) + r.datalen) {
+        memcpy(&r, opts.data + off, sizeof(r));
+        if(off + sizeof(r) + r.datalen > opts.data_len) {
+            fprintf(stderr, "%s is truncated\n", opts.input_file);
+            exit(1);
+        }
+
+        if(r.datalen > opts.bufsize) {
+            fprintf(stderr, "%s holds buffers of %llu bytes; use -b to make "
+                    "room for them\n", opts.input_file,
+                    (unsigned long long) r.datalen);
+            exit(1);
+        }
+
+        if(opts.captured_count == capacity) {
+            capacity = capacity * 2 + 256;
+            opts.captured = (struct captured *) realloc(opts.captured,
+                    capacity * sizeof(struct captured));
+        }
+
+        opts.captured[opts.captured_count].offset = off + sizeof(r);
+        opts.captured[opts.captured_count].len = r.datalen;
+        opts.captured_count++;
+    }
+
+    if(opts.captured_count == 0) {
+        fprintf(stderr, "%s holds no buffers\n", opts.input_file);
+        exit(1);
+    }
+}
+
+/* feeder stage def
+ *************************************************************/
+int feed_func(FG_stage *stage)
+{
+    struct feeder *f = (struct feeder *) stage->data;
+    FG_pin *pin;
+    FG_buf *buf;
+    uint32_t len, i;
+
+    if(f->remaining == 0)
+        return FG_STAGE_TERMINATE;
+
+    pin = fg_stage_pin_get_by_name(stage, "buf_in");
+    buf = fg_pin_accept_buffer(pin);
+
+    if(opts.captured) {
+        len = opts.captured[f->next].len;
+        memcpy(buf->data, opts.data + opts.captured[f->next].offset, len);
+        f->next = (f->next + 1) % opts.captured_count;
+    } else if(opts.input_file) {
+        /* file data goes out as it was, up to the end of the file */
+        len = opts.data_len - f->offset < buf->size
+            ? opts.data_len - f->offset : buf->size;
+        memcpy(buf->data, opts.data + f->offset, len);
+        f->offset = (f->offset + len) % opts.data_len;
+    } else {
+        len = buf->size;
+        memcpy(buf->data, opts.data + f->offset, len);
+        f->offset = (f->offset + 7 * opts.reclen) % opts.bufsize;
+
+        if(opts.fill == FILL_SORTED)
+            for(i = 0; i < len; i += opts.reclen)
+                *((int64_t *) (buf->data + i)) = f->key++;
+    }
+
+    buf->datalen = len;
+    f->remaining--;
+
+    pin = fg_stage_pin_get_by_name(stage, "data_out");
+    fg_pin_convey_buffer(pin, buf);
+
+    return FG_STAGE_SUCCESS;
+}
+
+/* drain stage def
+ *************************************************************/
+int drain_func(FG_stage *stage)
+{
+    FG_pin *pin;
+    FG_buf *buf;
+
+    pin = fg_stage_pin_get_by_name(stage, "data_in");
+    buf = fg_pin_accept_buffer(pin);
+
+    if(!buf)
+        return FG_STAGE_TERMINATE;
+
+    /* unconnected, so the buffer goes back where it came from */
+    pin = fg_stage_pin_get_by_name(stage, "buf_out");
+    fg_pin_convey_buffer(pin, buf);
+
+    return FG_STAGE_SUCCESS;
+}
+
+/* Calls the stage's function and records how long it worked.  The wait
+ * counters only move on this stage's thread, so their growth during the
+ * call is exactly the time it spent blocked. */
+int timed_func(FG_stage *stage)
+{
+    uint64_t start, waited;
+    int rc;
+
+    waited = stage->starved_ns + stage->backpressure_ns;
+    start = fg_now_ns();
+
+    rc = timed.func(stage);
+
+    waited = stage->starved_ns + stage->backpressure_ns - waited;
+
+    if(timed.count == timed.capacity) {
+        timed.capacity = timed.capacity * 2 + 1024;
+        timed.ns = (uint64_t *) realloc(timed.ns,
+                timed.capacity * sizeof(uint64_t));
+    }
+    timed.ns[timed.count++] = fg_now_ns() - start - waited;
+
+    return rc;
+}
+
+int is_fed(FG_pin *pin)
+{
+    int i;
+
+    if(opts.feed_pin_count == 0)
+        return strcmp(pin->name, "buf_in") != 0;
+
+    for(i = 0; i < opts.feed_pin_count; i++)
+        if(strcmp(pin->name, opts.feed_pins[i]) == 0)
+            return 1;
+
+    return 0;
+}
+
+FG_stage *add_feeder(FG_network *nw, int n)
+{
+    FG_stage *s;
+    struct feeder *f;
+    char name[64];
+
+    if(n == MAX_INPUTS) {
+        fprintf(stderr, "too many inputs to feed\n");
+        exit(1);
+    }
+
+    snprintf(name, sizeof(name), "feed%d", n);
+    s = fg_stage_create(nw, "fg-stagebench-feed", name);
+    if(!s)
+        exit(1);
+
+    f = (struct feeder *) calloc(1, sizeof(struct feeder));
+    f->remaining = opts.buffers;
+    f->offset = opts.input_file ? 0
+        : (uint64_t) n * 3 * opts.reclen % opts.bufsize;
+    s->data = f;
+
+    return s;
+}
+
+int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *((const uint64_t *) a), y = *((const uint64_t *) b);
+
+    return x < y ? -1 : x > y ? 1 : 0;
+}
+
+/* of the per-call times, which must be sorted */
+uint64_t percentile(double p)
+{
+    long i;
+
+    if(timed.count == 0)
+        return 0;
+
+    i = (long) (p / 100 * timed.count);
+    return timed.ns[i < timed.count ? i : timed.count - 1];
+}
+
+void report(FG_network *nw, FG_stage *stage)
+{
+    static const double pcts[] = { 50, 90, 99, 99.9, 100 };
+    FG_network_stats *stats;
+    FG_stage_stats *ss = NULL;
+    uint64_t bufs_in = 0, bytes_in = 0, bufs_out = 0, bytes_out = 0;
+    uint64_t work_ns = 0;
+    double secs;
+    long i;
+
+    stats = fg_network_get_stats(nw);
+    for(i = 0; i < stats->stage_count; i++)
+        if(strcmp(stats->stages[i].name, stage->name) == 0)
+            ss = stats->stages + i;
+
+    /* only fed and drained pins count; buf_in and buf_out are plumbing */
+    for(i = 0; i < ss->pin_count; i++) {
+        if(strcmp(ss->pins[i].name, "buf_in") == 0
+                || strcmp(ss->pins[i].name, "buf_out") == 0)
+            continue;
+
+        if(ss->pins[i].direction) {
+            bufs_out += ss->pins[i].buffers;
+            bytes_out += ss->pins[i].bytes;
+        } else {
+            bufs_in += ss->pins[i].buffers;
+            bytes_in += ss->pins[i].bytes;
+        }
+    }
+
+    qsort(timed.ns, timed.count, sizeof(uint64_t), cmp_u64);
+    for(i = 0; i < timed.count; i++)
+        work_ns += timed.ns[i];
+
+    secs = stats->run_ns / 1e9;
+
+    if(opts.json) {
+        printf("{\"stage_def\": \"%s\", \"bufsize\": %llu, \"bufcount\": %u, "
+                "\"seconds\": %.6f, \"calls\": %ld, \"busy\": %.3f, "
+                "\"in\": {\"buffers\": %llu, \"buffers_per_s\": %.1f, "
+                "\"bytes_per_s\": %.0f}, "
+                "\"out\": {\"buffers\": %llu, \"buffers_per_s\": %.1f, "
+                "\"bytes_per_s\": %.0f}, \"call_ns\": {", opts.stage_def,
+                (unsigned long long) opts.bufsize, opts.bufcount, secs, timed.count,
+                work_ns / 1e9 / secs, (unsigned long long) bufs_in,
+                bufs_in / secs, bytes_in / secs,
+                (unsigned long long) bufs_out, bufs_out / secs,
+                bytes_out / secs);
+        for(i = 0; i < (long) (sizeof(pcts) / sizeof(pcts[0])); i++) {
+            if(pcts[i] == 100)
+                printf(", \"max\": %llu",
+                        (unsigned long long) percentile(pcts[i]));
+            else
+                printf("%s\"p%g\": %llu", i ? ", " : "", pcts[i],
+                        (unsigned long long) percentile(pcts[i]));
+        }
+        printf("}}\n");
+    } else {
+        printf("%s: %ld calls in %.3f s, busy %.1f%%\n", opts.stage_def,
+                timed.count, secs, 100 * work_ns / 1e9 / secs);
+        printf("  in:  %10llu buffers %12.1f bufs/s %10.2f MB/s\n",
+                (unsigned long long) bufs_in, bufs_in / secs,
+                bytes_in / secs / (1024 * 1024));
+        printf("  out: %10llu buffers %12.1f bufs/s %10.2f MB/s\n",
+                (unsigned long long) bufs_out, bufs_out / secs,
+                bytes_out / secs / (1024 * 1024));
+        printf("  time per call, waits excluded:");
+        for(i = 0; i < (long) (sizeof(pcts) / sizeof(pcts[0])); i++) {
+            if(pcts[i] == 100)
+                printf(" max %.1f us", percentile(pcts[i]) / 1e3);
+            else
+                printf(" p%g %.1f us", pcts[i], percentile(pcts[i]) / 1e3);
+        }
+        printf("\n");
+
+        if(work_ns / 1e9 < secs / 2)
+            printf("  (busy under half the time: the feeders or drains may "
+                    "be the bottleneck)\n");
+    }
+
+    fg_network_stats_free(stats);
+}
@@ -0,0 +1,266 @@
+/*
+ * fg-top.c
+ *
+ * Shows what a running network is doing, refreshed every second or so: how
+ * busy each stage is, how long it waits for input or for empty buffers, and
+ * how fast buffers move through each pin.  The network must be serving its
+ * counters on a Unix domain socket, which fg_network_set_metrics_socket() or
+ * FG_METRICS in the environment of the program running it arranges.
+ *
+ * Usage: fg-top [-i seconds] [-n count] [-1] socket
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+struct stage_sample {
+    char name[128];
+    uint64_t calls;
+    uint64_t func_ns;
+    uint64_t starved_ns;
+    uint64_t backpressure_ns;
+};
+
+struct pin_sample {
+    char stage[128];
+    char name[128];
+    char dir[4];
+    uint64_t buffers;
+    uint64_t bytes;
+    unsigned int queued;
+};
+
+struct sample {
+    char network[128];
+    uint64_t elapsed_ns;
+    int stage_count;
+    struct stage_sample *stages;
+    int pin_count;
+    struct pin_sample *pins;
+};
+
+void usage(const char *argv0);
+int take_sample(const char *path, struct sample *s);
+void free_sample(struct sample *s);
+void show(struct sample *now, struct sample *prev, int clear);
+double pct(uint64_t now, uint64_t prev, double dt_ns);
+
+int main(int argc, char *argv[])
+{
+    struct sample now, prev;
+    double interval = 1.0;
+    int count = -1;
+    int clear = 1;
+    int have_prev = 0;
+    int seen = 0;
+    int c;
+
+    while((c = getopt(argc, argv, "i:n:1h")) != -1) {
+        switch(c) {
+            case 'i': interval = atof(optarg); break;
+            case 'n': count = atoi(optarg); break;
+            case '1': clear = 0; break;
+            default:
+                usage(argv[0]);
+                exit(c == 'h' ? 0 : 1);
+        }
+    }
+
+    if(optind != argc - 1 || interval <= 0) {
+        usage(argv[0]);
+        exit(1);
+    }
+
+    memset(&prev, 0, sizeof(prev));
+
+    for(; count != 0; count--) {
+        if(take_sample(argv[optind], &now) == 0) {
+            show(&now, have_prev ? &prev : NULL, clear);
+            if(have_prev)
+                free_sample(&prev);
+            prev = now;
+            have_prev = seen = 1;
+        } else if(seen) {
+            /* the network has finished and taken its socket with it */
+            printf("%s: network finished\n", argv[optind]);
+            break;
+        }
+
+        usleep(interval * 1e6);
+    }
+
+    if(have_prev)
+        free_sample(&prev);
+
+    return 0;
+}
+
+void usage(const char *argv0)
+{
+    printf("Usage: %s [-i seconds] [-n count] [-1] socket\n", argv0);
+    printf("  -i  seconds between updates (default 1)\n");
+    printf("  -n  stop after this many updates\n");
+    printf("  -1  print updates one after another instead of redrawing\n");
+}
+
+/* connects to the network's metrics socket and reads one snapshot */
+int take_sample(const char *path, struct sample *s)
+{
+    struct sockaddr_un addr;
+    struct stage_sample *ss;
+    struct pin_sample *ps;
+    unsigned long long a, b, c, d;
+    char line[BUFSIZ];
+    FILE *f;
+    int fd;
+    int done = 0;
+
+    memset(s, 0, sizeof(*s));
+
+    if(strlen(path) >= sizeof(addr.sun_path))
+        return -1;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(fd < 0)
+        return -1;
+
+    if(connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    f = fdopen(fd, "r");
+    if(!f) {
+        close(fd);
+        return -1;
+    }
+
+    while(fgets(line, sizeof(line), f)) {
+        if(sscanf(line, "network %llu %127[^\n]", &a, s->network) == 2) {
+            s->elapsed_ns = a;
+        } else if(strncmp(line, "stage ", 6) == 0) {
+            s->stages = (struct stage_sample *) realloc(s->stages,
+                    (s->stage_count + 1) * sizeof(struct stage_sample));
+            ss = s->stages + s->stage_count;
+            if(sscanf(line, "stage %127s %llu %llu %llu %llu", ss->name, &a,
+                        &b, &c, &d) == 5) {
+                ss->calls = a;
+                ss->func_ns = b;
+                ss->starved_ns = c;
+                ss->backpressure_ns = d;
+                s->stage_count++;
+            }
+        } else if(strncmp(line, "pin ", 4) == 0) {
+            s->pins = (struct pin_sample *) realloc(s->pins,
+                    (s->pin_count + 1) * sizeof(struct pin_sample));
+            ps = s->pins + s->pin_count;
+            if(sscanf(line, "pin %127s %127s %3s %llu %llu %u", ps->stage,
+                        ps->name, ps->dir, &a, &b, &ps->queued) == 6) {
+                ps->buffers = a;
+                ps->bytes = b;
+                s->pin_count++;
+            }
+        } else if(strcmp(line, "end\n") == 0) {
+            done = 1;
+        }
+    }
+
+    fclose(f);
+
+    if(!done) {
+        free_sample(s);
+        return -1;
+    }
+
+    return 0;
+}
+
+void free_sample(struct sample *s)
+{
+    free(s->stages);
+    free(s->pins);
+    s->stages = NULL;
+    s->pins = NULL;
+}
+
+/* Rates are over the interval since the previous snapshot; the first one
+ * shows averages since the network started. */
+void show(struct sample *now, struct sample *prev, int clear)
+{
+    struct stage_sample zero_stage, *ss, *pss;
+    struct pin_sample zero_pin, *ps, *pps;
+    uint64_t busy, prev_busy;
+    double dt;
+    int i, j;
+
+    memset(&zero_stage, 0, sizeof(zero_stage));
+    memset(&zero_pin, 0, sizeof(zero_pin));
+
+    /* counters only make sense against a snapshot of the same network */
+    if(prev && (prev->stage_count != now->stage_count
+                || prev->pin_count != now->pin_count
+                || prev->elapsed_ns >= now->elapsed_ns))
+        prev = NULL;
+
+    dt = now->elapsed_ns - (prev ? prev->elapsed_ns : 0);
+    if(dt <= 0)
+        return;
+
+    if(clear)
+        printf("\033[H\033[J");
+
+    printf("network %s, running %.1f s\n\n", now->network,
+            now->elapsed_ns / 1e9);
+    printf("%-20s %8s %8s %8s %10s\n", "stage", "busy%", "starved%",
+            "backpr%", "calls/s");
+
+    for(i=0; i<now->stage_count; i++) {
+        ss = now->stages + i;
+        pss = prev ? prev->stages + i : &zero_stage;
+
+        busy = ss->func_ns - ss->starved_ns - ss->backpressure_ns;
+        prev_busy = pss->func_ns - pss->starved_ns - pss->backpressure_ns;
+
+        printf("%-20s %8.1f %8.1f %8.1f %10.1f\n", ss->name,
+                pct(busy, prev_busy, dt),
+                pct(ss->starved_ns, pss->starved_ns, dt),
+                pct(ss->backpressure_ns, pss->backpressure_ns, dt),
+                (ss->calls - pss->calls) / (dt / 1e9));
+
+        for(j=0; j<now->pin_count; j++) {
+            ps = now->pins + j;
+            pps = prev ? prev->pins + j : &zero_pin;
+            if(strcmp(ps->stage, ss->name) != 0)
+                continue;
+
+            printf("  %-14s %-3s %10.1f bufs/s %10.2f MB/s", ps->name,
+                    ps->dir, (ps->buffers - pps->buffers) / (dt / 1e9),
+                    (ps->bytes - pps->bytes) / (dt / 1e9) / (1024 * 1024));
+            if(strcmp(ps->dir, "in") == 0)
+                printf(" %6u queued", ps->queued);
+            printf("\n");
+        }
+    }
+
+    printf("\n");
+    fflush(stdout);
+}
+
+/* share of the interval, in percent, taken by the growth of a time counter;
+ * time is only counted once a call or wait ends, so this can top 100 */
+double pct(uint64_t now, uint64_t prev, double dt_ns)
+{
+    if(now < prev)
+        return 0;
+
+    return 100.0 * (now - prev) / dt_ns;
+}
@@ -1,32 +1,120 @@
 /*
- * fg_module_index.c 
+ * fg_module_index.c
+ *
+ * Lists the stage definitions provided by the modules in the given
+ * directories (or in the module search path, FG_MODULE_PATH, if none are
+ * given).  With -w, also writes each directory's index file, which lets
+ * fg_init() find the module providing a stage definition without loading
+ * every module.
+ *
+ * Usage: fg_module_index [-w] [dir ...]
  */
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
+#include <dirent.h>
 
 #include "fg_internal.h"
 
 #define succeed_or_bail(x) if(!x) { fprintf(stderr, "Aborting\n"); exit(1); }
 
+int index_dir(const char *dir, int write_index);
+int is_module_file(const struct dirent *d);
+
 int main(int argc, char *argv[])
 {
     FG_stage_def **sd;
+    char **dir;
+    int write_index = 0;
+    int rc = 0;
+    int c;
+
+    while((c = getopt(argc, argv, "wh")) != -1) {
+        switch(c) {
+            case 'w': write_index = 1; break;
+            default:
+                printf("Usage: %s [-w] [dir ...]\n", argv[0]);
+                exit(c == 'h' ? 0 : 1);
+        }
+    }
 
     /* unbuffered stdout makes debugging easier */
     setbuf(stdout, NULL);
 
-    /* load stage definitions */
     fg_init(&argc, &argv);
 
-    for(sd=fg_get_stage_defs(); *sd; sd++) {
-        printf("%s\n", (*sd)->name);
+    if(optind < argc) {
+        for(; optind < argc; optind++)
+            rc |= index_dir(argv[optind], write_index);
+    } else if(*fg_module_path_get()) {
+        for(dir = fg_module_path_get(); *dir; dir++)
+            rc |= index_dir(*dir, write_index);
+    } else {
+        /* no directories to index; just list what can be loaded */
+        fg_module_load_all();
+        for(sd=fg_get_stage_defs(); *sd; sd++) {
+            printf("%s\n", (*sd)->name);
+        }
     }
 
     /* clean up */
     fg_fini();
 
+    return rc ? 1 : 0;
+}
+
+int index_dir(const char *dir, int write_index)
+{
+    struct dirent **entries;
+    FG_module *module;
+    FG_stage_def *sd;
+    FILE *f = NULL;
+    char path[BUFSIZ];
+    int i, n;
+
+    n = scandir(dir, &entries, is_module_file, alphasort);
+    if(n < 0) {
+        perror(dir);
+        return -1;
+    }
+
+    if(write_index) {
+        snprintf(path, sizeof(path), "%s/%s", dir, FG_MODULE_INDEX);
+        f = fopen(path, "w");
+        succeed_or_bail(f);
+        fprintf(f, "# generated by fg_module_index; stage-def module-file\n");
+    }
+
+    for(i=0; i<n; i++) {
+        snprintf(path, sizeof(path), "%s/%s", dir, entries[i]->d_name);
+        module = fg_module_load(path);
+        if(!module) {
+            fprintf(stderr, "skipping %s\n", path);
+            free(entries[i]);
+            continue;
+        }
+
+        for(sd=module->stage_defs; sd->name; sd++) {
+            printf("%s %s\n", sd->name, path);
+            if(f)
+                fprintf(f, "%s %s\n", sd->name, entries[i]->d_name);
+        }
+
+        free(entries[i]);
+    }
+    free(entries);
+
+    if(f)
+        fclose(f);
+
     return 0;
 }
 
+int is_module_file(const struct dirent *d)
+{
+    size_t len = strlen(d->d_name);
+
+    return len > 3 && strcmp(d->d_name + len - 3, ".so") == 0;
+}
@@ -10,14 +10,22 @@ nrecs=$(( $dataset_size / (8 + $rec_len) ))
 dd if=/dev/zero of=data.out bs=1M count=1024
 
 # uniform random
-dd if=/dev/urandom of=data.out bs=1M count=1024
+gen_dist_data -o data.out -u $nrecs $rec_len
 
 # normal distribution
 mean="0.0"
 stddev="1.0"
-gen_dist_data -n $nrecs $rec_len $mean $stddev
+gen_dist_data -o data.out -n $nrecs $rec_len $mean $stddev
 
 # poisson distribution
 lambda="1.0"
-gen_dist_data -p $nrecs $rec_len $lambda
+gen_dist_data -o data.out -p $nrecs $rec_len $lambda
 
+# zipf distribution
+nkeys=1000000
+skew="1.0"
+gen_dist_data -o data.out -z $nrecs $rec_len $nkeys $skew
+
+# sorted, and sorted but for 1% of records
+gen_dist_data -o data.out -s $nrecs $rec_len
+gen_dist_data -o data.out -a $nrecs $rec_len 0.01
@@ -1,11 +1,19 @@
 /*
  * gen_dist_data.c
- * 
- * Generates records whose keys are distributed according to either a normal
- * or Poisson distribution.  Keys are always 8-byte signed integers, though
- * record size can be tweaked with a command-line option.
+ *
+ * Generates records whose keys follow a given distribution.  Keys are always
+ * 8-byte signed integers, followed by a payload whose length is a
+ * command-line argument.
+ *
+ * Records are generated by several threads, each filling large chunks of the
+ * output and writing them with pwrite() to where they belong, so a data set
+ * takes about as long as the disk needs to write it.  Every record depends
+ * only on the seed and its position in the file (see lib/fg_rand.h), never on
+ * which thread made it or in what order, so the same seed gives the same
+ * bytes whatever the number of threads.
  */
 
+#define _GNU_SOURCE /* for O_DIRECT */
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
@@ -13,144 +21,345 @@
 #include <unistd.h>
 #include <string.h>
 #include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 
+#include "fg_rand.h"
+
+/* O_DIRECT wants offsets, lengths and memory aligned to this */
+#define ALIGN 4096
+
 void usage(char *progname);
-int64_t gauss_rand(double mean, double stddev);
-int64_t uniform_rand(void);
-int64_t poisson_rand(double lambda);
+void *generator(void *data);
+int64_t gen_key(uint64_t i);
+void fill_chunk(char *chunk, uint64_t first, uint64_t n);
+void write_chunk(char *chunk, uint64_t c, size_t len);
 
 enum {
     normal,
-    poisson
+    poisson,
+    uniform,
+    zipf,
+    sorted,
+    nearly_sorted
+};
+
+enum {
+    payload_random,
+    payload_zero,
+    payload_index
 };
 
 int key_len = 8;
-int recs_per_block = 8;
+
+struct {
+    int mode;
+    int64_t nrecs;
+    int64_t rec_len;        /* payload only, key not included */
+    int64_t size;           /* key plus payload */
+    double mean, stddev;
+    double lambda;
+    uint64_t nkeys;
+    double skew;
+    double fraction;        /* of records out of place, nearly sorted */
+    uint64_t seed;
+    int payload;
+
+    int fd;
+    int tail_fd;            /* for the unaligned end, when fd is O_DIRECT */
+    int seekable;
+    uint64_t chunk_recs;
+    uint64_t nchunks;
+
+    /* chunks are handed out in order; unseekable output is written in
+     * order too */
+    pthread_mutex_t mutex;
+    pthread_cond_t written_cv;
+    uint64_t next_chunk;
+    uint64_t next_write;
+    int failed;             /* read and set atomically */
+} g;
 
 int main(int argc, char *argv[])
 {
-    int64_t nrecs, rec_len;
-    double mean, stddev, lambda;
-    int8_t *block;
-    int block_size;     /* num octets */
-    int i;
-    int64_t n;
-    int mode = normal;
-    unsigned int random_seed;
-    int fd;
+    char *filename = NULL;
+    int64_t chunk_size = 8 * 1024 * 1024;
+    int nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    int direct = 0;
+    int nargs;
+    pthread_t *threads;
+    int64_t unit;
+    int c, i;
+
+    g.mode = -1;
+    g.seed = 1;
+    g.payload = payload_random;
+
+    while((c = getopt(argc, argv, "npuzsat:S:o:dP:c:h")) != -1) {
+        switch(c) {
+            case 'n': g.mode = normal; break;
+            case 'p': g.mode = poisson; break;
+            case 'u': g.mode = uniform; break;
+            case 'z': g.mode = zipf; break;
+            case 's': g.mode = sorted; break;
+            case 'a': g.mode = nearly_sorted; break;
+            case 't': nthreads = atoi(optarg); break;
+            case 'S': g.seed = strtoull(optarg, NULL, 0); break;
+            case 'o': filename = optarg; break;
+            case 'd': direct = 1; break;
+            case 'c': chunk_size = atol(optarg); break;
+            case 'P':
+                if(strcmp(optarg, "random") == 0)
+                    g.payload = payload_random;
+                else if(strcmp(optarg, "zero") == 0)
+                    g.payload = payload_zero;
+                else if(strcmp(optarg, "index") == 0)
+                    g.payload = payload_index;
+                else {
+                    usage(argv[0]);
+                    exit(1);
+                }
+                break;
+            default:
+                usage(argv[0]);
+                exit(c == 'h' ? 0 : 1);
+        }
+    }
 
-    if(argc < 2) {
+    switch(g.mode) {
+        case normal:        nargs = 4; break;
+        case poisson:       nargs = 3; break;
+        case zipf:          nargs = 4; break;
+        case nearly_sorted: nargs = 3; break;
+        default:            nargs = 2; break;
+    }
+
+    if(g.mode < 0 || argc - optind != nargs || nthreads < 1
+            || chunk_size < 1) {
         usage(argv[0]);
         exit(1);
-    } else if(strcmp(argv[1], "-p") == 0) {
-        mode = poisson;
-    } else if(strcmp(argv[1], "-n") == 0) {
-        mode = normal;
-    } else {
+    }
+
+    g.nrecs = atol(argv[optind]);
+    g.rec_len = atoi(argv[optind + 1]);
+    g.size = key_len + g.rec_len;
+
+    switch(g.mode) {
+        case normal:
+            g.mean = atof(argv[optind + 2]);
+            g.stddev = atof(argv[optind + 3]);
+            break;
+        case poisson:
+            g.lambda = atof(argv[optind + 2]);
+            break;
+        case zipf:
+            g.nkeys = strtoull(argv[optind + 2], NULL, 0);
+            g.skew = atof(argv[optind + 3]);
+            break;
+        case nearly_sorted:
+            g.fraction = atof(argv[optind + 2]);
+            break;
+    }
+
+    if(g.nrecs < 0 || g.rec_len < 0 || (g.mode == zipf
+                && (g.nkeys == 0 || g.skew <= 0))) {
         usage(argv[0]);
-        exit(0);
+        exit(1);
     }
 
-    if(mode == normal) {
-        if(argc < 6) {
-            usage(argv[0]);
-            exit(1);
-        }
+    /* chunks are whole records and, for direct I/O, whole blocks */
+    for(unit = g.size; unit % ALIGN != 0; unit += g.size)
+        ;
+    g.chunk_recs = (chunk_size + unit - 1) / unit * (unit / g.size);
+    g.nchunks = (g.nrecs + g.chunk_recs - 1) / g.chunk_recs;
 
-        nrecs = atol(argv[2]);
-        rec_len = atoi(argv[3]);
-        mean = atof(argv[4]);
-        stddev = atof(argv[5]);
-    } else {
-        if(argc < 5) {
-            usage(argv[0]);
+    if(filename) {
+        g.fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC
+                | (direct ? O_DIRECT : 0), 0644);
+        g.tail_fd = direct ? open(filename, O_WRONLY) : g.fd;
+        if(g.fd < 0 || g.tail_fd < 0) {
+            fprintf(stderr, "%s: %s\n", filename, strerror(errno));
             exit(1);
         }
-
-        nrecs = atol(argv[2]);
-        rec_len = atoi(argv[3]);
-        lambda = atof(argv[4]);
+    } else {
+        g.fd = g.tail_fd = 1;
     }
 
-    /* randomly seed the PRNG */
-    fd = open("/dev/urandom", O_RDONLY);
-    read(fd, &random_seed, sizeof(random_seed));
-    close(fd);
-    srandom(random_seed);
+    /* a pipe can't take writes out of order */
+    g.seekable = lseek(g.fd, 0, SEEK_CUR) >= 0;
 
-    block_size = recs_per_block * (key_len + rec_len);
-    block = (int8_t *) calloc(block_size, sizeof(int8_t));
+    pthread_mutex_init(&g.mutex, NULL);
+    pthread_cond_init(&g.written_cv, NULL);
 
-    /* to minimize disk operations, this loop fills up a block of records in
-     * memory before pushing them out */
+    threads = (pthread_t *) calloc(nthreads, sizeof(pthread_t));
+    for(i = 0; i < nthreads; i++)
+        pthread_create(threads + i, NULL, generator, NULL);
+    for(i = 0; i < nthreads; i++)
+        pthread_join(threads[i], NULL);
 
-    i = 0;
-    while(nrecs > 0) {
-        switch(mode) {
-            case normal:  n = gauss_rand(mean, stddev); break;
-            case poisson: n = poisson_rand(lambda);     break;
-        }
-
-        *((int64_t *) (block + i)) = n;
-        i = (i + key_len + rec_len) % block_size;
-        nrecs--;
+    if(__atomic_load_n(&g.failed, __ATOMIC_RELAXED))
+        exit(1);
 
-        if(i == 0) {
-            write(1, block, block_size);
+    if(filename) {
+        if(fsync(g.tail_fd) < 0 || (g.tail_fd != g.fd && close(g.tail_fd) < 0)
+                || close(g.fd) < 0) {
+            fprintf(stderr, "%s: %s\n", filename, strerror(errno));
+            exit(1);
         }
     }
 
+    free(threads);
+
     return 0;
 }
 
 void usage(char *progname)
 {
-    printf("normal:  %s -n nrecs rec_len mean stddev\n", progname);
-    printf("poisson: %s -p nrecs rec_len lambda\n", progname);
+    printf("normal:        %s [options] -n nrecs rec_len mean stddev\n",
+            progname);
+    printf("poisson:       %s [options] -p nrecs rec_len lambda\n", progname);
+    printf("uniform:       %s [options] -u nrecs rec_len\n", progname);
+    printf("zipf:          %s [options] -z nrecs rec_len nkeys skew\n",
+            progname);
+    printf("sorted:        %s [options] -s nrecs rec_len\n", progname);
+    printf("nearly sorted: %s [options] -a nrecs rec_len fraction\n",
+            progname);
+    printf("options:\n");
+    printf("  -o file   write to file instead of stdout\n");
+    printf("  -S seed   seed (default 1); the same seed gives the same data\n");
+    printf("  -t n      generator threads (default: one per CPU)\n");
+    printf("  -P kind   payload: random (default), zero or index\n");
+    printf("  -d        direct I/O (O_DIRECT) to the output file\n");
+    printf("  -c bytes  bytes generated and written at a time "
+            "(default 8M)\n");
 }
 
-/* Algorithm used is due to Knuth: http://c-faq.com/lib/gaussian.html */
-int64_t gauss_rand(double mean, double stddev)
+void *generator(void *data)
 {
-    static double V1, V2, S;
-    static int phase = 0;
-    double X;
+    char *chunk;
+    uint64_t c, first, n;
+
+    if(posix_memalign((void **) &chunk, ALIGN, g.chunk_recs * g.size) != 0) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
 
-    if(phase == 0) {
-        do {
-            double U1 = (double)random() / RAND_MAX;
-            double U2 = (double)random() / RAND_MAX;
+    for(;;) {
+        pthread_mutex_lock(&g.mutex);
+        c = g.next_chunk++;
+        pthread_mutex_unlock(&g.mutex);
 
-            V1 = 2 * U1 - 1;
-            V2 = 2 * U2 - 1;
-            S = V1 * V1 + V2 * V2;
-        } while(S >= 1 || S == 0);
+        if(c >= g.nchunks || __atomic_load_n(&g.failed, __ATOMIC_RELAXED))
+            break;
 
-        X = V1 * sqrt(-2 * log(S) / S);
-    } else {
-        X = V2 * sqrt(-2 * log(S) / S);
+        first = c * g.chunk_recs;
+        n = g.nrecs - first < g.chunk_recs ? g.nrecs - first : g.chunk_recs;
+
+        fill_chunk(chunk, first, n);
+        write_chunk(chunk, c, n * g.size);
     }
 
-    phase = 1 - phase;
+    free(chunk);
 
-    return (int64_t) (X * stddev + mean);
+    return NULL;
+}
+
+/* the key of record i */
+int64_t gen_key(uint64_t i)
+{
+    switch(g.mode) {
+        case normal:
+            return (int64_t) (fg_rand_normal(g.seed, i) * g.stddev + g.mean);
+        case poisson:
+            return fg_rand_poisson(g.seed, i, g.lambda);
+        case zipf:
+            /* ranks 1..nkeys, the commonest first */
+            return (int64_t) fg_rand_zipf(g.seed, i, g.nkeys, g.skew);
+        case sorted:
+            return (int64_t) i;
+        case nearly_sorted:
+            /* in place, except a fraction of records with any key at all */
+            if(fg_rand_double(fg_rand_substream(g.seed, i), 0) < g.fraction)
+                return (int64_t) (fg_rand_u64(g.seed, i) % g.nrecs);
+            return (int64_t) i;
+        default:
+            return (int64_t) fg_rand_u64(g.seed, i);
+    }
 }
 
-/* algorithm used due to Knuth:
- * http://en.wikipedia.org/wiki/Poisson_distribution */
-int64_t poisson_rand(double lambda)
+/* records first to first + n - 1 */
+void fill_chunk(char *chunk, uint64_t first, uint64_t n)
 {
-    double L = exp(-1.0 * lambda);
-    int64_t k = 0;
-    double p = 1.0;
+    uint64_t i, w, r, stream;
+    int64_t key;
+    char *rec;
 
-    do {
-        k = k + 1;
-        p = p * (double) random() / (double) RAND_MAX;
-    } while (p > L);
+    for(i = 0; i < n; i++) {
+        rec = chunk + i * g.size;
+        key = gen_key(first + i);
+        memcpy(rec, &key, key_len);
 
-    return k - 1;
+        switch(g.payload) {
+            case payload_zero:
+                memset(rec + key_len, 0, g.rec_len);
+                break;
+            case payload_index:
+                memset(rec + key_len, 0, g.rec_len);
+                r = first + i;
+                memcpy(rec + key_len, &r, g.rec_len < (int64_t) sizeof(r)
+                        ? g.rec_len : (int64_t) sizeof(r));
+                break;
+            case payload_random:
+                /* a stream of its own for each record's payload */
+                stream = fg_rand_substream(~g.seed, first + i);
+                for(w = 0; w * sizeof(r) < (uint64_t) g.rec_len; w++) {
+                    r = fg_rand_u64(stream, w);
+                    memcpy(rec + key_len + w * sizeof(r), &r,
+                            g.rec_len - w * sizeof(r) < sizeof(r)
+                            ? g.rec_len - w * sizeof(r) : sizeof(r));
+                }
+                break;
+        }
+    }
 }
 
+void write_chunk(char *chunk, uint64_t c, size_t len)
+{
+    off_t offset = (off_t) c * g.chunk_recs * g.size;
+    size_t done;
+    ssize_t n;
+    int fd;
+
+    /* only whole chunks are aligned for direct I/O */
+    fd = len == g.chunk_recs * g.size ? g.fd : g.tail_fd;
+
+    if(!g.seekable) {
+        pthread_mutex_lock(&g.mutex);
+        while(g.next_write != c
+                && !__atomic_load_n(&g.failed, __ATOMIC_RELAXED))
+            pthread_cond_wait(&g.written_cv, &g.mutex);
+        pthread_mutex_unlock(&g.mutex);
+    }
+
+    for(done = 0; done < len; done += n) {
+        if(g.seekable)
+            n = pwrite(fd, chunk + done, len - done, offset + done);
+        else
+            n = write(fd, chunk + done, len - done);
+
+        if(n <= 0) {
+            fprintf(stderr, "write failed: %s\n", strerror(errno));
+            __atomic_store_n(&g.failed, 1, __ATOMIC_RELAXED);
+            break;
+        }
+    }
+
+    if(!g.seekable) {
+        pthread_mutex_lock(&g.mutex);
+        g.next_write++;
+        pthread_cond_broadcast(&g.written_cv);
+        pthread_mutex_unlock(&g.mutex);
+    }
+}
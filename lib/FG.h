@@ -18,20 +18,62 @@ typedef struct _FG_buf FG_buf;
 typedef struct _FG_module FG_module;
 typedef struct _FG_stage_def FG_stage_def;
 
+/* runtime statistics, as returned by fg_network_get_stats() */
+#define FG_STAT_UNAVAILABLE UINT64_MAX
+
+typedef struct {
+    char *name;
+    int direction;              /* 0 for input pins, 1 for output pins */
+    uint64_t buffers;           /* accepted (inputs) or conveyed (outputs) */
+    uint64_t bytes;
+    uint32_t occupancy_min;     /* queue occupancy, input pins only */
+    uint32_t occupancy_max;
+    double occupancy_avg;
+} FG_pin_stats;
+
+typedef struct {
+    char *name;
+    uint64_t func_calls;
+    uint64_t func_ns;           /* total time inside the stage function */
+    uint64_t starved_ns;        /* of which waiting for input */
+    uint64_t backpressure_ns;   /* of which waiting for empty buffers */
+
+    /* hardware counters, if enabled for the network; FG_STAT_UNAVAILABLE
+     * if not, or if the CPU or kernel can't count them */
+    uint64_t cycles;
+    uint64_t instructions;
+    uint64_t llc_misses;
+    uint64_t dtlb_misses;
+
+    int pin_count;
+    FG_pin_stats *pins;
+} FG_stage_stats;
+
+typedef struct {
+    char *name;
+    uint64_t run_ns;            /* wall-clock time of the run */
+    int perf_counters;          /* hardware counters were collected */
+    int stage_count;
+    FG_stage_stats *stages;
+} FG_network_stats;
+
 /* FG context */
 int fg_init(int *argc, char **argv[]);
 int fg_fini(void);
 void fg_print_stage_defs(void);
+int fg_module_path_add(const char *dir);
 
 /* networks */
 FG_network *fg_network_create(const char *name, uint32_t default_bufcount,
-        uint32_t default_bufsize);
+        uint64_t default_bufsize);
 void fg_network_set_default_bufcount(FG_network *nw,
         uint32_t default_bufcount);
-void fg_network_set_default_bufsize(FG_network *nw, uint32_t default_bufsize);
+void fg_network_set_default_bufsize(FG_network *nw, uint64_t default_bufsize);
+void fg_network_set_init_threads(FG_network *nw, int n);
 void fg_network_destroy(FG_network *nw);
 int fg_network_fix(FG_network *nw);
 void fg_network_run(FG_network *nw);
+int fg_network_failed(FG_network *nw);
 void fg_network_print(FG_network *nw);
 FG_stage *fg_network_get_stage_by_name(FG_network *nw, const char *stage_name);
 int fg_network_rename_param(FG_network *nw, const char *stage_name,
@@ -42,6 +84,23 @@ int fg_network_merge(FG_network *nw1, FG_network *nw2);
 int fg_network_set_param(FG_network *nw, char *param, const char *value);
 char *fg_network_get_param(FG_network *nw, const char *param);
 
+/* fg_stats.c */
+FG_network_stats *fg_network_get_stats(FG_network *nw);
+void fg_network_stats_free(FG_network_stats *stats);
+void fg_network_print_stats(FG_network *nw);
+void fg_network_set_print_stats(FG_network *nw, int print_stats);
+void fg_network_print_bottleneck(FG_network *nw);
+void fg_network_set_print_bottleneck(FG_network *nw, int print_bottleneck);
+
+/* fg_perf.c */
+void fg_network_set_perf_counters(FG_network *nw, int perf_counters);
+
+/* fg_trace.c */
+void fg_network_set_trace(FG_network *nw, const char *filename);
+
+/* fg_metrics.c */
+void fg_network_set_metrics_socket(FG_network *nw, const char *path);
+
 /* fg_network_config.c */
 FG_network *fg_network_from_config(const char *name, const char *filename);
 
@@ -52,12 +111,16 @@ int fg_stage_set_param(FG_stage *stage, const char *param, const char *value);
 char *fg_stage_get_param(FG_stage *stage, const char *param);
 void fg_stage_destroy(FG_stage *stage);  /* here or internal? */
 FG_pin *fg_stage_pin_get_by_name(FG_stage *stage, const char *name);
+int fg_stage_init_after(FG_stage *stage, FG_stage *dep);
 
 /* pins */
 int fg_pin_connect(FG_stage *ins, const char *inp, FG_stage *outs,
         const char *outp);
-void fg_pin_set_buffer_size(FG_pin *pin, uint32_t size);
+void fg_pin_set_buffer_size(FG_pin *pin, uint64_t size);
 void fg_pin_set_buffer_count(FG_pin *pin, uint32_t count);
 
+/* fg_capture.c */
+int fg_pin_set_capture(FG_pin *pin, const char *filename);
+
 #endif /* __FG_H */
 
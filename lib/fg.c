@@ -2,66 +2,104 @@
  * fg.c
  */
 
+#define _GNU_SOURCE /* for asprintf() */
 #include <stdio.h>
 #include <dlfcn.h>
 #include <stdlib.h>
 #include <string.h>
-#include <stdarg.h>
+#include <dirent.h>
+#include <pthread.h>
 
 #include "fg_internal.h"
 
+/* limits on what fg_context keeps track of */
+#define MAX_MODULES 100
+#define MAX_STAGE_DEFS 100
+#define MAX_MODULE_DIRS 32
+
+/* modules that used to be loaded unconditionally; still tried, through the
+ * dynamic linker's own search path, when there is no module index to say
+ * which module provides a stage def */
+static const char *legacy_modules[] = { "io_module.so",
+                                        "dsort_module.so",
+                                        "gen_module.so",
+                                        "mpi_module.so",
+                                        NULL
+                                      };
+
 /* local-use funcs */
-static void *get_sym(void *handle, const char *name);
+static void *get_sym(void *handle, const char *name, int quiet);
+static FG_module *module_load(const char *path, int quiet);
+static int module_index_load(const char *dir);
+static int module_dir_load(const char *dir, const char *stage_def_name);
+static FG_stage_def *stage_def_find_loaded(const char *name);
+static int is_module_file(const struct dirent *d);
+
+struct module_index_entry {
+    char *stage_def_name;
+    char *path;
+};
 
 static struct {
-    int log_settings;           /* should this be associated with a network? */
-
     FG_module **modules;        /* NULL_terminated list of loaded modules */
     int module_count;
 
     FG_stage_def **stage_defs;  /* NULL-terminated list of stage definitions */
     int stage_def_count;
+
+    char **module_path;         /* NULL-terminated list of module dirs */
+    int module_path_indexed[MAX_MODULE_DIRS];   /* has an index file */
+    int module_path_count;
+
+    /* stage def name -> module file, from the index in each module dir */
+    struct module_index_entry *index;
+    int index_count;
+
+    pthread_mutex_t module_mutex;
 } fg_context;
 
 int fg_init(int *argc, char **argv[])
 {
-    fg_context.log_settings = FG_LOG_NETWORK | FG_LOG_STAGE;
+    char *path, *dir;
+
+    fg_log_start();
 
     fg_log(FG_LOG_MAIN, "initializing FG\n");
 
-    /* HACK: magic number! */
-    fg_context.modules = (FG_module **) calloc(101, sizeof(FG_module *));
+    fg_context.modules = (FG_module **) calloc(MAX_MODULES + 1,
+            sizeof(FG_module *));
     fg_context.module_count = 0;
 
-    /* HACK: magic number! */
-    fg_context.stage_defs = (FG_stage_def **) calloc(101,
+    fg_context.stage_defs = (FG_stage_def **) calloc(MAX_STAGE_DEFS + 1,
             sizeof(FG_stage_def *));
     fg_context.stage_def_count = 0;
 
-    /* Eventually, this will search a predefined list of paths and add all
-     * modules found therein */
-    fg_log(FG_LOG_MAIN, "  loading modules\n");
-    fg_module_load("io_module.so");
-    fg_module_load("dsort_module.so");
-    fg_module_load("mpi_module.so");
+    fg_context.module_path = (char **) calloc(MAX_MODULE_DIRS + 1,
+            sizeof(char *));
+    fg_context.module_path_count = 0;
 
-    return 0;
-}
+    fg_context.index = NULL;
+    fg_context.index_count = 0;
 
-void fg_log(int log_domain, const char *s, ...)
-{
-    va_list ap;
+    pthread_mutex_init(&fg_context.module_mutex, NULL);
 
-    if(log_domain & fg_context.log_settings) {
-        va_start(ap, s);
-        vprintf(s, ap);
-        va_end(ap);
+    /* modules are no longer loaded here; fg_stage_def_get_by_name() loads
+     * the one providing a stage def the first time that def is asked for */
+    if(getenv("FG_MODULE_PATH")) {
+        path = strdup(getenv("FG_MODULE_PATH"));
+        for(dir = strtok(path, ":"); dir; dir = strtok(NULL, ":"))
+            fg_module_path_add(dir);
+        free(path);
     }
+
+    return 0;
 }
 
 int fg_fini(void)
 {
     FG_module **module;
+    char **dir;
+    int i;
 
     fg_log(FG_LOG_MAIN, "shutting down FG\n");
 
@@ -73,34 +111,162 @@ int fg_fini(void)
     }
     free(fg_context.modules);
 
+    for(dir=fg_context.module_path; *dir; dir++)
+        free(*dir);
+    free(fg_context.module_path);
+
+    for(i=0; i<fg_context.index_count; i++) {
+        free(fg_context.index[i].stage_def_name);
+        free(fg_context.index[i].path);
+    }
+    free(fg_context.index);
+
+    pthread_mutex_destroy(&fg_context.module_mutex);
+
     fg_log(FG_LOG_MAIN, "FG shutdown complete\n");
 
+    fg_log_stop();
+
     return 0;
 }
 
-int fg_module_load(const char *path)
+/* appends a directory to the module search path and reads its index file, if
+ * it has one */
+int fg_module_path_add(const char *dir)
+{
+    int i;
+
+    pthread_mutex_lock(&fg_context.module_mutex);
+
+    for(i=0; i<fg_context.module_path_count; i++) {
+        if(strcmp(dir, fg_context.module_path[i]) == 0) {
+            pthread_mutex_unlock(&fg_context.module_mutex);
+            return 0;
+        }
+    }
+
+    if(fg_context.module_path_count == MAX_MODULE_DIRS) {
+        pthread_mutex_unlock(&fg_context.module_mutex);
+        fprintf(stderr, "too many module directories, ignoring %s\n", dir);
+        return -1;
+    }
+
+    fg_log(FG_LOG_MODULE, "module directory %s\n", dir);
+    fg_context.module_path_indexed[fg_context.module_path_count] =
+        module_index_load(dir) == 0;
+    fg_context.module_path[fg_context.module_path_count++] = strdup(dir);
+
+    pthread_mutex_unlock(&fg_context.module_mutex);
+
+    return 0;
+}
+
+char **fg_module_path_get(void)
+{
+    return fg_context.module_path;
+}
+
+/* Index files map stage def names to the modules providing them, one
+ * "stage-def-name module-file" pair per line, with module files relative to
+ * the directory holding the index.  bin/fg_module_index writes them. */
+static int module_index_load(const char *dir)
+{
+    FILE *f;
+    char filename[BUFSIZ];
+    char line[BUFSIZ];
+    char *name, *file;
+    struct module_index_entry *e;
+
+    snprintf(filename, sizeof(filename), "%s/%s", dir, FG_MODULE_INDEX);
+    f = fopen(filename, "r");
+    if(!f)
+        return -1;
+
+    fg_log(FG_LOG_MODULE, "reading module index %s\n", filename);
+
+    while(fgets(line, sizeof(line), f)) {
+        name = strtok(line, " \t\n");
+        file = strtok(NULL, " \t\n");
+        if(!name || !file || *name == '#')
+            continue;
+
+        fg_context.index = (struct module_index_entry *) realloc(
+                fg_context.index, (fg_context.index_count + 1)
+                * sizeof(struct module_index_entry));
+        e = fg_context.index + fg_context.index_count;
+
+        if(*file == '/')
+            e->path = strdup(file);
+        else if(asprintf(&e->path, "%s/%s", dir, file) < 0)
+            continue;
+        e->stage_def_name = strdup(name);
+        fg_context.index_count++;
+    }
+
+    fclose(f);
+
+    return 0;
+}
+
+/* loads the module at the given path (anything dlopen() accepts) unless it
+ * has been loaded already; returns NULL if it cannot be loaded */
+FG_module *fg_module_load(const char *path)
+{
+    return module_load(path, 0);
+}
+
+/* as fg_module_load(), but when quiet a file that is not a loadable module
+ * is only logged: looking for a stage def may try several that aren't */
+static FG_module *module_load(const char *path, int quiet)
 {
     void *handle;
     int i;
     FG_module *module;
     FG_stage_def *sd;
+    FG_stage_def *stage_defs;
+    char *name;
+
+    for(i=0; i<fg_context.module_count; i++) {
+        if(strcmp(path, fg_context.modules[i]->path) == 0)
+            return fg_context.modules[i];
+    }
+
+    if(fg_context.module_count == MAX_MODULES) {
+        fprintf(stderr, "too many modules, not loading %s\n", path);
+        return NULL;
+    }
 
     fg_log(FG_LOG_MODULE, "Loading module %s\n", path);
     handle = dlopen(path, RTLD_LAZY);
     if(!handle) {
-        fprintf(stderr, "dlopen failed: %s\n", dlerror());
-        exit(1);
+        if(quiet)
+            fg_log(FG_LOG_MODULE, "dlopen failed: %s\n", dlerror());
+        else
+            fprintf(stderr, "dlopen failed: %s\n", dlerror());
+        return NULL;
+    }
+
+    stage_defs = (FG_stage_def *) get_sym(handle, "fg_module_export", quiet);
+    name = (char *) get_sym(handle, "fg_module_name", quiet);
+    if(!stage_defs || !name) {
+        dlclose(handle);
+        return NULL;
     }
 
     module = (FG_module *) malloc(sizeof(FG_module));
     module->path = strdup(path);
     module->handle = handle;
-    module->stage_defs = (FG_stage_def *) get_sym(handle, "fg_module_export");
-
-    module->name = (char *) get_sym(handle, "fg_module_name");
+    module->stage_defs = stage_defs;
+    module->name = name;
 
     /* NOTE: this implies a flat stage namespace */
-    for(sd=module->stage_defs, i=0; sd->name; sd++, i++) {
+    for(sd=module->stage_defs; sd->name; sd++) {
+        if(fg_context.stage_def_count == MAX_STAGE_DEFS) {
+            fprintf(stderr, "too many stage definitions, ignoring %s\n",
+                    sd->name);
+            break;
+        }
+
         fg_log(FG_LOG_MODULE, "    %s\n", sd->name);
         *(fg_context.stage_defs + fg_context.stage_def_count) = sd;
         fg_context.stage_def_count++;
@@ -110,7 +276,7 @@ int fg_module_load(const char *path)
     *(fg_context.modules + fg_context.module_count) = module;
     fg_context.module_count++;
 
-    return 0;
+    return module;
 }
 
 void fg_module_unload(FG_module *module)
@@ -120,8 +286,6 @@ void fg_module_unload(FG_module *module)
     if(!module)
         return;
 
-    free(module);
-
     (void) dlerror();       /* clear error flag */
     dlclose(module->handle);
     s = dlerror();
@@ -129,6 +293,60 @@ void fg_module_unload(FG_module *module)
         fprintf(stderr, "dlclose failed: %s\n", s);
         exit(1);
     }
+
+    free(module->path);
+    free(module);
+}
+
+/* loads every module in the search path plus the legacy modules, for tools
+ * that want to see all stage defs rather than look one up */
+void fg_module_load_all(void)
+{
+    const char **legacy;
+    int i;
+
+    pthread_mutex_lock(&fg_context.module_mutex);
+
+    for(i=0; i<fg_context.module_path_count; i++)
+        module_dir_load(fg_context.module_path[i], NULL);
+
+    for(legacy = legacy_modules; *legacy; legacy++)
+        fg_module_load(*legacy);
+
+    pthread_mutex_unlock(&fg_context.module_mutex);
+}
+
+/* loads the modules in a directory, in name order, stopping once one of
+ * them provides stage_def_name (if not NULL, in which case files that are
+ * not modules are passed over quietly); returns 0 if it was found */
+static int module_dir_load(const char *dir, const char *stage_def_name)
+{
+    struct dirent **entries;
+    char path[BUFSIZ];
+    int i, n;
+    int found = 0;
+
+    n = scandir(dir, &entries, is_module_file, alphasort);
+    if(n < 0)
+        return -1;
+
+    for(i=0; i<n; i++) {
+        snprintf(path, sizeof(path), "%s/%s", dir, entries[i]->d_name);
+        if(!found && module_load(path, stage_def_name != NULL)
+                && stage_def_name)
+            found = stage_def_find_loaded(stage_def_name) != NULL;
+        free(entries[i]);
+    }
+    free(entries);
+
+    return found ? 0 : -1;
+}
+
+static int is_module_file(const struct dirent *d)
+{
+    size_t len = strlen(d->d_name);
+
+    return len > 3 && strcmp(d->d_name + len - 3, ".so") == 0;
 }
 
 void fg_print_stage_defs(void)
@@ -146,7 +364,7 @@ void fg_print_stage_defs(void)
     }
 }
 
-FG_stage_def *fg_stage_def_get_by_name(const char *name)
+static FG_stage_def *stage_def_find_loaded(const char *name)
 {
     FG_stage_def **sd;
 
@@ -158,7 +376,46 @@ FG_stage_def *fg_stage_def_get_by_name(const char *name)
     return NULL;
 }
 
-void *get_sym(void *handle, const char *name)
+/* Looks for a stage def among the modules loaded so far, loading another
+ * module if need be: the one named by the module indexes.  A directory's
+ * index is taken as complete, so a name it lacks is not looked for among
+ * its modules; only directories without an index have each of their
+ * modules tried, and the legacy modules are tried only if no directory has
+ * an index. */
+FG_stage_def *fg_stage_def_get_by_name(const char *name)
+{
+    FG_stage_def *sd;
+    const char **legacy;
+    int i;
+
+    pthread_mutex_lock(&fg_context.module_mutex);
+
+    sd = stage_def_find_loaded(name);
+
+    for(i=0; !sd && i<fg_context.index_count; i++) {
+        if(strcmp(name, fg_context.index[i].stage_def_name) == 0
+                && fg_module_load(fg_context.index[i].path))
+            sd = stage_def_find_loaded(name);
+    }
+
+    for(i=0; !sd && i<fg_context.module_path_count; i++) {
+        if(!fg_context.module_path_indexed[i]
+                && module_dir_load(fg_context.module_path[i], name) == 0)
+            sd = stage_def_find_loaded(name);
+    }
+
+    for(legacy = legacy_modules; !sd && fg_context.index_count == 0
+            && *legacy; legacy++) {
+        if(module_load(*legacy, 1))
+            sd = stage_def_find_loaded(name);
+    }
+
+    pthread_mutex_unlock(&fg_context.module_mutex);
+
+    return sd;
+}
+
+void *get_sym(void *handle, const char *name, int quiet)
 {
     void *sym;
     char *s;
@@ -168,8 +425,11 @@ void *get_sym(void *handle, const char *name)
 
     s = dlerror();
     if(s) {
-        fprintf(stderr, "dlsym failed: %s\n", s);
-        exit(1);
+        if(quiet)
+            fg_log(FG_LOG_MODULE, "dlsym failed: %s\n", s);
+        else
+            fprintf(stderr, "dlsym failed: %s\n", s);
+        return NULL;
     }
 
     return sym;
@@ -187,3 +447,29 @@ FG_stage_def **fg_get_stage_defs(void) {
     return fg_context.stage_defs;
 }
 
+/* Adds a stage def that lives in the program rather than in a module, such as
+ * the feeders and drains of a test harness.  Names share the namespace of
+ * module stage defs, and the def must outlive every stage made from it. */
+int fg_stage_def_register(FG_stage_def *sd)
+{
+    int rc = 0;
+
+    pthread_mutex_lock(&fg_context.module_mutex);
+
+    if(fg_context.stage_def_count == MAX_STAGE_DEFS) {
+        fprintf(stderr, "too many stage definitions, ignoring %s\n",
+                sd->name);
+        rc = -1;
+    } else if(stage_def_find_loaded(sd->name)) {
+        fprintf(stderr, "stage definition %s already exists\n", sd->name);
+        rc = -1;
+    } else {
+        fg_log(FG_LOG_MODULE, "registered stage definition %s\n", sd->name);
+        *(fg_context.stage_defs + fg_context.stage_def_count) = sd;
+        fg_context.stage_def_count++;
+    }
+
+    pthread_mutex_unlock(&fg_context.module_mutex);
+
+    return rc;
+}
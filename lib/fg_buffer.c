@@ -3,12 +3,13 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <malloc.h>
 #include <openssl/sha.h>
 
 #include "fg_internal.h"
 
-FG_buf *fg_buffer_create(int id, int size)
+FG_buf *fg_buffer_create(int id, uint64_t size)
 {
     FG_buf *buf;
 
@@ -16,7 +17,14 @@ FG_buf *fg_buffer_create(int id, int size)
 
     buf->id = id;
     buf->size = size;
-    buf->data = (char *) malloc(size);
+    buf->datalen = 0;
+    buf->trace_seq = 0;
+    buf->offset = 0;
+    buf->tag = 0;
+    /* aligned for stages that do direct I/O straight from buffers */
+    if(posix_memalign((void **) &buf->data, FG_BUF_ALIGN, size) != 0)
+        buf->data = NULL;
+    buf->alloc = buf->data;
 
     return buf;
 }
@@ -24,7 +32,7 @@ FG_buf *fg_buffer_create(int id, int size)
 void fg_buffer_destroy(FG_buf *buf)
 {
     if(buf) {
-        free(buf->data);
+        free(buf->alloc);
         free(buf);
     }
 }
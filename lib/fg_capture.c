@@ -0,0 +1,131 @@
+/*
+ * fg_capture.c
+ *
+ * Capture of the buffer stream crossing a pin.  While a network runs, every
+ * buffer accepted on a capturing input pin, or conveyed on a capturing output
+ * pin, is appended to the pin's capture file: when it crossed, relative to
+ * the start of the run, its round number, size and datalen, and its first
+ * datalen bytes.  The replay stage (modules/io_module.c) feeds a capture
+ * back into a network, so the half of a network downstream of a pin can be
+ * run and profiled without the half upstream of it.
+ *
+ * Records are written by the thread of the pin's stage, as buffers cross, so
+ * the stage's time includes the writing; a capture of a fast stream is only
+ * as fast as the disk it goes to.
+ *
+ * The file is a struct fg_capture_header followed by one struct
+ * fg_capture_record per buffer, each followed by its data; see
+ * fg_internal.h.  Integers are in the byte order of the machine that wrote
+ * them.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "fg_internal.h"
+
+/* captures are written in large blocks, whatever the buffer size */
+#define FG_CAPTURE_IOBUF (1024 * 1024)
+
+static void capture_close(FG_pin *pin);
+
+int fg_pin_set_capture(FG_pin *pin, const char *filename)
+{
+    if(!pin)
+        return -1;
+
+    free(pin->capture_file);
+    pin->capture_file = filename ? strdup(filename) : NULL;
+
+    return 0;
+}
+
+/* opens the capture file of every capturing pin */
+void fg_capture_start(FG_network *nw)
+{
+    struct fg_capture_header h;
+    FG_stage **stage;
+    FG_pin **pin;
+
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, FG_CAPTURE_MAGIC, sizeof(h.magic));
+
+    for(stage = nw->stages; *stage; stage++) {
+        for(pin = (*stage)->pins; *pin; pin++) {
+            if(!(*pin)->capture_file)
+                continue;
+
+            snprintf(h.pin, sizeof(h.pin), "%s.%s", (*stage)->name,
+                    (*pin)->name);
+
+            (*pin)->capture = fopen((*pin)->capture_file, "w");
+            if(!(*pin)->capture) {
+                fprintf(stderr, "%s: cannot capture %s: %s\n",
+                        (*pin)->capture_file, h.pin, strerror(errno));
+                continue;
+            }
+
+            (*pin)->capture_iobuf = (char *) malloc(FG_CAPTURE_IOBUF);
+            if((*pin)->capture_iobuf)
+                setvbuf((*pin)->capture, (*pin)->capture_iobuf, _IOFBF,
+                        FG_CAPTURE_IOBUF);
+
+            if(fwrite(&h, sizeof(h), 1, (*pin)->capture) != 1) {
+                fprintf(stderr, "%s: write failed\n", (*pin)->capture_file);
+                capture_close(*pin);
+                continue;
+            }
+
+            fg_log(FG_LOG_PIN, "capturing %s to %s\n", h.pin,
+                    (*pin)->capture_file);
+        }
+    }
+}
+
+void fg_capture_finish(FG_network *nw)
+{
+    FG_stage **stage;
+    FG_pin **pin;
+
+    for(stage = nw->stages; *stage; stage++)
+        for(pin = (*stage)->pins; *pin; pin++)
+            capture_close(*pin);
+}
+
+static void capture_close(FG_pin *pin)
+{
+    if(!pin->capture)
+        return;
+
+    if(fclose(pin->capture) != 0)
+        fprintf(stderr, "%s: write failed: %s\n", pin->capture_file,
+                strerror(errno));
+
+    free(pin->capture_iobuf);
+    pin->capture = NULL;
+    pin->capture_iobuf = NULL;
+}
+
+/* appends a buffer to the pin's capture; index is the connection of a pin
+ * array it came through, 0 otherwise */
+void fg_capture_record(FG_pin *pin, FG_buf *buf, uint32_t index)
+{
+    struct fg_capture_record r;
+
+    r.ts_ns = fg_now_ns() - pin->stage->nw->run_start_ns;
+    r.datalen = buf->datalen;
+    r.size = buf->size;
+    r.round_num = buf->round_num;
+    r.index = index;
+
+    if(fwrite(&r, sizeof(r), 1, pin->capture) != 1
+            || fwrite(buf->data, 1, buf->datalen, pin->capture)
+                != buf->datalen) {
+        /* give up on this capture rather than the run */
+        fprintf(stderr, "%s: write failed, capture of %s.%s stopped\n",
+                pin->capture_file, pin->stage->name, pin->name);
+        capture_close(pin);
+    }
+}
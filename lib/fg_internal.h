@@ -5,14 +5,17 @@
 #ifndef __FG_INTERNAL_H
 #define __FG_INTERNAL_H
 
+#include <stdio.h>
 #include <stdarg.h>
+#include <time.h>
 #include <pthread.h>
 
 #include "FG.h"
 
 enum fg_stage_result {
     FG_STAGE_SUCCESS,
-    FG_STAGE_TERMINATE
+    FG_STAGE_TERMINATE,
+    FG_STAGE_ERROR          /* terminate, and fail the run */
 };
 
 enum fg_log_domain {
@@ -22,9 +25,66 @@ enum fg_log_domain {
     FG_LOG_PIN = 0x8,
     FG_LOG_STAGE = 0x10,
     FG_LOG_NETWORK = 0x20,
-    FG_LOG_MODULE = 0x40
+    FG_LOG_MODULE = 0x40,
+    FG_LOG_DATA = 0x80,         /* per-buffer messages from stages */
+
+    FG_LOG_ALL = 0xff
 };
 
+/* hardware counters collected per stage; see fg_perf.c */
+enum fg_perf_counter {
+    FG_PERF_CYCLES,
+    FG_PERF_INSTRUCTIONS,
+    FG_PERF_LLC_MISSES,
+    FG_PERF_DTLB_MISSES,
+
+    FG_PERF_COUNTERS
+};
+
+/* events recorded by the tracer; see fg_trace.c */
+enum fg_trace_event {
+    FG_TRACE_FUNC,
+    FG_TRACE_STARVED,
+    FG_TRACE_BACKPRESSURE,
+    FG_TRACE_ACCEPT,
+    FG_TRACE_CONVEY
+};
+
+/* Log levels, chosen at compile time with -DFG_LOG_LEVEL=n.  Messages in
+ * domains above the level are compiled out entirely, arguments and all:
+ *   0: nothing
+ *   1: setting up, running and tearing down networks (default with NDEBUG)
+ *   2: also every buffer read, written and conveyed (default otherwise)
+ * Within the compiled-in domains, fg_log_domains (FG_LOG in the environment)
+ * picks what is actually logged at run time. */
+#ifndef FG_LOG_LEVEL
+#ifdef NDEBUG
+#define FG_LOG_LEVEL 1
+#else
+#define FG_LOG_LEVEL 2
+#endif
+#endif
+
+#define FG_LOG_SETUP (FG_LOG_MAIN | FG_LOG_PIN | FG_LOG_STAGE \
+                      | FG_LOG_NETWORK | FG_LOG_MODULE)
+
+#if FG_LOG_LEVEL >= 2
+#define FG_LOG_COMPILED FG_LOG_ALL
+#elif FG_LOG_LEVEL == 1
+#define FG_LOG_COMPILED FG_LOG_SETUP
+#else
+#define FG_LOG_COMPILED 0
+#endif
+
+extern int fg_log_domains;
+
+#define fg_log(log_domain, ...) \
+    do { \
+        if(((log_domain) & FG_LOG_COMPILED) \
+                && ((log_domain) & fg_log_domains)) \
+            fg_log_write(__VA_ARGS__); \
+    } while(0)
+
 struct _FG_module {
     char *path;
     char *name;
@@ -43,9 +103,23 @@ struct _FG_network {
     char *name;
     int stage_count;
     FG_stage **stages;
-    unsigned int default_bufsize;
+    uint64_t default_bufsize;
     unsigned int default_bufcount;
     FG_param_rename **params;
+    int init_threads;       /* size of the stage init thread pool */
+    int print_stats;        /* print statistics after fg_network_run */
+    int print_bottleneck;   /* and name the bottleneck */
+    int perf_counters;      /* collect hardware counters per stage */
+    uint64_t run_start_ns;
+    uint64_t run_ns;        /* wall-clock time of the last run */
+    int failed;             /* a stage of the last run returned an error */
+    char *trace_file;       /* Chrome trace written after run, if set */
+
+    /* live metrics server; see fg_metrics.c */
+    char *metrics_path;
+    int metrics_fd;
+    int metrics_stop;
+    pthread_t metrics_thread;
 };
 
 struct _FG_stage_def {
@@ -66,6 +140,19 @@ struct _FG_stage {
     FG_stage_def *sd;
     FG_network *nw;
     char **param_vals;
+    FG_stage **init_deps;   /* stages whose init must finish before ours */
+    int init_dep_count;
+
+    /* statistics; see fg_stats.c */
+    uint64_t func_calls;
+    uint64_t func_ns;           /* inside sd->func, including waits */
+    uint64_t starved_ns;        /* waiting for input buffers */
+    uint64_t backpressure_ns;   /* waiting for empty buffers to come back */
+
+    struct fg_trace_ring *trace;    /* only while a traced network runs */
+
+    int perf_fd[FG_PERF_COUNTERS];
+    uint64_t perf[FG_PERF_COUNTERS];
 };
 
 struct _FG_pin {
@@ -73,20 +160,40 @@ struct _FG_pin {
     int direction;
     FG_stage *stage;
     FG_queue *queue;        /* could be made */
-    FG_queue **queues;      /* into a union */
+    FG_queue **queues;      /* into a union; a pin array's connections */
     uint32_t queue_count;
+    uint32_t queue_capacity;
     uint32_t bufcount;
-    uint32_t bufsize;
+    uint64_t bufsize;
     uint32_t cur_round_num;
+
+    /* statistics: buffers accepted on input pins, conveyed on output pins */
+    uint64_t buffers;
+    uint64_t bytes;
+
+    /* capture of the buffers crossing the pin; see fg_capture.c */
+    char *capture_file;
+    FILE *capture;          /* only while the network runs */
+    char *capture_iobuf;
 };
 
+/* Buffer data is aligned to this, which satisfies O_DIRECT on any device
+ * with sectors of up to a page */
+#define FG_BUF_ALIGN 4096
+
 struct _FG_buf {
     unsigned int id;
     unsigned int round_num;
     FG_pin *origin;
     char *data;
-    unsigned int size;
-    unsigned int datalen;       /* if data doesn't occupy whole buffer... */
+    char *alloc;                /* data as allocated, freed with the buffer;
+                                   stages may point data elsewhere */
+    uint64_t size;
+    uint64_t datalen;           /* if data doesn't occupy whole buffer... */
+    unsigned int trace_seq;     /* times conveyed, to pair trace events */
+    uint64_t offset;            /* in the file the data came from, for
+                                   stages that read out of order */
+    unsigned int tag;           /* which of several files it came from */
     FG_buf *next;
 };
 
@@ -99,14 +206,64 @@ struct _FG_queue {
     FG_buf *tail;
     unsigned int occupancy;
     int is_active;
+
+    /* statistics, sampled on every read and write; guarded by mutex */
+    unsigned int occupancy_min;
+    unsigned int occupancy_max;
+    uint64_t occupancy_sum;
+    uint64_t occupancy_samples;
+};
+
+/* Capture files: a header, then a record per buffer, each followed by
+ * datalen bytes of data; see fg_capture.c */
+#define FG_CAPTURE_MAGIC "FGCAP02\n"
+
+struct fg_capture_header {
+    char magic[8];          /* FG_CAPTURE_MAGIC */
+    char pin[120];          /* stage.pin captured, for reference */
 };
 
+struct fg_capture_record {
+    uint64_t ts_ns;         /* since the start of the run */
+    uint64_t datalen;
+    uint64_t size;
+    uint32_t round_num;
+    uint32_t index;         /* connection, for pin arrays */
+};
+
+/* Statistics counters have a single writer (the thread of the stage they
+ * belong to), so they are bumped with plain relaxed stores rather than
+ * locked read-modify-writes; readers may see them slightly out of date. */
+#define fg_stat_add(counter, n) \
+    __atomic_store_n(&(counter), (counter) + (n), __ATOMIC_RELAXED)
+
+static inline uint64_t fg_now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* name of the stage def -> module index file in each module directory */
+#define FG_MODULE_INDEX "fg_modules.index"
+
 /* FG context */
-int fg_module_load(const char *path);
+FG_module *fg_module_load(const char *path);
 void fg_module_unload(FG_module *module);
+void fg_module_load_all(void);
+char **fg_module_path_get(void);
 FG_stage_def *fg_stage_def_get_by_name(const char *name);
-void fg_log(int log_domain, const char *s, ...);
 FG_stage_def **fg_get_stage_defs(void);
+int fg_stage_def_register(FG_stage_def *sd);
+
+/* logging (see fg_log() above) */
+void fg_log_start(void);
+void fg_log_stop(void);
+void fg_log_flush(void);
+void fg_log_set_domains(int domains);
+void fg_log_write(const char *s, ...)
+    __attribute__((format(printf, 1, 2)));
 
 /* networks */
 int fg_network_stage_add(FG_network *nw, FG_stage *stage);
@@ -114,6 +271,28 @@ void fg_network_halt(FG_network *nw);
 
 /* stages */
 
+/* statistics */
+void fg_stats_reset(FG_network *nw);
+
+/* hardware counters */
+void fg_perf_start(FG_stage *stage);
+void fg_perf_stop(FG_stage *stage);
+
+/* tracing */
+void fg_trace_start(FG_network *nw);
+void fg_trace_finish(FG_network *nw);
+void fg_trace_record(FG_stage *stage, int type, uint64_t ts, uint64_t dur,
+        FG_pin *pin, FG_buf *buf);
+
+/* pin capture */
+void fg_capture_start(FG_network *nw);
+void fg_capture_finish(FG_network *nw);
+void fg_capture_record(FG_pin *pin, FG_buf *buf, uint32_t index);
+
+/* live metrics */
+void fg_metrics_start(FG_network *nw);
+void fg_metrics_stop(FG_network *nw);
+
 /* pins */
 enum pindir { PIN_IN,
               PIN_ARRAY_IN,
@@ -123,20 +302,24 @@ FG_pin *fg_pin_create(const char *name, FG_stage *stage, int direction);
 void fg_pin_destroy(FG_pin *pin);
 void fg_pin_disconnect(FG_pin *pin);
 FG_buf *fg_pin_accept_buffer(FG_pin *pin);
+int fg_pin_buffer_ready(FG_pin *pin);
 void fg_pin_convey_buffer(FG_pin *pin, FG_buf *buf);
 
 int fg_pin_array_get_width(FG_pin *pin);
 FG_buf *fg_pin_array_accept_buffer(FG_pin *pin, int n);
+void fg_pin_array_convey_buffer(FG_pin *pin, int n, FG_buf *buf);
+void fg_pin_array_deactivate(FG_pin *pin, int n);
 
 /* queues */
 FG_queue *fg_queue_create(void);
 void fg_queue_destroy(FG_queue *q);
 int fg_queue_write(FG_queue *q, FG_buf *buffer);
 FG_buf *fg_queue_read(FG_queue *q);
+int fg_queue_ready(FG_queue *q);
 void fg_queue_deactivate(FG_queue *q);
 
 /* buffers */
-FG_buf *fg_buffer_create(int id, int size);
+FG_buf *fg_buffer_create(int id, uint64_t size);
 void fg_buffer_destroy(FG_buf *buf);
 
 /* helpers */
@@ -0,0 +1,312 @@
+/*
+ * fg_log.c
+ *
+ * Asynchronous logging.  Each thread formats its messages into a ring buffer
+ * of its own, without taking any locks; a background thread drains the rings
+ * and writes the messages to stdout in large batches.  Messages from one
+ * thread stay in order, but messages from different threads may be
+ * interleaved differently than they were logged.  A thread whose ring is full
+ * sleeps until the writer has made room; messages too long for a slot are cut
+ * short and end in "...".
+ *
+ * Setting FG_LOG_SYNC in the environment writes every message immediately
+ * instead, which is handy when chasing a crash.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "fg_internal.h"
+
+#define LOG_RING_SLOTS 256
+#define LOG_MSG_LEN 256
+#define LOG_IDLE_NS 1000000         /* writer sleeps 1 ms when idle */
+#define LOG_TRUNCATED "...\n"
+
+struct log_ring {
+    char msgs[LOG_RING_SLOTS][LOG_MSG_LEN];
+    uint64_t head;                  /* next slot to fill; owner only */
+    uint64_t tail;                  /* next slot to drain; writer only */
+    int orphaned;                   /* owning thread has exited */
+    struct log_ring *next;
+};
+
+static void *log_writer(void *data);
+static void log_drain(void);
+static void log_ring_orphan(void *data);
+static struct log_ring *log_ring_get(void);
+static void write_all(const char *s, size_t len);
+static int log_ring_full(struct log_ring *ring);
+
+int fg_log_domains = FG_LOG_NETWORK | FG_LOG_STAGE;
+
+static struct {
+    int running;                    /* writer thread is up */
+    int stop;
+    int have_key;
+    pthread_t writer;
+    pthread_mutex_t mutex;          /* guards rings and stdout writes */
+    struct log_ring *rings;
+    pthread_key_t key;
+
+    /* threads whose rings are full wait on space_cv, having woken the
+     * writer with work_cv */
+    pthread_mutex_t wait_mutex;
+    pthread_cond_t space_cv;
+    pthread_cond_t work_cv;
+} fg_logger = { 0, 0, 0, 0, PTHREAD_MUTEX_INITIALIZER, NULL, 0,
+                PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER,
+                PTHREAD_COND_INITIALIZER };
+
+static __thread struct log_ring *my_ring;
+
+static const struct {
+    const char *name;
+    int domain;
+} domain_names[] = { { "main",    FG_LOG_MAIN    },
+                     { "queue",   FG_LOG_QUEUE   },
+                     { "buffer",  FG_LOG_BUFFER  },
+                     { "pin",     FG_LOG_PIN     },
+                     { "stage",   FG_LOG_STAGE   },
+                     { "network", FG_LOG_NETWORK },
+                     { "module",  FG_LOG_MODULE  },
+                     { "data",    FG_LOG_DATA    },
+                     { "all",     FG_LOG_ALL     },
+                     { NULL }
+                   };
+
+/* FG_LOG may hold a comma-separated list of domain names (or "none"), or a
+ * numeric mask, and replaces the default set of domains */
+void fg_log_start(void)
+{
+    char *s, *name;
+    int i;
+
+    if(getenv("FG_LOG")) {
+        s = strdup(getenv("FG_LOG"));
+        fg_log_domains = strtol(s, &name, 0);
+        if(*name) {
+            fg_log_domains = 0;
+            for(name = strtok(s, ","); name; name = strtok(NULL, ",")) {
+                for(i = 0; domain_names[i].name; i++) {
+                    if(strcmp(name, domain_names[i].name) == 0)
+                        fg_log_domains |= domain_names[i].domain;
+                }
+            }
+        }
+        free(s);
+    }
+
+    if(fg_logger.running || getenv("FG_LOG_SYNC"))
+        return;
+
+    if(!fg_logger.have_key) {
+        pthread_key_create(&fg_logger.key, log_ring_orphan);
+        fg_logger.have_key = 1;
+
+        /* don't lose what was logged before an error exit */
+        atexit(fg_log_stop);
+    }
+
+    fg_logger.stop = 0;
+    if(pthread_create(&fg_logger.writer, NULL, log_writer, NULL) == 0)
+        fg_logger.running = 1;
+}
+
+/* drains everything logged so far and stops the writer; later messages are
+ * written synchronously */
+void fg_log_stop(void)
+{
+    if(!fg_logger.running)
+        return;
+
+    fg_logger.stop = 1;
+    pthread_join(fg_logger.writer, NULL);
+    fg_logger.running = 0;
+}
+
+void fg_log_set_domains(int domains)
+{
+    fg_log_domains = domains;
+}
+
+/* blocks until everything logged so far has been written out */
+void fg_log_flush(void)
+{
+    if(fg_logger.running)
+        log_drain();
+}
+
+void fg_log_write(const char *s, ...)
+{
+    struct log_ring *ring;
+    va_list ap;
+    char *msg;
+    int n;
+
+    ring = fg_logger.running ? log_ring_get() : NULL;
+    if(!ring) {
+        va_start(ap, s);
+        vprintf(s, ap);
+        va_end(ap);
+        return;
+    }
+
+    /* the ring is full only if the writer has fallen far behind; wait for
+     * it rather than lose messages */
+    if(log_ring_full(ring)) {
+        pthread_mutex_lock(&fg_logger.wait_mutex);
+        while(log_ring_full(ring)) {
+            pthread_cond_signal(&fg_logger.work_cv);
+            pthread_cond_wait(&fg_logger.space_cv, &fg_logger.wait_mutex);
+        }
+        pthread_mutex_unlock(&fg_logger.wait_mutex);
+    }
+
+    msg = ring->msgs[ring->head % LOG_RING_SLOTS];
+    va_start(ap, s);
+    n = vsnprintf(msg, LOG_MSG_LEN, s, ap);
+    va_end(ap);
+
+    /* a message cut short still says so, and still ends its line */
+    if(n >= LOG_MSG_LEN)
+        strcpy(msg + LOG_MSG_LEN - sizeof(LOG_TRUNCATED), LOG_TRUNCATED);
+
+    __atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+}
+
+static int log_ring_full(struct log_ring *ring)
+{
+    return ring->head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE)
+        >= LOG_RING_SLOTS;
+}
+
+static struct log_ring *log_ring_get(void)
+{
+    struct log_ring *ring;
+
+    if(my_ring)
+        return my_ring;
+
+    ring = (struct log_ring *) calloc(1, sizeof(struct log_ring));
+    if(!ring)
+        return NULL;
+
+    pthread_mutex_lock(&fg_logger.mutex);
+    ring->next = fg_logger.rings;
+    fg_logger.rings = ring;
+    pthread_mutex_unlock(&fg_logger.mutex);
+
+    pthread_setspecific(fg_logger.key, ring);
+    my_ring = ring;
+
+    return ring;
+}
+
+/* called as a thread exits; the writer frees the ring once it is empty */
+static void log_ring_orphan(void *data)
+{
+    struct log_ring *ring = (struct log_ring *) data;
+
+    __atomic_store_n(&ring->orphaned, 1, __ATOMIC_RELEASE);
+}
+
+static void *log_writer(void *data)
+{
+    struct timespec wake;
+    int stop;
+
+    do {
+        stop = __atomic_load_n(&fg_logger.stop, __ATOMIC_ACQUIRE);
+        log_drain();
+        if(stop)
+            break;
+
+        /* a thread with a full ring cuts the sleep short */
+        clock_gettime(CLOCK_REALTIME, &wake);
+        wake.tv_nsec += LOG_IDLE_NS;
+        if(wake.tv_nsec >= 1000000000) {
+            wake.tv_sec++;
+            wake.tv_nsec -= 1000000000;
+        }
+        pthread_mutex_lock(&fg_logger.wait_mutex);
+        pthread_cond_timedwait(&fg_logger.work_cv, &fg_logger.wait_mutex,
+                &wake);
+        pthread_mutex_unlock(&fg_logger.wait_mutex);
+    } while(1);
+
+    return NULL;
+}
+
+/* copies messages out of every ring and writes them in large batches */
+static void log_drain(void)
+{
+    static char batch[64 * 1024];
+    struct log_ring **ring, *dead;
+    uint64_t head;
+    size_t used = 0;
+    size_t len;
+    char *msg;
+
+    pthread_mutex_lock(&fg_logger.mutex);
+
+    for(ring = &fg_logger.rings; *ring; ) {
+        head = __atomic_load_n(&(*ring)->head, __ATOMIC_ACQUIRE);
+
+        while((*ring)->tail < head) {
+            msg = (*ring)->msgs[(*ring)->tail % LOG_RING_SLOTS];
+            len = strnlen(msg, LOG_MSG_LEN);
+
+            if(used + len > sizeof(batch)) {
+                write_all(batch, used);
+                used = 0;
+            }
+
+            memcpy(batch + used, msg, len);
+            used += len;
+
+            __atomic_store_n(&(*ring)->tail, (*ring)->tail + 1,
+                    __ATOMIC_RELEASE);
+        }
+
+        if(__atomic_load_n(&(*ring)->orphaned, __ATOMIC_ACQUIRE)
+                && (*ring)->tail == __atomic_load_n(&(*ring)->head,
+                    __ATOMIC_ACQUIRE)) {
+            dead = *ring;
+            *ring = dead->next;
+            free(dead);
+        } else {
+            ring = &(*ring)->next;
+        }
+    }
+
+    write_all(batch, used);
+
+    pthread_mutex_unlock(&fg_logger.mutex);
+
+    /* under wait_mutex, so a thread that has just found its ring full is
+     * either already waiting or will see the room made */
+    pthread_mutex_lock(&fg_logger.wait_mutex);
+    pthread_cond_broadcast(&fg_logger.space_cv);
+    pthread_mutex_unlock(&fg_logger.wait_mutex);
+}
+
+static void write_all(const char *s, size_t len)
+{
+    ssize_t n;
+
+    /* stdio may be holding output that should come first */
+    fflush(stdout);
+
+    for(; len > 0; len -= n, s += n) {
+        n = write(STDOUT_FILENO, s, len);
+        if(n < 0)
+            break;
+    }
+}
@@ -0,0 +1,215 @@
+/*
+ * fg_metrics.c
+ *
+ * Live metrics.  While a network with a metrics socket runs, a thread serves
+ * its counters on a Unix domain socket: every client that connects is sent
+ * one snapshot, as text, and the connection is closed.  bin/fg-top polls the
+ * socket and turns successive snapshots into rates.
+ *
+ * The snapshot format is one record per line, fields separated by spaces:
+ *
+ *   network <elapsed ns> <name>
+ *   stage <name> <calls> <func ns> <starved ns> <backpressure ns>
+ *   pin <stage> <pin> <in|out> <buffers> <bytes> <queued buffers>
+ *   end
+ *
+ * Network names run to the end of the line and may contain spaces; stage and
+ * pin names may not.
+ *
+ * Snapshots are taken without locking anything: the counters are read with
+ * relaxed atomic loads, queue occupancy included, so serving them never
+ * holds up a stage.  The price is that a snapshot is not quite consistent.
+ */
+
+#define _GNU_SOURCE /* for open_memstream() */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "fg_internal.h"
+
+/* how often the server checks whether the network has finished */
+#define METRICS_POLL_MS 100
+
+static void *metrics_server(void *data);
+static void metrics_send(FG_network *nw, int fd);
+static unsigned int pin_queued(FG_pin *pin);
+
+void fg_network_set_metrics_socket(FG_network *nw, const char *path)
+{
+    if(!nw)
+        return;
+
+    free(nw->metrics_path);
+    nw->metrics_path = path ? strdup(path) : NULL;
+}
+
+/* opens the socket and starts serving it, if the network has one */
+void fg_metrics_start(FG_network *nw)
+{
+    struct sockaddr_un addr;
+    struct stat st;
+
+    nw->metrics_fd = -1;
+    if(!nw->metrics_path)
+        return;
+
+    if(strlen(nw->metrics_path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "metrics socket path too long: %s\n",
+                nw->metrics_path);
+        return;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, nw->metrics_path);
+
+    nw->metrics_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(nw->metrics_fd < 0) {
+        perror("metrics socket");
+        return;
+    }
+
+    /* a socket left behind by an earlier run would make bind() fail; but
+     * anything else at that path is someone's file, not ours to remove */
+    if(lstat(nw->metrics_path, &st) == 0) {
+        if(!S_ISSOCK(st.st_mode)) {
+            fprintf(stderr, "metrics socket path %s exists and is not a "
+                    "socket\n", nw->metrics_path);
+            close(nw->metrics_fd);
+            nw->metrics_fd = -1;
+            return;
+        }
+        unlink(nw->metrics_path);
+    }
+
+    if(bind(nw->metrics_fd, (struct sockaddr *) &addr, sizeof(addr)) < 0
+            || listen(nw->metrics_fd, 8) < 0) {
+        perror(nw->metrics_path);
+        close(nw->metrics_fd);
+        nw->metrics_fd = -1;
+        return;
+    }
+
+    nw->metrics_stop = 0;
+    if(pthread_create(&nw->metrics_thread, NULL, metrics_server, nw) != 0) {
+        close(nw->metrics_fd);
+        unlink(nw->metrics_path);
+        nw->metrics_fd = -1;
+        return;
+    }
+
+    fg_log(FG_LOG_NETWORK, "serving metrics on %s\n", nw->metrics_path);
+}
+
+void fg_metrics_stop(FG_network *nw)
+{
+    if(nw->metrics_fd < 0)
+        return;
+
+    __atomic_store_n(&nw->metrics_stop, 1, __ATOMIC_RELEASE);
+    pthread_join(nw->metrics_thread, NULL);
+
+    close(nw->metrics_fd);
+    unlink(nw->metrics_path);
+    nw->metrics_fd = -1;
+}
+
+static void *metrics_server(void *data)
+{
+    FG_network *nw = (FG_network *) data;
+    struct pollfd pfd;
+    int fd;
+
+    pfd.fd = nw->metrics_fd;
+    pfd.events = POLLIN;
+
+    while(!__atomic_load_n(&nw->metrics_stop, __ATOMIC_ACQUIRE)) {
+        if(poll(&pfd, 1, METRICS_POLL_MS) <= 0)
+            continue;
+
+        fd = accept(nw->metrics_fd, NULL, NULL);
+        if(fd < 0)
+            continue;
+
+        metrics_send(nw, fd);
+        close(fd);
+    }
+
+    return NULL;
+}
+
+static void metrics_send(FG_network *nw, int fd)
+{
+    FG_stage **stage;
+    FG_pin **pin;
+    FILE *f;
+    char *s = NULL;
+    size_t len = 0;
+    ssize_t n;
+    size_t off;
+
+    f = open_memstream(&s, &len);
+    if(!f)
+        return;
+
+    fprintf(f, "network %llu %s\n",
+            (unsigned long long) (fg_now_ns() - nw->run_start_ns), nw->name);
+
+    for(stage = nw->stages; *stage; stage++) {
+        fprintf(f, "stage %s %llu %llu %llu %llu\n", (*stage)->name,
+                (unsigned long long) __atomic_load_n(&(*stage)->func_calls,
+                    __ATOMIC_RELAXED),
+                (unsigned long long) __atomic_load_n(&(*stage)->func_ns,
+                    __ATOMIC_RELAXED),
+                (unsigned long long) __atomic_load_n(&(*stage)->starved_ns,
+                    __ATOMIC_RELAXED),
+                (unsigned long long) __atomic_load_n(
+                    &(*stage)->backpressure_ns, __ATOMIC_RELAXED));
+
+        for(pin = (*stage)->pins; *pin; pin++) {
+            fprintf(f, "pin %s %s %s %llu %llu %u\n", (*stage)->name,
+                    (*pin)->name, (*pin)->direction == PIN_IN
+                        || (*pin)->direction == PIN_ARRAY_IN ? "in" : "out",
+                    (unsigned long long) __atomic_load_n(&(*pin)->buffers,
+                        __ATOMIC_RELAXED),
+                    (unsigned long long) __atomic_load_n(&(*pin)->bytes,
+                        __ATOMIC_RELAXED),
+                    pin_queued(*pin));
+        }
+    }
+
+    fprintf(f, "end\n");
+    fclose(f);
+
+    /* the client may hang up early; that must not kill the process */
+    for(off = 0; off < len; off += n) {
+        n = send(fd, s + off, len - off, MSG_NOSIGNAL);
+        if(n <= 0)
+            break;
+    }
+
+    free(s);
+}
+
+/* buffers waiting in an input pin's queues, read without the queue locks */
+static unsigned int pin_queued(FG_pin *pin)
+{
+    unsigned int queued = 0;
+    int i;
+
+    if(pin->direction == PIN_IN && pin->queue)
+        queued = __atomic_load_n(&pin->queue->occupancy, __ATOMIC_RELAXED);
+    else if(pin->direction == PIN_ARRAY_IN)
+        for(i=0; i<pin->queue_count; i++)
+            queued += __atomic_load_n(&pin->queues[i]->occupancy,
+                    __ATOMIC_RELAXED);
+
+    return queued;
+}
@@ -6,13 +6,41 @@
 #include <stdio.h>
 #include <malloc.h>
 #include <string.h>
+#include <stdlib.h>
 #include <pthread.h>
 #include <stdint.h>
 
 #include "fg_internal.h"
 
+/* default size of the thread pool that runs stage inits in fg_network_fix;
+ * can be overridden with FG_INIT_THREADS or fg_network_set_init_threads() */
+#define FG_DEFAULT_INIT_THREADS 8
+
+enum init_state {
+    INIT_PENDING,
+    INIT_RUNNING,
+    INIT_DONE,
+    INIT_FAILED,
+    INIT_SKIPPED,       /* a dependency failed */
+    INIT_CYCLE          /* dependencies can never be satisfied */
+};
+
+struct init_pool {
+    pthread_mutex_t mutex;
+    pthread_cond_t cv;
+    FG_network *nw;
+    int *state;         /* one entry per stage, indexed like nw->stages */
+    int running;
+    int remaining;
+};
+
+static void *init_worker(void *data);
+static int init_deps_state(struct init_pool *pool, FG_stage *stage);
+static void init_stage(FG_stage *stage, int *state);
+static void alloc_source_buffers(FG_network *nw);
+
 FG_network *fg_network_create(const char *name, uint32_t default_bufcount,
-        uint32_t default_bufsize)
+        uint64_t default_bufsize)
 {
     FG_network *nw;
 
@@ -34,6 +62,27 @@ FG_network *fg_network_create(const char *name, uint32_t default_bufcount,
     /* HACK: magic number! */
     nw->params = (FG_param_rename **) calloc(11, sizeof(FG_param_rename *));
 
+    nw->init_threads = FG_DEFAULT_INIT_THREADS;
+    if(getenv("FG_INIT_THREADS"))
+        fg_network_set_init_threads(nw, atoi(getenv("FG_INIT_THREADS")));
+
+    /* statistics are always kept; FG_STATS=0 just stops them being printed */
+    nw->print_stats = getenv("FG_STATS") ? atoi(getenv("FG_STATS")) : 1;
+    nw->print_bottleneck = getenv("FG_BOTTLENECK")
+        ? atoi(getenv("FG_BOTTLENECK")) : 0;
+    nw->perf_counters = getenv("FG_PERF") ? atoi(getenv("FG_PERF")) : 0;
+    nw->run_start_ns = 0;
+    nw->run_ns = 0;
+
+    nw->trace_file = NULL;
+    if(getenv("FG_TRACE"))
+        fg_network_set_trace(nw, getenv("FG_TRACE"));
+
+    nw->metrics_path = NULL;
+    nw->metrics_fd = -1;
+    if(getenv("FG_METRICS"))
+        fg_network_set_metrics_socket(nw, getenv("FG_METRICS"));
+
     return nw;
 }
 
@@ -46,7 +95,7 @@ void fg_network_set_default_bufcount(FG_network *nw,
     nw->default_bufcount = default_bufcount;
 }
 
-void fg_network_set_default_bufsize(FG_network *nw, uint32_t default_bufsize)
+void fg_network_set_default_bufsize(FG_network *nw, uint64_t default_bufsize)
 {
     if(!nw)
         return;
@@ -54,6 +103,14 @@ void fg_network_set_default_bufsize(FG_network *nw, uint32_t default_bufsize)
     nw->default_bufsize = default_bufsize;
 }
 
+void fg_network_set_init_threads(FG_network *nw, int n)
+{
+    if(!nw || n < 1)
+        return;
+
+    nw->init_threads = n;
+}
+
 void fg_network_destroy(FG_network *nw)
 {
     FG_stage **s;
@@ -73,6 +130,8 @@ void fg_network_destroy(FG_network *nw)
         }
         free(nw->params);
 
+        free(nw->trace_file);
+        free(nw->metrics_path);
         free(nw->name);
         free(nw);
     }
@@ -174,45 +233,205 @@ int fg_network_stage_add(FG_network *nw, FG_stage *stage)
     return 0;
 }
 
+/* Stage inits run concurrently on a bounded pool of threads, honoring any
+ * dependencies declared with fg_stage_init_after(), while this thread
+ * allocates buffers.  All failures are reported together once every init has
+ * finished; stages that did initialize are then finalized again. */
 int fg_network_fix(FG_network *nw)
 {
     FG_stage **stage;
-    FG_pin **pin;
-    FG_buf *buf;
+    struct init_pool pool;
+    pthread_t *threads;
+    int nthreads;
     int i;
-    int buf_id;
-    uint32_t bufsize;
-    uint32_t bufcount;
-    int rc;
-    const char **p;
-    char **v;
+    int rc = 0;
 
     fg_log(FG_LOG_NETWORK, "Fixing network %s\n", nw->name);
     fg_log(FG_LOG_NETWORK, "found %d stages\n", nw->stage_count);
 
+    pthread_mutex_init(&pool.mutex, NULL);
+    pthread_cond_init(&pool.cv, NULL);
+    pool.nw = nw;
+    pool.state = (int *) calloc(nw->stage_count + 1, sizeof(int));
+    pool.running = 0;
+    pool.remaining = nw->stage_count;
+
+    nthreads = nw->init_threads < nw->stage_count
+        ? nw->init_threads : nw->stage_count;
+    threads = (pthread_t *) calloc(nthreads + 1, sizeof(pthread_t));
+
     /* initialize stages */
-    fg_log(FG_LOG_NETWORK, "initializing stages\n");
-    for(stage = nw->stages; *stage; stage++) {
-        fg_log(FG_LOG_STAGE, "initializing stage %s with params:\n",
-                (*stage)->name);
-        if((*stage)->sd->params) {
-            for(p = (*stage)->sd->params, v = (*stage)->param_vals; *p;
-                    p++, v++) {
-                fg_log(FG_LOG_STAGE, "    %s = %s\n", *p, *v);
+    fg_log(FG_LOG_NETWORK, "initializing stages (%d threads)\n", nthreads);
+    for(i=0; i<nthreads; i++) {
+        if(pthread_create(threads + i, NULL, init_worker, &pool) != 0)
+            break;
+    }
+    nthreads = i;
+
+    /* should thread creation fail outright, do the work here instead */
+    if(nthreads == 0)
+        init_worker(&pool);
+
+    /* for each unconnected source pin, create and add buffers to queue */
+    alloc_source_buffers(nw);
+
+    for(i=0; i<nthreads; i++)
+        pthread_join(threads[i], NULL);
+
+    for(stage = nw->stages, i = 0; *stage; stage++, i++) {
+        switch(pool.state[i]) {
+            case INIT_FAILED:
+                fprintf(stderr, "%s> stage initialization failed\n",
+                        (*stage)->name);
+                rc = -1;
+                break;
+            case INIT_SKIPPED:
+                fprintf(stderr, "%s> stage initialization skipped, a stage "
+                        "it depends on failed\n", (*stage)->name);
+                rc = -1;
+                break;
+            case INIT_CYCLE:
+                fprintf(stderr, "%s> stage initialization skipped, circular "
+                        "init dependency\n", (*stage)->name);
+                rc = -1;
+                break;
+        }
+    }
+
+    if(rc < 0) {
+        for(stage = nw->stages, i = 0; *stage; stage++, i++) {
+            if(pool.state[i] == INIT_DONE && (*stage)->sd->init
+                    && (*stage)->sd->fini)
+                (*stage)->sd->fini(*stage);
+        }
+    }
+
+    free(threads);
+    free(pool.state);
+    pthread_cond_destroy(&pool.cv);
+    pthread_mutex_destroy(&pool.mutex);
+
+    return rc;
+}
+
+static void *init_worker(void *data)
+{
+    struct init_pool *pool = (struct init_pool *) data;
+    FG_stage **stage;
+    int i, pick, deps;
+    int result;
+
+    pthread_mutex_lock(&pool->mutex);
+
+    while(pool->remaining > 0) {
+        pick = -1;
+        for(stage = pool->nw->stages, i = 0; *stage; stage++, i++) {
+            if(pool->state[i] != INIT_PENDING)
+                continue;
+
+            deps = init_deps_state(pool, *stage);
+            if(deps == INIT_DONE) {
+                pick = i;
+                break;
+            } else if(deps != INIT_PENDING) {
+                pool->state[i] = INIT_SKIPPED;
+                pool->remaining--;
+                pthread_cond_broadcast(&pool->cv);
             }
         }
 
-        if((*stage)->sd->init) {
-            rc = (*stage)->sd->init(*stage);
-            if(rc < 0) {
-                fprintf(stderr, "%s> stage initialization failed\n", (*stage)->name);
-                fg_stage_destroy(*stage);
-                return -1;
+        if(pick >= 0) {
+            pool->state[pick] = INIT_RUNNING;
+            pool->running++;
+            pthread_mutex_unlock(&pool->mutex);
+
+            init_stage(pool->nw->stages[pick], &result);
+
+            pthread_mutex_lock(&pool->mutex);
+            pool->state[pick] = result;
+            pool->running--;
+            pool->remaining--;
+            pthread_cond_broadcast(&pool->cv);
+        } else if(pool->remaining > 0 && pool->running == 0) {
+            /* nothing is runnable and nothing will become runnable */
+            for(i=0; i<pool->nw->stage_count; i++) {
+                if(pool->state[i] == INIT_PENDING) {
+                    pool->state[i] = INIT_CYCLE;
+                    pool->remaining--;
+                }
             }
+            pthread_cond_broadcast(&pool->cv);
+        } else if(pool->remaining > 0) {
+            pthread_cond_wait(&pool->cv, &pool->mutex);
         }
     }
 
-    /* for each unconnected source pin, create and add buffers to queue */
+    pthread_mutex_unlock(&pool->mutex);
+
+    return NULL;
+}
+
+/* INIT_DONE if all of the stage's dependencies initialized, INIT_PENDING if
+ * some have yet to, otherwise INIT_SKIPPED; call with pool->mutex held */
+static int init_deps_state(struct init_pool *pool, FG_stage *stage)
+{
+    FG_stage **s;
+    int i, j;
+    int rc = INIT_DONE;
+
+    for(j=0; j<stage->init_dep_count; j++) {
+        for(s = pool->nw->stages, i = 0; *s; s++, i++) {
+            if(*s == stage->init_deps[j])
+                break;
+        }
+
+        /* dependencies outside of this network are ignored */
+        if(!*s)
+            continue;
+
+        switch(pool->state[i]) {
+            case INIT_DONE:
+                break;
+            case INIT_PENDING:
+            case INIT_RUNNING:
+                rc = INIT_PENDING;
+                break;
+            default:
+                return INIT_SKIPPED;
+        }
+    }
+
+    return rc;
+}
+
+static void init_stage(FG_stage *stage, int *state)
+{
+    const char **p;
+    char **v;
+
+    fg_log(FG_LOG_STAGE, "initializing stage %s with params:\n",
+            stage->name);
+    if(stage->sd->params) {
+        for(p = stage->sd->params, v = stage->param_vals; *p; p++, v++) {
+            fg_log(FG_LOG_STAGE, "    %s = %s\n", *p, *v);
+        }
+    }
+
+    *state = INIT_DONE;
+    if(stage->sd->init && stage->sd->init(stage) < 0)
+        *state = INIT_FAILED;
+}
+
+static void alloc_source_buffers(FG_network *nw)
+{
+    FG_stage **stage;
+    FG_pin **pin;
+    FG_buf *buf;
+    int i;
+    int buf_id;
+    uint64_t bufsize;
+    uint32_t bufcount;
+
     fg_log(FG_LOG_NETWORK, "finding source pins:\n");
     buf_id = 0;
     for(stage = nw->stages; *stage; stage++) {
@@ -231,23 +450,30 @@ int fg_network_fix(FG_network *nw)
                     buf->origin = *pin;
                 }
 
-                fg_log(FG_LOG_NETWORK, "  %s.%s: %d x %db buffers\n",
-                        (*pin)->stage->name, (*pin)->name, bufcount, bufsize);
+                fg_log(FG_LOG_NETWORK, "  %s.%s: %u x %llub buffers\n",
+                        (*pin)->stage->name, (*pin)->name, bufcount,
+                        (unsigned long long) bufsize);
             }
         }
     }
-
-    return 0;
 }
 
 void fg_network_run(FG_network *nw)
 {
     FG_stage **stage;
 
+    fg_stats_reset(nw);
+    fg_trace_start(nw);
+    nw->failed = 0;
+    nw->run_start_ns = fg_now_ns();
+    fg_capture_start(nw);
+    fg_metrics_start(nw);
+
     /* create one thread for each stage and watch 'em go! */
     fg_log(FG_LOG_NETWORK, "Creating threads\n");
     for(stage = nw->stages; *stage; stage++) {
-        fg_log(FG_LOG_NETWORK, "  %s @ %p\n", (*stage)->name, *stage);
+        fg_log(FG_LOG_NETWORK, "  %s @ %p\n", (*stage)->name,
+                (void *) *stage);
         pthread_create(&((*stage)->thread), NULL, fg_stage_handler, *stage);
     }
     fg_log(FG_LOG_NETWORK, "Creating threads complete\n");
@@ -255,15 +481,39 @@ void fg_network_run(FG_network *nw)
     /* join threads once they're done */
     for(stage = nw->stages; *stage; stage++) {
         pthread_join((*stage)->thread, NULL);
-        fg_log(FG_LOG_NETWORK, "joined thread %s @ %p\n", (*stage)->name, *stage);
+        fg_log(FG_LOG_NETWORK, "joined thread %s @ %p\n", (*stage)->name,
+                (void *) *stage);
     }
 
+    __atomic_store_n(&nw->run_ns, fg_now_ns() - nw->run_start_ns,
+            __ATOMIC_RELAXED);
+
+    fg_metrics_stop(nw);
+
+    fg_trace_finish(nw);
+    fg_capture_finish(nw);
+
     /* and let the stages clean themselves up */
     for(stage = nw->stages; *stage; stage++) {
         fg_log(FG_LOG_NETWORK, "finalizing stage %s\n", (*stage)->name);
         if((*stage)->sd->fini)
             (*stage)->sd->fini(*stage);
     }
+
+    /* lines logged during the run come out before the stats, not among
+     * them */
+    fg_log_flush();
+
+    if(nw->print_stats)
+        fg_network_print_stats(nw);
+    if(nw->print_bottleneck)
+        fg_network_print_bottleneck(nw);
+}
+
+/* whether a stage ended the last run with an error */
+int fg_network_failed(FG_network *nw)
+{
+    return __atomic_load_n(&nw->failed, __ATOMIC_RELAXED);
 }
 
 void fg_network_halt(FG_network *nw)
@@ -287,10 +537,17 @@ FG_network *fg_network_copy(FG_network *nw, const char *name)
     char **value;
     FG_pin **pin;
     FG_param_rename **pr;
+    int i;
 
     new_nw = fg_network_create(name, nw->default_bufcount, nw->default_bufsize);
     if(!new_nw)
         return NULL;
+    new_nw->init_threads = nw->init_threads;
+    new_nw->print_stats = nw->print_stats;
+    new_nw->print_bottleneck = nw->print_bottleneck;
+    new_nw->perf_counters = nw->perf_counters;
+    fg_network_set_trace(new_nw, nw->trace_file);
+    fg_network_set_metrics_socket(new_nw, nw->metrics_path);
 
     /* create stages and populate parameters, if set */
     for(s=nw->stages; *s; s++) {
@@ -317,6 +574,16 @@ FG_network *fg_network_copy(FG_network *nw, const char *name)
         }
     }
 
+    /* duplicate init dependencies */
+    for(s=nw->stages; *s; s++) {
+        new_stage = fg_network_get_stage_by_name(new_nw, (*s)->name);
+        for(i=0; i<(*s)->init_dep_count; i++) {
+            new_stage2 = fg_network_get_stage_by_name(new_nw,
+                    (*s)->init_deps[i]->name);
+            fg_stage_init_after(new_stage, new_stage2);
+        }
+    }
+
     /* duplicate parameter renaming */
     for(pr=nw->params; *pr; pr++) {
         fg_network_rename_param(new_nw, (*pr)->stage->name, (*pr)->name,
@@ -109,7 +109,7 @@ int process_cmd(FG_network *nw, char *s)
         }
     } else if(strcmp(cmd, "set_bufsize") == 0) {
         if(strcmp(a, "default") == 0) {
-            nw->default_bufsize = atoi(b);
+            nw->default_bufsize = strtoull(b, NULL, 0);
         } else {
             stage0_name = strtok(a, ".");
             pin0_name = strtok(NULL, "\n");
@@ -125,8 +125,39 @@ int process_cmd(FG_network *nw, char *s)
                         stage0_name);
                 return -1;
             }
-            pin0->bufsize = atoi(b);
+            pin0->bufsize = strtoull(b, NULL, 0);
         }
+    } else if(strcmp(cmd, "capture") == 0) {
+        stage0_name = strtok(a, ".");
+        pin0_name = strtok(NULL, "\n");
+
+        stage0 = fg_network_get_stage_by_name(nw, stage0_name);
+        if(!stage0) {
+            fprintf(stderr, "stage %s not found\n", stage0_name);
+            return -1;
+        }
+        pin0 = fg_stage_pin_get_by_name(stage0, pin0_name);
+        if(!pin0) {
+            fprintf(stderr, "pin %s not found in stage %s\n", pin0_name,
+                    stage0_name);
+            return -1;
+        }
+        fg_pin_set_capture(pin0, b);
+    } else if(strcmp(cmd, "init_after") == 0) {
+        stage0 = fg_network_get_stage_by_name(nw, a);
+        if(!stage0) {
+            fprintf(stderr, "stage %s not found\n", a);
+            return -1;
+        }
+        stage1 = fg_network_get_stage_by_name(nw, b);
+        if(!stage1) {
+            fprintf(stderr, "stage %s not found\n", b);
+            return -1;
+        }
+
+        fg_stage_init_after(stage0, stage1);
+    } else if(strcmp(cmd, "init_threads") == 0) {
+        fg_network_set_init_threads(nw, atoi(a));
     } else if(strcmp(cmd, "loop") == 0) {
         n = atoi(a);
 
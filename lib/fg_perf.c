@@ -0,0 +1,97 @@
+/*
+ * fg_perf.c
+ *
+ * Hardware performance counters per stage.  With counters enabled for a
+ * network, each stage thread opens its own counters with perf_event_open(2)
+ * as it starts and reads them as it finishes, so everything counted is work
+ * done by that stage alone.  Counters count user-space events only, which
+ * lets unprivileged users (perf_event_paranoid up to 2) collect them.
+ *
+ * Counters the CPU or kernel doesn't support are reported as unavailable
+ * rather than failing the run.  When there are more counters than hardware
+ * registers the kernel multiplexes them; values are scaled up to the whole
+ * run accordingly.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "fg_internal.h"
+
+#define CACHE_MISSES(cache) ((cache) | (PERF_COUNT_HW_CACHE_OP_READ << 8) \
+        | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16))
+
+static const struct {
+    uint32_t type;
+    uint64_t config;
+} perf_events[FG_PERF_COUNTERS] = {
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES             },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS           },
+    { PERF_TYPE_HW_CACHE, CACHE_MISSES(PERF_COUNT_HW_CACHE_LL)   },
+    { PERF_TYPE_HW_CACHE, CACHE_MISSES(PERF_COUNT_HW_CACHE_DTLB) }
+};
+
+void fg_network_set_perf_counters(FG_network *nw, int perf_counters)
+{
+    if(nw)
+        nw->perf_counters = perf_counters;
+}
+
+/* opens and starts the counters for the calling thread; called by the stage
+ * handler before the stage's first call */
+void fg_perf_start(FG_stage *stage)
+{
+    struct perf_event_attr attr;
+    int i;
+
+    for(i=0; i<FG_PERF_COUNTERS; i++) {
+        stage->perf[i] = FG_STAT_UNAVAILABLE;
+
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = perf_events[i].type;
+        attr.config = perf_events[i].config;
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED
+            | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+        stage->perf_fd[i] = syscall(SYS_perf_event_open, &attr, 0, -1, -1,
+                0);
+        if(stage->perf_fd[i] < 0) {
+            fg_log(FG_LOG_STAGE, "%s> hardware counter %d unavailable\n",
+                    stage->name, i);
+            continue;
+        }
+
+        ioctl(stage->perf_fd[i], PERF_EVENT_IOC_RESET, 0);
+        ioctl(stage->perf_fd[i], PERF_EVENT_IOC_ENABLE, 0);
+    }
+}
+
+/* stops and reads the counters; called by the stage handler at the end */
+void fg_perf_stop(FG_stage *stage)
+{
+    uint64_t v[3];      /* value, time enabled, time running */
+    int i;
+
+    for(i=0; i<FG_PERF_COUNTERS; i++) {
+        if(stage->perf_fd[i] < 0)
+            continue;
+
+        ioctl(stage->perf_fd[i], PERF_EVENT_IOC_DISABLE, 0);
+        if(read(stage->perf_fd[i], v, sizeof(v)) == sizeof(v) && v[2] > 0) {
+            if(v[2] < v[1])
+                v[0] = (double) v[0] * v[1] / v[2];
+            stage->perf[i] = v[0];
+        }
+
+        close(stage->perf_fd[i]);
+        stage->perf_fd[i] = -1;
+    }
+}
@@ -22,28 +22,40 @@ FG_pin *fg_pin_create(const char *name, FG_stage *stage, int direction)
     p->cur_round_num = 0;
     p->bufsize = 0;         /* default to network setting */
     p->bufcount = 0;        /* default to network setting */
+    p->buffers = 0;
+    p->bytes = 0;
+    p->capture_file = NULL;
+    p->capture = NULL;
+    p->capture_iobuf = NULL;
 
-    /* HACK: magic number! */
-    if(p->direction == PIN_ARRAY_IN) {
-        p->queues = (FG_queue **) calloc(201, sizeof(FG_queue *));
-        p->queue_count = 0;
-    }
+    /* grows as connections are made; see fg_pin_connect() */
+    p->queues = NULL;
+    p->queue_count = 0;
+    p->queue_capacity = 0;
 
     return p;
 }
 
 void fg_pin_destroy(FG_pin *pin)
 {
+    uint32_t i;
+
     if(pin) {
+        /* queues belong to the pins that read them */
         if(pin->direction == PIN_IN)
             fg_queue_destroy(pin->queue);
+        if(pin->direction == PIN_ARRAY_IN)
+            for(i=0; i<pin->queue_count; i++)
+                fg_queue_destroy(pin->queues[i]);
+        free(pin->queues);
         fg_pin_disconnect(pin);
+        free(pin->capture_file);
         free(pin->name);
         free(pin);
     }
 }
 
-void fg_pin_set_buffer_size(FG_pin *pin, uint32_t size)
+void fg_pin_set_buffer_size(FG_pin *pin, uint64_t size)
 {
     if(pin)
         pin->bufsize = size;
@@ -55,6 +67,27 @@ void fg_pin_set_buffer_count(FG_pin *pin, uint32_t count)
         pin->bufcount = count;
 }
 
+/* adds a connection to a pin array */
+static void pin_array_add(FG_pin *pin, FG_queue *q)
+{
+    FG_queue **queues;
+
+    if(pin->queue_count == pin->queue_capacity) {
+        queues = (FG_queue **) realloc(pin->queues,
+                (pin->queue_capacity * 2 + 8) * sizeof(FG_queue *));
+        if(!queues) {
+            fprintf(stderr, "error: no memory to connect %s.%s\n",
+                    pin->stage->name, pin->name);
+            exit(1);
+        }
+        pin->queues = queues;
+        pin->queue_capacity = pin->queue_capacity * 2 + 8;
+    }
+
+    *(pin->queues + pin->queue_count) = q;
+    pin->queue_count++;
+}
+
 int fg_pin_connect(FG_stage *outs, const char *outp, FG_stage *ins,
         const char *inp)
 {
@@ -86,28 +119,32 @@ int fg_pin_connect(FG_stage *outs, const char *outp, FG_stage *ins,
         exit(1);
     }
 
-    if(in_pin->direction == PIN_ARRAY_IN) {
-        q = fg_queue_create();
-        *(in_pin->queues + in_pin->queue_count) = q;
-        out_pin->queue = q;
-        q->reader = in_pin;
-        q->writer = out_pin;
-
-        fg_log(FG_LOG_PIN, "connected %s.%s -> %s.%s[%d]\n",
-                out_pin->stage->name, out_pin->name, in_pin->stage->name,
-                in_pin->name, in_pin->queue_count);
+    q = fg_queue_create();
+    q->reader = in_pin;
+    q->writer = out_pin;
 
-        in_pin->queue_count++;
-    } else {
-        q = fg_queue_create();
+    /* each connection of a pin array is a queue of its own */
+    if(in_pin->direction == PIN_ARRAY_IN)
+        pin_array_add(in_pin, q);
+    else
         in_pin->queue = q;
-        q->reader = in_pin;
+
+    if(out_pin->direction == PIN_ARRAY_OUT)
+        pin_array_add(out_pin, q);
+    else
         out_pin->queue = q;
-        q->writer = out_pin;
 
+    if(out_pin->direction == PIN_ARRAY_OUT)
+        fg_log(FG_LOG_PIN, "connected %s.%s[%d] -> %s.%s\n",
+                out_pin->stage->name, out_pin->name,
+                out_pin->queue_count - 1, in_pin->stage->name, in_pin->name);
+    else if(in_pin->direction == PIN_ARRAY_IN)
+        fg_log(FG_LOG_PIN, "connected %s.%s -> %s.%s[%d]\n",
+                out_pin->stage->name, out_pin->name, in_pin->stage->name,
+                in_pin->name, in_pin->queue_count - 1);
+    else
         fg_log(FG_LOG_PIN, "connected %s.%s -> %s.%s\n", out_pin->stage->name,
                 out_pin->name, in_pin->stage->name, in_pin->name);
-    }
 
     return 0;
 }
@@ -118,12 +155,48 @@ void fg_pin_disconnect(FG_pin *pin)
 }
 
 FG_buf *fg_pin_accept_buffer(FG_pin *pin) {
-    return fg_queue_read(pin->queue);
+    FG_buf *buf;
+
+    buf = fg_queue_read(pin->queue);
+
+    /* empty buffers from a source pin carry no data worth counting */
+    if(buf) {
+        fg_stat_add(pin->buffers, 1);
+        if(pin->queue->writer)
+            fg_stat_add(pin->bytes, buf->datalen);
+        if(pin->stage->trace)
+            fg_trace_record(pin->stage, FG_TRACE_ACCEPT, fg_now_ns(), 0, pin,
+                    buf);
+        if(pin->capture)
+            fg_capture_record(pin, buf, 0);
+    }
+
+    return buf;
+}
+
+/* nonzero if fg_pin_accept_buffer() would return without waiting, for
+ * stages that keep several buffers in flight and must not block on one
+ * input while they could be finishing work on another */
+int fg_pin_buffer_ready(FG_pin *pin)
+{
+    return fg_queue_ready(pin->queue);
 }
 
 void fg_pin_convey_buffer(FG_pin *pin, FG_buf *buf) {
     FG_pin *dst;
 
+    fg_stat_add(pin->buffers, 1);
+    fg_stat_add(pin->bytes, buf->datalen);
+
+    /* the buffer belongs to the next stage once queued, so record first */
+    if(pin->stage->trace) {
+        buf->trace_seq++;
+        fg_trace_record(pin->stage, FG_TRACE_CONVEY, fg_now_ns(), 0, pin,
+                buf);
+    }
+    if(pin->capture)
+        fg_capture_record(pin, buf, 0);
+
     if(pin->queue) {
         fg_queue_write(pin->queue, buf);
 
@@ -143,8 +216,9 @@ void fg_pin_convey_buffer(FG_pin *pin, FG_buf *buf) {
 
 FG_buf *fg_pin_array_accept_buffer(FG_pin *pin, int i) {
     FG_queue *q;
+    FG_buf *buf;
 
-    if(!pin)
+    if(!pin || i < 0 || i >= pin->queue_count)
         return NULL;
 
     q = *(pin->queues + i);
@@ -152,9 +226,59 @@ FG_buf *fg_pin_array_accept_buffer(FG_pin *pin, int i) {
     if(!q)
         return NULL;
 
-    return fg_queue_read(q);
+    buf = fg_queue_read(q);
+    if(buf) {
+        fg_stat_add(pin->buffers, 1);
+        fg_stat_add(pin->bytes, buf->datalen);
+        if(pin->stage->trace)
+            fg_trace_record(pin->stage, FG_TRACE_ACCEPT, fg_now_ns(), 0, pin,
+                    buf);
+        if(pin->capture)
+            fg_capture_record(pin, buf, i);
+    }
+
+    return buf;
+}
+
+/* conveys buf on connection i of an output pin array */
+void fg_pin_array_convey_buffer(FG_pin *pin, int i, FG_buf *buf)
+{
+    FG_queue *q;
+
+    if(!pin || i < 0 || i >= pin->queue_count) {
+        fg_queue_write(buf->origin->queue, buf);
+        return;
+    }
+
+    q = *(pin->queues + i);
+
+    fg_stat_add(pin->buffers, 1);
+    fg_stat_add(pin->bytes, buf->datalen);
+
+    if(pin->stage->trace) {
+        buf->trace_seq++;
+        fg_trace_record(pin->stage, FG_TRACE_CONVEY, fg_now_ns(), 0, pin,
+                buf);
+    }
+    if(pin->capture)
+        fg_capture_record(pin, buf, i);
+
+    fg_queue_write(q, buf);
+
+    fg_log(FG_LOG_BUFFER, "buffer %d, round %d passed from %s.%s[%d] to %s.%s\n",
+            buf->id, buf->round_num, pin->stage->name, pin->name, i,
+            q->reader->stage->name, q->reader->name);
+}
+
+/* ends connection i of an output pin array, while the stage goes on with
+ * the others; its reader gets NULL once it has taken what was conveyed */
+void fg_pin_array_deactivate(FG_pin *pin, int i)
+{
+    if(pin && i >= 0 && i < pin->queue_count)
+        fg_queue_deactivate(*(pin->queues + i));
 }
 
+/* connections of a pin array, in or out */
 int fg_pin_array_get_width(FG_pin *pin)
 {
     return pin->queue_count;
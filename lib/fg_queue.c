@@ -12,6 +12,9 @@
 
 #include "fg_internal.h"
 
+static void queue_sample_occupancy(FG_queue *q);
+static void queue_wait_done(FG_queue *q, uint64_t start);
+
 /* q->is_active could eventually be counter of active writers, which upon
  * reaching zero signals okay to shut down */
 
@@ -31,19 +34,35 @@ FG_queue *fg_queue_create(void)
     q->is_active = 1;
     q->reader = NULL;
     q->writer = NULL;
+    q->occupancy_min = 0;
+    q->occupancy_max = 0;
+    q->occupancy_sum = 0;
+    q->occupancy_samples = 0;
 
     return q;
 }
 
+/* any buffers still sitting in the queue are destroyed along with it, so
+ * networks can be built and torn down repeatedly without leaking buffers */
 void fg_queue_destroy(FG_queue *q)
 {
+    FG_buf *buf, *next;
+
     if(q) {
+        for(buf = q->head; q->occupancy > 0; buf = next, q->occupancy--) {
+            next = buf->next;
+            fg_buffer_destroy(buf);
+        }
+
+        pthread_mutex_destroy(&(q->mutex));
+        pthread_cond_destroy(&(q->read_cv));
         free(q);
     }
 }
 
 /* on deactivation, the queue will accept no more writes, but will fulfill
- * reads until empty, at which point read will return NULL */
+ * reads until empty, at which point read will return NULL; a source pin's
+ * queue (no writer) still takes its buffers back, so they are freed with it */
 void fg_queue_deactivate(FG_queue *q)
 {
     if(!q)
@@ -52,8 +71,12 @@ void fg_queue_deactivate(FG_queue *q)
     pthread_mutex_lock(&(q->mutex));
 
     q->is_active = 0;
-    fg_log(FG_LOG_QUEUE, "%s> queue deactivated: %s\n", q->writer->stage->name,
-            q->writer->name);
+    if(q->writer)
+        fg_log(FG_LOG_QUEUE, "%s> queue deactivated: %s\n",
+                q->writer->stage->name, q->writer->name);
+    else
+        fg_log(FG_LOG_QUEUE, "%s> buffers deactivated: %s\n",
+                q->reader->stage->name, q->reader->name);
 
     pthread_cond_signal(&(q->read_cv));
     pthread_mutex_unlock(&(q->mutex));
@@ -63,7 +86,7 @@ int fg_queue_write(FG_queue *q, FG_buf *buf)
 {
     pthread_mutex_lock(&(q->mutex));
 
-    if(q->is_active == 0) {
+    if(q->is_active == 0 && q->writer) {
         pthread_mutex_unlock(&(q->mutex));
         return -1;
     }
@@ -90,6 +113,7 @@ int fg_queue_write(FG_queue *q, FG_buf *buf)
     }
 
     q->occupancy++;
+    queue_sample_occupancy(q);
 
     pthread_cond_signal(&(q->read_cv));
     pthread_mutex_unlock(&(q->mutex));
@@ -102,6 +126,7 @@ int fg_queue_write(FG_queue *q, FG_buf *buf)
 FG_buf *fg_queue_read(FG_queue *q)
 {
     FG_buf *buf;
+    uint64_t wait_start = 0;
 
 /*
     fg_log(FG_LOG_QUEUE, "%d> %s/%s locking\n", q->read_pin->stage->id,
@@ -112,9 +137,14 @@ FG_buf *fg_queue_read(FG_queue *q)
     while(q->occupancy == 0) {
         if(! q->is_active) {
             pthread_mutex_unlock(&(q->mutex));
+            if(wait_start)
+                queue_wait_done(q, wait_start);
             return NULL;
         }
 
+        /* only reads that block pay for a clock read */
+        if(!wait_start)
+            wait_start = fg_now_ns();
         pthread_cond_wait(&(q->read_cv), &(q->mutex));
     }
 
@@ -127,12 +157,58 @@ FG_buf *fg_queue_read(FG_queue *q)
     } else {
         q->head = q->head->next;
     }
+    queue_sample_occupancy(q);
 
     fg_log(FG_LOG_QUEUE, "%s> read buffer %d (round %d)\n",
             q->reader->stage->name, buf->id, buf->round_num);
 
     pthread_mutex_unlock(&(q->mutex));
 
+    if(wait_start)
+        queue_wait_done(q, wait_start);
+
     return buf;
 }
 
+/* nonzero if a read would not block: there's a buffer, or the queue has
+ * been deactivated and the read would return NULL */
+int fg_queue_ready(FG_queue *q)
+{
+    int ready;
+
+    pthread_mutex_lock(&(q->mutex));
+    ready = q->occupancy > 0 || !q->is_active;
+    pthread_mutex_unlock(&(q->mutex));
+
+    return ready;
+}
+
+/* call with q->mutex held */
+static void queue_sample_occupancy(FG_queue *q)
+{
+    if(q->occupancy < q->occupancy_min)
+        q->occupancy_min = q->occupancy;
+    if(q->occupancy > q->occupancy_max)
+        q->occupancy_max = q->occupancy;
+    q->occupancy_sum += q->occupancy;
+    q->occupancy_samples++;
+}
+
+/* charges a blocked read to the reading stage: waiting on a queue fed by
+ * another stage is starvation, waiting on a source pin's queue for empty
+ * buffers to come back is back pressure */
+static void queue_wait_done(FG_queue *q, uint64_t start)
+{
+    FG_stage *stage = q->reader->stage;
+    uint64_t ns = fg_now_ns() - start;
+
+    if(q->writer)
+        fg_stat_add(stage->starved_ns, ns);
+    else
+        fg_stat_add(stage->backpressure_ns, ns);
+
+    if(stage->trace)
+        fg_trace_record(stage, q->writer ? FG_TRACE_STARVED
+                : FG_TRACE_BACKPRESSURE, start, ns, q->reader, NULL);
+}
+
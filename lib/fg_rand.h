@@ -0,0 +1,102 @@
+/*
+ * fg_rand.h
+ *
+ * Counter-based random numbers for generating data sets.  The i-th number of
+ * a stream is a hash of the seed and i (the i-th output of splitmix64), not
+ * the next step of a state machine, so:
+ *
+ *  - any record of a data set can be generated without generating those
+ *    before it, which lets threads and stages split a data set however they
+ *    like and still produce exactly the same bytes;
+ *  - a loop filling an array has no dependence from one iteration to the
+ *    next, and compilers vectorize it.
+ *
+ * Not for cryptography.
+ */
+
+#ifndef __FG_RAND_H
+#define __FG_RAND_H
+
+#include <stdint.h>
+#include <math.h>
+
+#define FG_RAND_GOLDEN 0x9e3779b97f4a7c15ULL
+
+/* the splitmix64 finalizer */
+static inline uint64_t fg_rand_mix(uint64_t x)
+{
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+/* number i of the stream seed */
+static inline uint64_t fg_rand_u64(uint64_t seed, uint64_t i)
+{
+    return fg_rand_mix(seed + (i + 1) * FG_RAND_GOLDEN);
+}
+
+/* a stream of its own for each i, for values that take several numbers to
+ * make; its numbers are fg_rand_u64(fg_rand_substream(seed, i), j) */
+static inline uint64_t fg_rand_substream(uint64_t seed, uint64_t i)
+{
+    return fg_rand_mix(fg_rand_u64(seed, i) ^ 0x5851f42d4c957f2dULL);
+}
+
+/* uniform in (0, 1), never exactly 0 or 1, so safe to take logs of */
+static inline double fg_rand_double(uint64_t seed, uint64_t i)
+{
+    return ((fg_rand_u64(seed, i) >> 11) + 0.5) * (1.0 / 9007199254740992.0);
+}
+
+/* standard normal, by Box-Muller */
+static inline double fg_rand_normal(uint64_t seed, uint64_t i)
+{
+    uint64_t s = fg_rand_substream(seed, i);
+
+    return sqrt(-2 * log(fg_rand_double(s, 0)))
+        * cos(2 * M_PI * fg_rand_double(s, 1));
+}
+
+/* Poisson with mean lambda: Knuth's method while it's cheap, a rounded
+ * normal approximation once lambda is large enough for it to be close */
+static inline int64_t fg_rand_poisson(uint64_t seed, uint64_t i, double lambda)
+{
+    uint64_t s = fg_rand_substream(seed, i);
+    double L, p;
+    int64_t k;
+
+    if(lambda > 30) {
+        k = (int64_t) floor(lambda + sqrt(lambda) * fg_rand_normal(s, 0)
+                + 0.5);
+        return k < 0 ? 0 : k;
+    }
+
+    L = exp(-lambda);
+    p = 1.0;
+    for(k = 0; ; k++) {
+        p *= fg_rand_double(s, k);
+        if(p <= L)
+            return k;
+    }
+}
+
+/* Zipf-like over 1..n with exponent s: rank r comes up in proportion to
+ * r^-s.  Inverts the continuous power law's CDF and rounds down, which is
+ * O(1) and close to the discrete distribution for all but the first few
+ * ranks. */
+static inline uint64_t fg_rand_zipf(uint64_t seed, uint64_t i, uint64_t n,
+        double s)
+{
+    double u = fg_rand_double(seed, i);
+    double x;
+
+    if(fabs(s - 1.0) < 1e-9)
+        x = pow((double) n + 1, u);
+    else
+        x = pow(1 + u * (pow((double) n + 1, 1 - s) - 1), 1 / (1 - s));
+
+    return x < 1 ? 1 : x > n ? n : (uint64_t) x;
+}
+
+#endif
@@ -0,0 +1,68 @@
+/*
+ * fg_runfile.h
+ *
+ * Run files hold many sorted runs in one file, so that a pass writing
+ * thousands of runs makes one file rather than one per run.  The run-writer
+ * stage (modules/io_module.c) appends a run per buffer; run-reader serves
+ * each run to a connection of a pin array.
+ *
+ * A run file is a header block, then the runs, each starting on a multiple
+ * of FG_RUNFILE_ALIGN so they can be read with O_DIRECT, then the
+ * directory: an entry per run, in the order written.  The header is written
+ * last, so a file whose writer never finished has no magic.  Integers are
+ * in the byte order of the machine that wrote the file.
+ */
+
+#ifndef __FG_RUNFILE_H
+#define __FG_RUNFILE_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define FG_RUNFILE_MAGIC "FGRUNS1\n"
+#define FG_RUNFILE_ALIGN 4096
+
+struct fg_runfile_header {
+    char magic[8];          /* FG_RUNFILE_MAGIC */
+    uint64_t runs;
+    uint64_t dir_offset;
+};
+
+struct fg_runfile_entry {
+    uint64_t offset;
+    uint64_t length;        /* bytes of data, not counting padding */
+};
+
+/* The number of runs in the run file open on fd, or -1 if it isn't one.
+ * With dir set, the directory is read too, into memory from malloc() that
+ * the caller frees. */
+static inline int64_t fg_runfile_read_dir(int fd, struct fg_runfile_entry **dir)
+{
+    struct fg_runfile_header h;
+    size_t len;
+
+    if(pread(fd, &h, sizeof(h), 0) != sizeof(h)
+            || memcmp(h.magic, FG_RUNFILE_MAGIC, sizeof(h.magic)) != 0
+            || h.runs > INT32_MAX)
+        return -1;
+
+    if(!dir)
+        return h.runs;
+
+    len = h.runs * sizeof(struct fg_runfile_entry);
+    *dir = (struct fg_runfile_entry *) malloc(len ? len : 1);
+    if(!*dir)
+        return -1;
+
+    if(len && pread(fd, *dir, len, h.dir_offset) != (ssize_t) len) {
+        free(*dir);
+        *dir = NULL;
+        return -1;
+    }
+
+    return h.runs;
+}
+
+#endif /* __FG_RUNFILE_H */
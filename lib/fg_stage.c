@@ -16,6 +16,7 @@ FG_stage *fg_stage_create(FG_network *nw, const char *stage_def_name,
     FG_pin *sd_pin;
     FG_pin *pin;
     int pin_count = 0;
+    int i;
 
     fg_log(FG_LOG_STAGE, "new stage %s (%s)\n", stage_name, stage_def_name);
 
@@ -35,6 +36,19 @@ FG_stage *fg_stage_create(FG_network *nw, const char *stage_def_name,
     stage->pins = (FG_pin **) calloc(10, sizeof(FG_pin *));
     /* HACK: magic number! (should tell from number of params in sd) */
     stage->param_vals = (char **) calloc(10, sizeof(char *));
+    /* HACK: magic number! */
+    stage->init_deps = (FG_stage **) calloc(11, sizeof(FG_stage *));
+    stage->init_dep_count = 0;
+
+    stage->func_calls = 0;
+    stage->func_ns = 0;
+    stage->starved_ns = 0;
+    stage->backpressure_ns = 0;
+    stage->trace = NULL;
+    for(i=0; i<FG_PERF_COUNTERS; i++) {
+        stage->perf_fd[i] = -1;
+        stage->perf[i] = FG_STAT_UNAVAILABLE;
+    }
 
     /* instantiate pins */
     for(sd_pin = stage_def->pins; sd_pin->name; sd_pin++) {
@@ -59,6 +73,7 @@ void fg_stage_destroy(FG_stage *s)
             fg_pin_destroy(*pin);
 
         free(s->pins);
+        free(s->init_deps);
         free(s->name);
         free(s);
     }
@@ -95,27 +110,86 @@ char *fg_stage_get_param(FG_stage *stage, const char *param) {
     return NULL;
 }
 
+/* stage inits run concurrently during fg_network_fix; this forces "stage"
+ * to be initialized only once "dep" has been initialized successfully */
+int fg_stage_init_after(FG_stage *stage, FG_stage *dep)
+{
+    if(!stage || !dep || stage == dep)
+        return -1;
+
+    /* HACK: magic number! */
+    if(stage->init_dep_count == 10) {
+        fprintf(stderr, "%s> too many init dependencies\n", stage->name);
+        return -1;
+    }
+
+    stage->init_deps[stage->init_dep_count++] = dep;
+
+    return 0;
+}
+
+/* A stage that failed may never give back the buffers it holds, so stages
+ * waiting for empty buffers would wait forever: every source pin in the
+ * network is told no more are coming, and the stages end as they run out. */
+static void stage_failed(FG_stage *stage)
+{
+    FG_stage **s;
+    FG_pin **pin;
+
+    __atomic_store_n(&stage->nw->failed, 1, __ATOMIC_RELAXED);
+
+    for(s = stage->nw->stages; *s; s++)
+        for(pin = (*s)->pins; *pin; pin++)
+            if((*pin)->direction == PIN_IN && (*pin)->queue
+                    && !(*pin)->queue->writer)
+                fg_queue_deactivate((*pin)->queue);
+}
+
 void *fg_stage_handler(void *data) {
     FG_stage *stage;
     FG_pin **pin;
+    uint32_t i;
     int rc = FG_STAGE_SUCCESS;
+    uint64_t start, end;
 
     stage = (FG_stage *) data;
 
     fg_log(FG_LOG_STAGE, "%s> HANDLER STARTING\n", stage->name);
 
+    if(stage->nw->perf_counters)
+        fg_perf_start(stage);
+
+    /* one clock read per call: each call ends where the next one starts */
+    start = fg_now_ns();
     while(rc == FG_STAGE_SUCCESS) {
         /* printf("%d> handler for stage %s starting\n", stage->id, stage->name); */
         rc = stage->sd->func(stage);
         /* printf("%d> handler for stage %s complete\n", stage->id, stage->name); */
+
+        end = fg_now_ns();
+        fg_stat_add(stage->func_ns, end - start);
+        fg_stat_add(stage->func_calls, 1);
+        if(stage->trace)
+            fg_trace_record(stage, FG_TRACE_FUNC, start, end - start, NULL,
+                    NULL);
+        start = end;
     }
 
+    if(stage->nw->perf_counters)
+        fg_perf_stop(stage);
+
+    if(rc == FG_STAGE_ERROR)
+        stage_failed(stage);
+
     fg_log(FG_LOG_STAGE, "%s> stage complete\n", stage->name);
 
     /* deactivate all outgoing queues */
     for(pin = stage->pins; *pin; pin++) {
         if((*pin)->direction == PIN_OUT) {
             fg_queue_deactivate((*pin)->queue);
+        } else if((*pin)->direction == PIN_ARRAY_OUT) {
+            for(i=0; i<(*pin)->queue_count; i++)
+                fg_queue_deactivate((*pin)->queues[i]);
         }
     }
 
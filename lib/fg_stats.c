@@ -0,0 +1,410 @@
+/*
+ * fg_stats.c
+ *
+ * Runtime statistics.  The counters themselves live in the stage, pin and
+ * queue structures and are updated as buffers move: stage function time is
+ * clocked once per call, and waits are clocked only when a read actually has
+ * to block, so keeping them costs a couple of clock reads per buffer.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "fg_internal.h"
+
+static void queue_reset(FG_queue *q);
+static void queue_stats_add(FG_queue *q, FG_pin_stats *ps, uint64_t *sum,
+        uint64_t *samples);
+static double ms(uint64_t ns);
+static void print_counter(uint64_t v, int width);
+static int stage_index(FG_network *nw, FG_stage *stage);
+static double busy_fraction(FG_stage_stats *ss, uint64_t run_ns);
+
+/* clears all counters; called as the network starts running */
+void fg_stats_reset(FG_network *nw)
+{
+    FG_stage **stage;
+    FG_pin **pin;
+    int i;
+
+    for(stage = nw->stages; *stage; stage++) {
+        for(i=0; i<FG_PERF_COUNTERS; i++)
+            (*stage)->perf[i] = FG_STAT_UNAVAILABLE;
+
+        (*stage)->func_calls = 0;
+        (*stage)->func_ns = 0;
+        (*stage)->starved_ns = 0;
+        (*stage)->backpressure_ns = 0;
+
+        for(pin = (*stage)->pins; *pin; pin++) {
+            (*pin)->buffers = 0;
+            (*pin)->bytes = 0;
+
+            if((*pin)->direction == PIN_IN)
+                queue_reset((*pin)->queue);
+            else if((*pin)->direction == PIN_ARRAY_IN)
+                for(i=0; i<(*pin)->queue_count; i++)
+                    queue_reset((*pin)->queues[i]);
+        }
+    }
+
+    nw->run_ns = 0;
+}
+
+static void queue_reset(FG_queue *q)
+{
+    if(!q)
+        return;
+
+    pthread_mutex_lock(&(q->mutex));
+    q->occupancy_min = q->occupancy;
+    q->occupancy_max = q->occupancy;
+    q->occupancy_sum = 0;
+    q->occupancy_samples = 0;
+    pthread_mutex_unlock(&(q->mutex));
+}
+
+void fg_network_set_print_stats(FG_network *nw, int print_stats)
+{
+    if(nw)
+        nw->print_stats = print_stats;
+}
+
+/* Takes a snapshot of the network's statistics.  May be called while the
+ * network is running; the result must be freed with
+ * fg_network_stats_free(). */
+FG_network_stats *fg_network_get_stats(FG_network *nw)
+{
+    FG_network_stats *stats;
+    FG_stage_stats *ss;
+    FG_pin_stats *ps;
+    FG_stage **stage;
+    FG_pin **pin;
+    uint64_t sum, samples;
+    int i;
+
+    if(!nw)
+        return NULL;
+
+    stats = (FG_network_stats *) calloc(1, sizeof(FG_network_stats));
+    stats->name = strdup(nw->name);
+    stats->stage_count = nw->stage_count;
+    stats->perf_counters = nw->perf_counters;
+    stats->stages = (FG_stage_stats *) calloc(nw->stage_count + 1,
+            sizeof(FG_stage_stats));
+
+    /* a run in progress counts up to now */
+    stats->run_ns = __atomic_load_n(&nw->run_ns, __ATOMIC_RELAXED);
+    if(!stats->run_ns && nw->run_start_ns)
+        stats->run_ns = fg_now_ns() - nw->run_start_ns;
+
+    for(stage = nw->stages, ss = stats->stages; *stage; stage++, ss++) {
+        ss->name = strdup((*stage)->name);
+        ss->func_calls = __atomic_load_n(&(*stage)->func_calls,
+                __ATOMIC_RELAXED);
+        ss->func_ns = __atomic_load_n(&(*stage)->func_ns, __ATOMIC_RELAXED);
+        ss->starved_ns = __atomic_load_n(&(*stage)->starved_ns,
+                __ATOMIC_RELAXED);
+        ss->backpressure_ns = __atomic_load_n(&(*stage)->backpressure_ns,
+                __ATOMIC_RELAXED);
+
+        /* only known once the stage has finished */
+        ss->cycles = __atomic_load_n(&(*stage)->perf[FG_PERF_CYCLES],
+                __ATOMIC_RELAXED);
+        ss->instructions = __atomic_load_n(
+                &(*stage)->perf[FG_PERF_INSTRUCTIONS], __ATOMIC_RELAXED);
+        ss->llc_misses = __atomic_load_n(&(*stage)->perf[FG_PERF_LLC_MISSES],
+                __ATOMIC_RELAXED);
+        ss->dtlb_misses = __atomic_load_n(
+                &(*stage)->perf[FG_PERF_DTLB_MISSES], __ATOMIC_RELAXED);
+
+        for(pin = (*stage)->pins; *pin; pin++)
+            ss->pin_count++;
+        ss->pins = (FG_pin_stats *) calloc(ss->pin_count + 1,
+                sizeof(FG_pin_stats));
+
+        for(pin = (*stage)->pins, ps = ss->pins; *pin; pin++, ps++) {
+            ps->name = strdup((*pin)->name);
+            ps->direction = (*pin)->direction == PIN_OUT
+                || (*pin)->direction == PIN_ARRAY_OUT;
+            ps->buffers = __atomic_load_n(&(*pin)->buffers, __ATOMIC_RELAXED);
+            ps->bytes = __atomic_load_n(&(*pin)->bytes, __ATOMIC_RELAXED);
+
+            /* pin arrays report all of their queues together */
+            sum = samples = 0;
+            if((*pin)->direction == PIN_IN)
+                queue_stats_add((*pin)->queue, ps, &sum, &samples);
+            else if((*pin)->direction == PIN_ARRAY_IN)
+                for(i=0; i<(*pin)->queue_count; i++)
+                    queue_stats_add((*pin)->queues[i], ps, &sum, &samples);
+
+            if(samples)
+                ps->occupancy_avg = (double) sum / samples;
+        }
+    }
+
+    return stats;
+}
+
+static void queue_stats_add(FG_queue *q, FG_pin_stats *ps, uint64_t *sum,
+        uint64_t *samples)
+{
+    if(!q)
+        return;
+
+    pthread_mutex_lock(&(q->mutex));
+
+    if(*samples == 0 || q->occupancy_min < ps->occupancy_min)
+        ps->occupancy_min = q->occupancy_min;
+    if(q->occupancy_max > ps->occupancy_max)
+        ps->occupancy_max = q->occupancy_max;
+    *sum += q->occupancy_sum;
+    *samples += q->occupancy_samples;
+
+    pthread_mutex_unlock(&(q->mutex));
+}
+
+void fg_network_stats_free(FG_network_stats *stats)
+{
+    int i, j;
+
+    if(!stats)
+        return;
+
+    for(i=0; i<stats->stage_count; i++) {
+        for(j=0; j<stats->stages[i].pin_count; j++)
+            free(stats->stages[i].pins[j].name);
+        free(stats->stages[i].pins);
+        free(stats->stages[i].name);
+    }
+    free(stats->stages);
+    free(stats->name);
+    free(stats);
+}
+
+/* Prints one line per stage and, beneath it, one per pin.  "busy" is the
+ * time spent in the stage function less the time it spent waiting. */
+void fg_network_print_stats(FG_network *nw)
+{
+    FG_network_stats *stats;
+    FG_stage_stats *ss;
+    FG_pin_stats *ps;
+    uint64_t waited;
+    int i, j;
+
+    stats = fg_network_get_stats(nw);
+    if(!stats)
+        return;
+
+    printf("network %s: %.1f ms\n", stats->name, ms(stats->run_ns));
+    printf("%-20s %10s %10s %10s %10s %10s\n", "stage", "calls", "func ms",
+            "busy ms", "starved ms", "backpr ms");
+
+    for(i=0; i<stats->stage_count; i++) {
+        ss = stats->stages + i;
+        waited = ss->starved_ns + ss->backpressure_ns;
+
+        printf("%-20s %10llu %10.1f %10.1f %10.1f %10.1f\n", ss->name,
+                (unsigned long long) ss->func_calls, ms(ss->func_ns),
+                ms(ss->func_ns > waited ? ss->func_ns - waited : 0),
+                ms(ss->starved_ns), ms(ss->backpressure_ns));
+
+        for(j=0; j<ss->pin_count; j++) {
+            ps = ss->pins + j;
+            printf("  %-10s %-3s %10llu bufs %14llu bytes", ps->name,
+                    ps->direction ? "out" : "in",
+                    (unsigned long long) ps->buffers,
+                    (unsigned long long) ps->bytes);
+            if(!ps->direction)
+                printf("  occ %u/%u/%.1f", ps->occupancy_min,
+                        ps->occupancy_max, ps->occupancy_avg);
+            printf("\n");
+        }
+    }
+
+    if(stats->perf_counters) {
+        printf("%-20s %13s %13s %6s %11s %11s\n", "stage", "cycles",
+                "instructions", "IPC", "LLC misses", "dTLB misses");
+        for(i=0; i<stats->stage_count; i++) {
+            ss = stats->stages + i;
+            printf("%-20s ", ss->name);
+            print_counter(ss->cycles, 13);
+            print_counter(ss->instructions, 13);
+            if(ss->cycles != FG_STAT_UNAVAILABLE && ss->cycles
+                    && ss->instructions != FG_STAT_UNAVAILABLE)
+                printf(" %6.2f", (double) ss->instructions / ss->cycles);
+            else
+                printf(" %6s", "-");
+            print_counter(ss->llc_misses, 11);
+            print_counter(ss->dtlb_misses, 11);
+            printf("\n");
+        }
+    }
+
+    fg_network_stats_free(stats);
+}
+
+static void print_counter(uint64_t v, int width)
+{
+    if(v == FG_STAT_UNAVAILABLE)
+        printf(" %*s", width, "-");
+    else
+        printf(" %*llu", width, (unsigned long long) v);
+}
+
+void fg_network_set_print_bottleneck(FG_network *nw, int print_bottleneck)
+{
+    if(nw)
+        nw->print_bottleneck = print_bottleneck;
+}
+
+/* Names the stage that limits the network's throughput: the busiest one.  If
+ * its input queues stay full while the stages downstream of it go hungry, it
+ * is the bottleneck beyond doubt, and both are reported as evidence.  Also
+ * estimates, from the time fractions alone, what running two copies of that
+ * stage, or giving more buffers to a stage that waits for them, would gain;
+ * the network can never run faster than its busiest stage allows. */
+void fg_network_print_bottleneck(FG_network *nw)
+{
+    FG_network_stats *stats;
+    FG_stage_stats *ss;
+    FG_pin_stats *ps;
+    FG_stage *stage;
+    FG_pin **pin;
+    FG_queue *q;
+    double busy, next_busy, waits, most_waits, full, starved, speedup;
+    int b, w, i, j, k, n, starved_stage;
+
+    stats = fg_network_get_stats(nw);
+    if(!stats || stats->run_ns == 0 || stats->stage_count == 0) {
+        fg_network_stats_free(stats);
+        return;
+    }
+
+    /* the busiest stage, the runner-up, and the stage waiting the longest
+     * for empty buffers */
+    b = w = 0;
+    busy = next_busy = most_waits = 0;
+    for(i=0; i<stats->stage_count; i++) {
+        ss = stats->stages + i;
+        if(busy_fraction(ss, stats->run_ns) > busy) {
+            next_busy = busy;
+            busy = busy_fraction(ss, stats->run_ns);
+            b = i;
+        } else if(busy_fraction(ss, stats->run_ns) > next_busy) {
+            next_busy = busy_fraction(ss, stats->run_ns);
+        }
+
+        waits = (double) ss->backpressure_ns / stats->run_ns;
+        if(waits > most_waits) {
+            most_waits = waits;
+            w = i;
+        }
+    }
+
+    stage = nw->stages[b];
+    ss = stats->stages + b;
+
+    /* how full the queues feeding it are, on average, compared to the most
+     * they have held */
+    full = 0;
+    for(pin = stage->pins, ps = ss->pins; *pin; pin++, ps++) {
+        if(((*pin)->direction == PIN_IN && (*pin)->queue
+                    && (*pin)->queue->writer)
+                || (*pin)->direction == PIN_ARRAY_IN) {
+            if(ps->occupancy_max && ps->occupancy_avg / ps->occupancy_max
+                    > full)
+                full = ps->occupancy_avg / ps->occupancy_max;
+        }
+    }
+
+    /* and how hungry the stages it feeds are */
+    starved = 0;
+    starved_stage = -1;
+    for(pin = stage->pins; *pin; pin++) {
+        /* a pin array feeds a stage through each of its queues */
+        if((*pin)->direction == PIN_OUT)
+            n = 1;
+        else if((*pin)->direction == PIN_ARRAY_OUT)
+            n = (*pin)->queue_count;
+        else
+            continue;
+
+        for(j = 0; j < n; j++) {
+            q = (*pin)->direction == PIN_OUT ? (*pin)->queue
+                : (*pin)->queues[j];
+            if(!q || !q->reader)
+                continue;
+
+            k = stage_index(nw, q->reader->stage);
+            if(k >= 0 && (double) stats->stages[k].starved_ns / stats->run_ns
+                    > starved) {
+                starved = (double) stats->stages[k].starved_ns
+                    / stats->run_ns;
+                starved_stage = k;
+            }
+        }
+    }
+
+    printf("bottleneck: %s: %.0f%% busy", ss->name, busy * 100);
+    if(full > 0)
+        printf(", input queues %.0f%% full", full * 100);
+    if(starved_stage >= 0)
+        printf(", %s starved %.0f%%", stats->stages[starved_stage].name,
+                starved * 100);
+    printf("\n");
+
+    if(busy > 0) {
+        speedup = busy / (busy / 2 > next_busy ? busy / 2 : next_busy);
+        printf("  two copies of %s: about %.2fx faster\n", ss->name,
+                speedup);
+    }
+
+    if(most_waits > 0.01) {
+        ss = stats->stages + w;
+        speedup = 1 / (1 - most_waits);
+        if(busy > 0 && speedup > 1 / busy)
+            speedup = 1 / busy;
+
+        printf("  more buffers for");
+        for(pin = nw->stages[w]->pins, j = 0; *pin; pin++) {
+            if((*pin)->direction == PIN_IN && (*pin)->queue
+                    && !(*pin)->queue->writer)
+                printf("%s %s.%s", j++ ? "," : "", ss->name, (*pin)->name);
+        }
+        printf(": up to %.2fx faster (%s waited for buffers %.0f%%)\n",
+                speedup, ss->name, most_waits * 100);
+    }
+
+    fg_network_stats_free(stats);
+}
+
+static int stage_index(FG_network *nw, FG_stage *stage)
+{
+    int i;
+
+    for(i=0; i<nw->stage_count; i++) {
+        if(nw->stages[i] == stage)
+            return i;
+    }
+
+    return -1;
+}
+
+/* fraction of the run a stage spent working rather than waiting */
+static double busy_fraction(FG_stage_stats *ss, uint64_t run_ns)
+{
+    uint64_t waited = ss->starved_ns + ss->backpressure_ns;
+
+    if(ss->func_ns <= waited)
+        return 0;
+
+    return (double) (ss->func_ns - waited) / run_ns;
+}
+
+static double ms(uint64_t ns)
+{
+    return ns / 1e6;
+}
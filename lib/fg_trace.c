@@ -0,0 +1,236 @@
+/*
+ * fg_trace.c
+ *
+ * Buffer-flow tracing.  When a network has a trace file, each stage records
+ * timestamped events into a ring buffer of its own while the network runs:
+ * calls to its function, reads that had to wait, and every buffer accepted
+ * and conveyed.  Since each stage runs on a thread of its own, recording
+ * takes no locks.  Should a ring fill up, its oldest events are overwritten.
+ *
+ * When the run finishes, the events are written out in the Chrome trace-event
+ * format, which chrome://tracing and Perfetto (ui.perfetto.dev) can open:
+ * one track per stage, with flow arrows following each buffer from the stage
+ * that conveyed it to the stage that accepted it.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "fg_internal.h"
+
+/* default number of events kept per stage; FG_TRACE_EVENTS overrides */
+#define FG_TRACE_DEFAULT_EVENTS 65536
+
+struct trace_event {
+    uint64_t ts;
+    uint64_t dur;               /* FG_TRACE_FUNC and waits only */
+    const char *pin;
+    uint32_t buf_id;
+    uint32_t round_num;
+    uint32_t seq;
+    int type;
+};
+
+struct fg_trace_ring {
+    struct trace_event *events;
+    uint64_t size;
+    uint64_t count;             /* events recorded, including overwritten */
+};
+
+static void trace_write(FG_network *nw, FILE *f);
+static void trace_write_event(FILE *f, int tid, struct trace_event *e,
+        uint64_t t0);
+static void json_string(FILE *f, const char *s);
+static double us(uint64_t ns, uint64_t t0);
+
+void fg_network_set_trace(FG_network *nw, const char *filename)
+{
+    if(!nw)
+        return;
+
+    free(nw->trace_file);
+    nw->trace_file = filename ? strdup(filename) : NULL;
+}
+
+/* gives every stage a ring to record into, if the network is being traced */
+void fg_trace_start(FG_network *nw)
+{
+    FG_stage **stage;
+    uint64_t size = FG_TRACE_DEFAULT_EVENTS;
+
+    if(!nw->trace_file)
+        return;
+
+    if(getenv("FG_TRACE_EVENTS") && atoi(getenv("FG_TRACE_EVENTS")) > 0)
+        size = atoi(getenv("FG_TRACE_EVENTS"));
+
+    for(stage = nw->stages; *stage; stage++) {
+        (*stage)->trace = (struct fg_trace_ring *)
+            malloc(sizeof(struct fg_trace_ring));
+        (*stage)->trace->events = (struct trace_event *)
+            malloc(size * sizeof(struct trace_event));
+        (*stage)->trace->size = size;
+        (*stage)->trace->count = 0;
+
+        if(!(*stage)->trace->events) {
+            fprintf(stderr, "%s> no memory for trace events\n",
+                    (*stage)->name);
+            free((*stage)->trace);
+            (*stage)->trace = NULL;
+        }
+    }
+}
+
+/* writes the trace file once every stage has finished, then frees the rings */
+void fg_trace_finish(FG_network *nw)
+{
+    FG_stage **stage;
+    FILE *f;
+
+    if(!nw->trace_file)
+        return;
+
+    f = fopen(nw->trace_file, "w");
+    if(f) {
+        trace_write(nw, f);
+        fclose(f);
+        fg_log(FG_LOG_NETWORK, "wrote trace to %s\n", nw->trace_file);
+    } else {
+        perror(nw->trace_file);
+    }
+
+    for(stage = nw->stages; *stage; stage++) {
+        if((*stage)->trace) {
+            free((*stage)->trace->events);
+            free((*stage)->trace);
+            (*stage)->trace = NULL;
+        }
+    }
+}
+
+/* called only from the stage's own thread, and only if stage->trace is set */
+void fg_trace_record(FG_stage *stage, int type, uint64_t ts, uint64_t dur,
+        FG_pin *pin, FG_buf *buf)
+{
+    struct fg_trace_ring *ring = stage->trace;
+    struct trace_event *e;
+
+    e = ring->events + ring->count % ring->size;
+    e->type = type;
+    e->ts = ts;
+    e->dur = dur;
+    e->pin = pin ? pin->name : NULL;
+    if(buf) {
+        e->buf_id = buf->id;
+        e->round_num = buf->round_num;
+        e->seq = buf->trace_seq;
+    }
+
+    ring->count++;
+}
+
+static void trace_write(FG_network *nw, FILE *f)
+{
+    FG_stage **stage;
+    struct fg_trace_ring *ring;
+    uint64_t first, i;
+    int tid;
+
+    fprintf(f, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+    fprintf(f, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,"
+            "\"args\":{\"name\":\"");
+    json_string(f, nw->name);
+    fprintf(f, "\"}}");
+
+    for(stage = nw->stages, tid = 1; *stage; stage++, tid++) {
+        fprintf(f, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,"
+                "\"tid\":%d,\"args\":{\"name\":\"", tid);
+        json_string(f, (*stage)->name);
+        fprintf(f, "\"}}");
+
+        ring = (*stage)->trace;
+        if(!ring)
+            continue;
+
+        if(ring->count > ring->size)
+            fprintf(stderr, "%s> trace ring overflowed, %llu oldest events "
+                    "lost\n", (*stage)->name,
+                    (unsigned long long) (ring->count - ring->size));
+
+        first = ring->count > ring->size ? ring->count - ring->size : 0;
+        for(i = first; i < ring->count; i++)
+            trace_write_event(f, tid, ring->events + i % ring->size,
+                    nw->run_start_ns);
+    }
+
+    fprintf(f, "\n]}\n");
+}
+
+/* Flow ids pair a convey with the accept of the same buffer at the other
+ * end: the buffer's id in the upper half, and in the lower half the number
+ * of times it had been conveyed, which only the convey bumps. */
+static void trace_write_event(FILE *f, int tid, struct trace_event *e,
+        uint64_t t0)
+{
+    unsigned long long flow_id;
+
+    flow_id = ((unsigned long long) e->buf_id << 32) | e->seq;
+
+    switch(e->type) {
+        case FG_TRACE_FUNC:
+            fprintf(f, ",\n{\"name\":\"func\",\"ph\":\"X\",\"pid\":1,"
+                    "\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}", tid, us(e->ts, t0),
+                    us(e->dur, 0));
+            break;
+
+        case FG_TRACE_STARVED:
+        case FG_TRACE_BACKPRESSURE:
+            fprintf(f, ",\n{\"name\":\"wait ");
+            json_string(f, e->pin);
+            fprintf(f, "\",\"cat\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,"
+                    "\"ts\":%.3f,\"dur\":%.3f}",
+                    e->type == FG_TRACE_STARVED ? "starved" : "backpressure",
+                    tid, us(e->ts, t0), us(e->dur, 0));
+            break;
+
+        case FG_TRACE_ACCEPT:
+        case FG_TRACE_CONVEY:
+            fprintf(f, ",\n{\"name\":\"%s ",
+                    e->type == FG_TRACE_ACCEPT ? "accept" : "convey");
+            json_string(f, e->pin);
+            fprintf(f, "\",\"ph\":\"i\",\"s\":\"t\",\"pid\":1,\"tid\":%d,"
+                    "\"ts\":%.3f,\"args\":{\"buf\":%u,\"round\":%u}}",
+                    tid, us(e->ts, t0), e->buf_id, e->round_num);
+
+            /* buffers fresh from a source pin were never conveyed */
+            if(e->type == FG_TRACE_ACCEPT && e->seq == 0)
+                break;
+
+            fprintf(f, ",\n{\"name\":\"buffer %u\",\"cat\":\"buffer\","
+                    "\"ph\":\"%s\",\"id\":%llu,\"pid\":1,\"tid\":%d,"
+                    "\"ts\":%.3f}", e->buf_id,
+                    e->type == FG_TRACE_CONVEY ? "s" : "f\",\"bp\":\"e",
+                    flow_id, tid, us(e->ts, t0));
+            break;
+    }
+}
+
+/* the inside of a JSON string: names come from config files and may hold
+ * anything */
+static void json_string(FILE *f, const char *s)
+{
+    for(; *s; s++) {
+        if(*s == '"' || *s == '\\')
+            fprintf(f, "\\%c", *s);
+        else if((unsigned char) *s < 0x20)
+            fprintf(f, "\\u%04x", (unsigned char) *s);
+        else
+            fputc(*s, f);
+    }
+}
+
+static double us(uint64_t ns, uint64_t t0)
+{
+    return (ns - t0) / 1e3;
+}
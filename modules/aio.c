@@ -0,0 +1,463 @@
+/*
+ * aio.c
+ *
+ * Two engines behind one interface.  io_uring is driven through its raw
+ * system calls, so there is nothing to link against and nothing to install;
+ * where the kernel lacks it or a sandbox forbids it, a pool of depth threads
+ * doing pread() and pwrite() keeps the same number of requests in flight.
+ *
+ * A request's result is what pread() or pwrite() would have returned, or
+ * -errno.  Transfers may come back short; finishing them is up to the
+ * caller, who knows where the file ends.
+ *
+ * aio_submit() and aio_complete() are meant to be called from one thread,
+ * the stage's own.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+#include "aio.h"
+
+struct aio_req {
+    int write;
+    char *data;
+    size_t len;
+    off_t offset;
+    void *tag;
+    ssize_t res;
+    struct iovec iov;       /* must live until the kernel is done with it */
+};
+
+struct uring {
+    int fd;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ring, *cq_ring;
+    size_t sq_ring_size, cq_ring_size, sqes_size;
+};
+
+struct aio_ {
+    enum aio_engine engine;
+    int fd;
+    int depth;
+    struct aio_req *reqs;
+    int *free_reqs;         /* stack of unused indices into reqs */
+    int free_count;
+
+    struct uring ring;
+
+    /* thread engine: FIFOs of request indices, guarded by mutex */
+    pthread_t *threads;
+    pthread_mutex_t mutex;
+    pthread_cond_t pending_cv;
+    pthread_cond_t done_cv;
+    int *pending, pending_head, pending_count;
+    int *done, done_head, done_count;
+    int stop;
+};
+
+static int uring_setup(aio *a);
+static void uring_teardown(aio *a);
+static int uring_submit(aio *a, int i);
+static int uring_complete(aio *a, int block);
+static int threads_setup(aio *a);
+static void threads_teardown(aio *a);
+static void *threads_worker(void *data);
+
+aio *aio_create(int fd, int depth, enum aio_engine engine)
+{
+    aio *a;
+    int i;
+
+    if(depth < 1)
+        return NULL;
+
+    a = (aio *) calloc(1, sizeof(aio));
+    if(!a)
+        return NULL;
+
+    a->fd = fd;
+    a->depth = depth;
+    a->reqs = (struct aio_req *) calloc(depth, sizeof(struct aio_req));
+    a->free_reqs = (int *) calloc(depth, sizeof(int));
+    if(!a->reqs || !a->free_reqs)
+        goto fail;
+
+    for(i = 0; i < depth; i++)
+        a->free_reqs[i] = depth - 1 - i;
+    a->free_count = depth;
+
+    a->ring.fd = -1;
+    if(engine != AIO_THREADS && uring_setup(a) == 0) {
+        a->engine = AIO_URING;
+        return a;
+    }
+    if(engine == AIO_URING)
+        goto fail;
+
+    if(threads_setup(a) == 0) {
+        a->engine = AIO_THREADS;
+        return a;
+    }
+
+fail:
+    free(a->reqs);
+    free(a->free_reqs);
+    free(a);
+    return NULL;
+}
+
+/* requests still in flight are waited for, so their buffers can be reused
+ * as soon as this returns */
+void aio_destroy(aio *a)
+{
+    void *tag;
+    ssize_t res;
+
+    if(!a)
+        return;
+
+    while(a->free_count < a->depth)
+        if(aio_complete(a, 1, &tag, &res) < 0)
+            break;
+
+    if(a->engine == AIO_URING)
+        uring_teardown(a);
+    else
+        threads_teardown(a);
+
+    free(a->reqs);
+    free(a->free_reqs);
+    free(a);
+}
+
+const char *aio_engine_name(aio *a)
+{
+    return a->engine == AIO_URING ? "io_uring" : "threads";
+}
+
+/* starts a read into, or a write from, data; tag comes back with the
+ * result.  Returns -1 if depth requests are already in flight. */
+int aio_submit(aio *a, int write, char *data, size_t len, off_t offset,
+        void *tag)
+{
+    struct aio_req *r;
+    int i;
+
+    if(a->free_count == 0)
+        return -1;
+
+    i = a->free_reqs[--a->free_count];
+    r = &a->reqs[i];
+    r->write = write;
+    r->data = data;
+    r->len = len;
+    r->offset = offset;
+    r->tag = tag;
+    r->res = 0;
+
+    if(a->engine == AIO_URING) {
+        if(uring_submit(a, i) < 0) {
+            a->free_reqs[a->free_count++] = i;
+            return -1;
+        }
+        return 0;
+    }
+
+    pthread_mutex_lock(&a->mutex);
+    a->pending[(a->pending_head + a->pending_count) % a->depth] = i;
+    a->pending_count++;
+    pthread_cond_signal(&a->pending_cv);
+    pthread_mutex_unlock(&a->mutex);
+
+    return 0;
+}
+
+/* Reaps a finished request, in whatever order they finish.  Returns 1 and
+ * its tag and result, 0 if none has finished and block is 0 (or none is in
+ * flight), or -1 on error. */
+int aio_complete(aio *a, int block, void **tag, ssize_t *res)
+{
+    int i;
+
+    if(a->free_count == a->depth)
+        return 0;
+
+    if(a->engine == AIO_URING) {
+        i = uring_complete(a, block);
+        if(i < 0)
+            return i == -2 ? 0 : -1;
+    } else {
+        pthread_mutex_lock(&a->mutex);
+        while(a->done_count == 0 && block)
+            pthread_cond_wait(&a->done_cv, &a->mutex);
+        if(a->done_count == 0) {
+            pthread_mutex_unlock(&a->mutex);
+            return 0;
+        }
+        i = a->done[a->done_head];
+        a->done_head = (a->done_head + 1) % a->depth;
+        a->done_count--;
+        pthread_mutex_unlock(&a->mutex);
+    }
+
+    *tag = a->reqs[i].tag;
+    *res = a->reqs[i].res;
+    a->free_reqs[a->free_count++] = i;
+
+    return 1;
+}
+
+/* io_uring engine
+ *************************************************************/
+
+static int uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+        unsigned flags)
+{
+    return (int) syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+            flags, NULL, 0);
+}
+
+static int uring_setup(aio *a)
+{
+    struct uring *u = &a->ring;
+    struct io_uring_params p;
+
+    memset(&p, 0, sizeof(p));
+    u->fd = (int) syscall(__NR_io_uring_setup, a->depth, &p);
+    if(u->fd < 0)
+        return -1;
+
+    u->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    u->cq_ring_size = p.cq_off.cqes
+        + p.cq_entries * sizeof(struct io_uring_cqe);
+    if(p.features & IORING_FEAT_SINGLE_MMAP) {
+        if(u->cq_ring_size > u->sq_ring_size)
+            u->sq_ring_size = u->cq_ring_size;
+        u->cq_ring_size = u->sq_ring_size;
+    }
+
+    u->sq_ring = mmap(NULL, u->sq_ring_size, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+    if(u->sq_ring == MAP_FAILED)
+        goto fail_fd;
+
+    if(p.features & IORING_FEAT_SINGLE_MMAP) {
+        u->cq_ring = u->sq_ring;
+    } else {
+        u->cq_ring = mmap(NULL, u->cq_ring_size, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+        if(u->cq_ring == MAP_FAILED)
+            goto fail_sq;
+    }
+
+    u->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    u->sqes = (struct io_uring_sqe *) mmap(NULL, u->sqes_size,
+            PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd,
+            IORING_OFF_SQES);
+    if(u->sqes == MAP_FAILED)
+        goto fail_cq;
+
+    u->sq_head = (unsigned *) ((char *) u->sq_ring + p.sq_off.head);
+    u->sq_tail = (unsigned *) ((char *) u->sq_ring + p.sq_off.tail);
+    u->sq_mask = (unsigned *) ((char *) u->sq_ring + p.sq_off.ring_mask);
+    u->sq_array = (unsigned *) ((char *) u->sq_ring + p.sq_off.array);
+    u->cq_head = (unsigned *) ((char *) u->cq_ring + p.cq_off.head);
+    u->cq_tail = (unsigned *) ((char *) u->cq_ring + p.cq_off.tail);
+    u->cq_mask = (unsigned *) ((char *) u->cq_ring + p.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe *) ((char *) u->cq_ring + p.cq_off.cqes);
+
+    return 0;
+
+fail_cq:
+    if(u->cq_ring != u->sq_ring)
+        munmap(u->cq_ring, u->cq_ring_size);
+fail_sq:
+    munmap(u->sq_ring, u->sq_ring_size);
+fail_fd:
+    close(u->fd);
+    u->fd = -1;
+    return -1;
+}
+
+static void uring_teardown(aio *a)
+{
+    struct uring *u = &a->ring;
+
+    munmap(u->sqes, u->sqes_size);
+    if(u->cq_ring != u->sq_ring)
+        munmap(u->cq_ring, u->cq_ring_size);
+    munmap(u->sq_ring, u->sq_ring_size);
+    close(u->fd);
+}
+
+static int uring_submit(aio *a, int i)
+{
+    struct uring *u = &a->ring;
+    struct aio_req *r = &a->reqs[i];
+    struct io_uring_sqe *sqe;
+    unsigned tail, idx;
+    int n;
+
+    /* never more in flight than entries, so there is always room */
+    tail = *u->sq_tail;
+    idx = tail & *u->sq_mask;
+    sqe = &u->sqes[idx];
+
+    r->iov.iov_base = r->data;
+    r->iov.iov_len = r->len;
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = r->write ? IORING_OP_WRITEV : IORING_OP_READV;
+    sqe->fd = a->fd;
+    sqe->off = r->offset;
+    sqe->addr = (unsigned long) &r->iov;
+    sqe->len = 1;
+    sqe->user_data = i;
+
+    u->sq_array[idx] = idx;
+    __atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+    do {
+        n = uring_enter(u->fd, 1, 0, 0);
+    } while(n < 0 && (errno == EINTR || errno == EAGAIN));
+
+    if(n == 1)
+        return 0;
+
+    /* The kernel takes entries only inside io_uring_enter(), so one it did
+     * not take can be withdrawn before the request goes back on the free
+     * list; left in the ring, a later enter would submit it anyway.  One it
+     * did take is in flight, and its completion carries the error. */
+    if(__atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) != tail)
+        return 0;
+    __atomic_store_n(u->sq_tail, tail, __ATOMIC_RELEASE);
+
+    return -1;
+}
+
+/* index of a finished request, -2 if none is ready and block is 0, or -1 */
+static int uring_complete(aio *a, int block)
+{
+    struct uring *u = &a->ring;
+    struct io_uring_cqe *cqe;
+    unsigned head;
+    int i;
+
+    head = *u->cq_head;
+    while(head == __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE)) {
+        if(!block)
+            return -2;
+        if(uring_enter(u->fd, 0, 1, IORING_ENTER_GETEVENTS) < 0
+                && errno != EINTR)
+            return -1;
+    }
+
+    cqe = &u->cqes[head & *u->cq_mask];
+    i = (int) cqe->user_data;
+    a->reqs[i].res = cqe->res;
+    __atomic_store_n(u->cq_head, head + 1, __ATOMIC_RELEASE);
+
+    return i;
+}
+
+/* thread engine
+ *************************************************************/
+
+static int threads_setup(aio *a)
+{
+    int i;
+
+    a->threads = (pthread_t *) calloc(a->depth, sizeof(pthread_t));
+    a->pending = (int *) calloc(a->depth, sizeof(int));
+    a->done = (int *) calloc(a->depth, sizeof(int));
+    if(!a->threads || !a->pending || !a->done) {
+        free(a->threads);
+        free(a->pending);
+        free(a->done);
+        return -1;
+    }
+
+    pthread_mutex_init(&a->mutex, NULL);
+    pthread_cond_init(&a->pending_cv, NULL);
+    pthread_cond_init(&a->done_cv, NULL);
+
+    for(i = 0; i < a->depth; i++) {
+        if(pthread_create(&a->threads[i], NULL, threads_worker, a) != 0) {
+            a->depth = i;       /* only join those that started */
+            threads_teardown(a);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static void threads_teardown(aio *a)
+{
+    int i;
+
+    pthread_mutex_lock(&a->mutex);
+    a->stop = 1;
+    pthread_cond_broadcast(&a->pending_cv);
+    pthread_mutex_unlock(&a->mutex);
+
+    for(i = 0; i < a->depth; i++)
+        pthread_join(a->threads[i], NULL);
+
+    pthread_mutex_destroy(&a->mutex);
+    pthread_cond_destroy(&a->pending_cv);
+    pthread_cond_destroy(&a->done_cv);
+    free(a->threads);
+    free(a->pending);
+    free(a->done);
+}
+
+static void *threads_worker(void *data)
+{
+    aio *a = (aio *) data;
+    struct aio_req *r;
+    ssize_t n;
+    int i;
+
+    for(;;) {
+        pthread_mutex_lock(&a->mutex);
+        while(a->pending_count == 0 && !a->stop)
+            pthread_cond_wait(&a->pending_cv, &a->mutex);
+        if(a->pending_count == 0) {
+            pthread_mutex_unlock(&a->mutex);
+            return NULL;
+        }
+        i = a->pending[a->pending_head];
+        a->pending_head = (a->pending_head + 1) % a->depth;
+        a->pending_count--;
+        pthread_mutex_unlock(&a->mutex);
+
+        r = &a->reqs[i];
+        do {
+            if(r->write)
+                n = pwrite(a->fd, r->data, r->len, r->offset);
+            else
+                n = pread(a->fd, r->data, r->len, r->offset);
+        } while(n < 0 && errno == EINTR);
+        r->res = n < 0 ? -errno : n;
+
+        pthread_mutex_lock(&a->mutex);
+        a->done[(a->done_head + a->done_count) % a->depth] = i;
+        a->done_count++;
+        pthread_cond_signal(&a->done_cv);
+        pthread_mutex_unlock(&a->mutex);
+    }
+}
@@ -0,0 +1,29 @@
+/*
+ * aio.h
+ *
+ * Asynchronous positioned reads and writes on one file descriptor, for the
+ * io module's stages.  Up to depth requests may be in flight at once.
+ */
+
+#ifndef __AIO_H_
+#define __AIO_H_
+
+#include <stddef.h>
+#include <sys/types.h>
+
+typedef struct aio_ aio;
+
+enum aio_engine {
+    AIO_AUTO,               /* io_uring if the kernel allows it, else threads */
+    AIO_URING,
+    AIO_THREADS
+};
+
+aio *aio_create(int fd, int depth, enum aio_engine engine);
+void aio_destroy(aio *a);
+const char *aio_engine_name(aio *a);
+int aio_submit(aio *a, int write, char *data, size_t len, off_t offset,
+        void *tag);
+int aio_complete(aio *a, int block, void **tag, ssize_t *res);
+
+#endif /* __AIO_H_ */
@@ -11,6 +11,7 @@
 #include <mpi.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <errno.h>
 
 #include "fg_internal.h"
 #include "pq.h"
@@ -18,6 +19,10 @@
 #define DSORT_DATA 1
 #define DSORT_SCATTER_DONE 2
 
+/* MPI counts are ints, so buffers bigger than this go in several messages;
+ * a multiple of RECLEN */
+#define DSORT_MAX_MSG (1 << 30)
+
 /* WARNING: pretty much this entire file depends on keys being 64-bit signed
  * integers and records (including key) being 64 bytes */
 enum {
@@ -131,7 +136,7 @@ struct merge_state {
 
 struct pq_entry {
     FG_buf *buffer;
-    uint32_t offset;
+    uint64_t offset;
     uint32_t pin_index;
 };
 
@@ -167,7 +172,8 @@ int merge_func(FG_stage *stage)
     s->p = pq_create(s->num_inputs);
     pqes = (struct pq_entry *) calloc(s->num_inputs, sizeof(struct pq_entry));
 
-    printf("%s> input pin array width is %d\n", stage->name, s->num_inputs);
+    fg_log(FG_LOG_STAGE, "%s> input pin array width is %d\n", stage->name,
+            s->num_inputs);
 
     /* before we can start, need to get a buffer from each input */
     for(i=0; i<s->num_inputs; i++) {
@@ -181,10 +187,10 @@ int merge_func(FG_stage *stage)
 
             pq_insert(s->p, key, pqe);
 
-            fg_log(FG_LOG_MODULE, "%s> accepted initial buffer from input %d\n",
+            fg_log(FG_LOG_DATA, "%s> accepted initial buffer from input %d\n",
                     stage->name, i);
         } else {
-            fg_log(FG_LOG_MODULE, "%s> no initial buffer available from input %d\n",
+            fg_log(FG_LOG_DATA, "%s> no initial buffer available from input %d\n",
                     stage->name, i);
         }
     }
@@ -193,9 +199,11 @@ int merge_func(FG_stage *stage)
         /* if no output buffer, get one */
         if(!merged_buf) {
             merged_buf = fg_pin_accept_buffer(buf_in);
+            if(!merged_buf)
+                break;
             merged_buf->datalen= 0;
 
-            fg_log(FG_LOG_MODULE, "%s> accepted empty buffer to fill\n",
+            fg_log(FG_LOG_DATA, "%s> accepted empty buffer to fill\n",
                     stage->name);
         }
 
@@ -208,7 +216,7 @@ int merge_func(FG_stage *stage)
         /* if input buffer is exhausted, discard it and get another */
         if(pqe->offset >= pqe->buffer->size) {
             fg_pin_convey_buffer(buf_out, pqe->buffer);
-            fg_log(FG_LOG_MODULE, "%s> input buffer %i exhausted\n",
+            fg_log(FG_LOG_DATA, "%s> input buffer %i exhausted\n",
                     stage->name, pqe->pin_index);
 
             pqe->buffer = fg_pin_array_accept_buffer(data_in, pqe->pin_index);
@@ -225,7 +233,7 @@ int merge_func(FG_stage *stage)
         /* if output buffer full, convey */
         if(merged_buf->datalen >= merged_buf->size) {
             fg_pin_convey_buffer(data_out, merged_buf);
-            fg_log(FG_LOG_MODULE, "%s> conveyed merged buffer\n", stage->name);
+            fg_log(FG_LOG_DATA, "%s> conveyed merged buffer\n", stage->name);
             merged_buf = NULL;
         }
     }
@@ -243,7 +251,7 @@ int merge_func(FG_stage *stage)
 
 struct scatter_state {
     int num_procs;
-    int recnum;
+    int64_t recnum;
     splitter *splitters;
 };
 
@@ -261,6 +269,12 @@ int scatter_init(FG_stage *stage)
 
     filename = fg_stage_get_param(stage, "splitter_filename");
     fd = open(filename, O_RDONLY);
+    if(fd < 0) {
+        fprintf(stderr, "%s> cannot open %s: %s\n", stage->name, filename,
+                strerror(errno));
+        free(s);
+        return -1;
+    }
 
     s->splitters = (splitter *) calloc(s->num_procs, sizeof(splitter));
     read(fd, s->splitters, sizeof(splitter) * s->num_procs);
@@ -268,7 +282,7 @@ int scatter_init(FG_stage *stage)
     close(fd);
 
     for(i=0; i<s->num_procs; i++) {
-        printf("%s> splitter %d = %016lx == %ld (%ld, %ld)\n",
+        fg_log(FG_LOG_STAGE, "%s> splitter %d = %016lx == %ld (%ld, %ld)\n",
                 stage->name, i, (s->splitters + i)->key,
                 (s->splitters + i)->key, (s->splitters + i)->proc,
                 (s->splitters + i)->index);
@@ -281,7 +295,8 @@ int scatter_init(FG_stage *stage)
 
 int scatter_func(FG_stage *stage)
 {
-    int i, n;
+    int i;
+    uint64_t n, sent, chunk;
     int rank;
     int rc;
     int64_t *key;
@@ -289,7 +304,7 @@ int scatter_func(FG_stage *stage)
     FG_pin *pin;
     FG_buf *buf;
     struct scatter_state *s;
-    int bytes_per_round;
+    uint64_t bytes_per_round;
 
     s = (struct scatter_state *) stage->data;
 
@@ -299,7 +314,7 @@ int scatter_func(FG_stage *stage)
     buf = fg_pin_accept_buffer(pin);
 
     if(!buf) {
-        fg_log(FG_LOG_MODULE, "%s> scatter done %d\n", stage->name, rank);
+        fg_log(FG_LOG_STAGE, "%s> scatter done %d\n", stage->name, rank);
         for(i=0; i<s->num_procs; i++) {
             rc = MPI_Send(data, 0, MPI_CHAR, i, DSORT_SCATTER_DONE,
                     MPI_COMM_WORLD);
@@ -318,8 +333,8 @@ int scatter_func(FG_stage *stage)
         n = 0;
         while(1) {
             if(data + n >= ((uint8_t *) buf->data) + buf->datalen) {
-                fg_log(FG_LOG_MODULE, "%s> reached end of buffer (%d bytes)\n",
-                        stage->name, n);
+                fg_log(FG_LOG_DATA, "%s> reached end of buffer (%llu bytes)\n",
+                        stage->name, (unsigned long long) n);
                 break;
             }
 
@@ -338,19 +353,22 @@ int scatter_func(FG_stage *stage)
             s->recnum++;
         }
 
-        if(n > 0) {
-            rc = MPI_Send(data, n, MPI_CHAR, i, DSORT_DATA, MPI_COMM_WORLD);
+        for(sent = 0; sent < n; sent += chunk) {
+            chunk = n - sent < DSORT_MAX_MSG ? n - sent : DSORT_MAX_MSG;
+            rc = MPI_Send(data + sent, (int) chunk, MPI_CHAR, i, DSORT_DATA,
+                    MPI_COMM_WORLD);
             if(rc != MPI_SUCCESS)
                 return FG_STAGE_TERMINATE;
         }
-        fg_log(FG_LOG_MODULE, "%s> sent %d bytes to %d\n", stage->name, n, i);
+        fg_log(FG_LOG_DATA, "%s> sent %llu bytes to %d\n", stage->name,
+                (unsigned long long) n, i);
 
         data += n;
         bytes_per_round += n;
     }
 
-    fg_log(FG_LOG_MODULE, "%s> sent %d bytes total this round\n", stage->name,
-            bytes_per_round);
+    fg_log(FG_LOG_DATA, "%s> sent %llu bytes total this round\n",
+            stage->name, (unsigned long long) bytes_per_round);
 
     pin = fg_stage_pin_get_by_name(stage, "buf_out");
     fg_pin_convey_buffer(pin, buf);
@@ -371,7 +389,8 @@ int gather_func(FG_stage *stage)
     MPI_Status status;
     int rc;
     int num_procs, num_done;
-    int k, l;
+    uint64_t k, l;
+    int max_msg;
 
     MPI_Comm_size(MPI_COMM_WORLD, &num_procs);
     num_done = 0;
@@ -380,27 +399,30 @@ int gather_func(FG_stage *stage)
     out_pin = fg_stage_pin_get_by_name(stage, "data_out");
 
     buf = fg_pin_accept_buffer(in_pin);
+    if(!buf)
+        return FG_STAGE_TERMINATE;
     buf->datalen = 0;
 
-    mpi_buf = (char *) malloc(buf->size);
+    max_msg = buf->size < DSORT_MAX_MSG ? buf->size : DSORT_MAX_MSG;
+    mpi_buf = (char *) malloc(max_msg);
 
     /* I'm not convinced this is the best loop structure here */
     while(num_done < num_procs) {
         /* get an MPI message */
-        rc = MPI_Recv(mpi_buf, buf->size, MPI_CHAR, MPI_ANY_SOURCE,
+        rc = MPI_Recv(mpi_buf, max_msg, MPI_CHAR, MPI_ANY_SOURCE,
                 MPI_ANY_TAG, MPI_COMM_WORLD, &status);
         if(rc != MPI_SUCCESS)
             return FG_STAGE_TERMINATE;
 
         /* if it's not a data msg, handle it accordingly */
         if(status.MPI_TAG == DSORT_SCATTER_DONE) {
-            fg_log(FG_LOG_MODULE, "%s> received dsort scatter done from %d\n",
+            fg_log(FG_LOG_STAGE, "%s> received dsort scatter done from %d\n",
                     stage->name, status.MPI_SOURCE);
             num_done++;
             continue;
         }
 
-        fg_log(FG_LOG_MODULE, "%s> received %d data bytes from %d\n",
+        fg_log(FG_LOG_DATA, "%s> received %d data bytes from %d\n",
                 stage->name, status.count, status.MPI_SOURCE);
 
         /* either the received data will all fit in the current buffer */
@@ -422,6 +444,10 @@ int gather_func(FG_stage *stage)
             fg_pin_convey_buffer(out_pin, buf);
 
             buf = fg_pin_accept_buffer(in_pin);
+            if(!buf) {
+                free(mpi_buf);
+                return FG_STAGE_TERMINATE;
+            }
             memcpy(buf->data, mpi_buf + k, l);
             /* printf("%s> stuffed remaining %d of %d bytes into new buffer\n",
                     stage->name, l, status.count); */
@@ -432,6 +458,10 @@ int gather_func(FG_stage *stage)
         if(buf->datalen >= buf->size) {
             fg_pin_convey_buffer(out_pin, buf);
             buf = fg_pin_accept_buffer(in_pin);
+            if(!buf) {
+                free(mpi_buf);
+                return FG_STAGE_TERMINATE;
+            }
             buf->datalen = 0;
         }
 
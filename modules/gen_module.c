@@ -0,0 +1,291 @@
+/*
+ * gen_module.c
+ *
+ * Synthetic data.  The generate stage fills buffers with records in place,
+ * so benchmarks can drive sort, merge and the runtime at full speed without
+ * a disk in the way.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "fg_internal.h"
+#include "fg_rand.h"
+
+/* keys are the first 8 bytes of each record, as the dsort stages expect */
+#define KEYLEN 8
+
+/* keys are made this many at a time into a contiguous array, which the
+ * compiler can vectorize, then copied into the records */
+#define GEN_BLOCK 256
+
+/* generate stage definition prototypes */
+char generate_name[] = "generate";
+char generate_doc[] = "fills buffers with records of synthetic keys";
+int generate_init(FG_stage *stage);
+int generate_func(FG_stage *stage);
+void generate_fini(FG_stage *stage);
+FG_pin generate_pins[] = { { "buf_in",   PIN_IN  },
+                           { "data_out", PIN_OUT },
+                           { NULL }
+                         };
+const char *generate_params[] = { "distribution",
+                                  "records",
+                                  "reclen",
+                                  "seed",
+                                  "payload",
+                                  "mean",
+                                  "stddev",
+                                  "lambda",
+                                  "skew",
+                                  "keys",
+                                  NULL
+                                };
+
+/* module defs */
+char *fg_module_name = "synthetic data";
+FG_stage_def fg_module_export[] = {
+    { generate_name, generate_doc, generate_init, generate_func, generate_fini, generate_pins, generate_params },
+    { NULL }
+};
+
+/* generate stage definition
+ *************************************************************/
+
+enum distribution {
+    DIST_UNIFORM,
+    DIST_NORMAL,
+    DIST_POISSON,
+    DIST_ZIPF,
+    DIST_SORTED,
+    DIST_REVERSE,
+    DIST_DUPLICATES
+};
+
+static const char *distribution_names[] = { "uniform", "normal", "poisson",
+                                            "zipf", "sorted", "reverse",
+                                            "duplicates", NULL };
+
+enum payload {
+    PAYLOAD_INDEX,          /* the record's index, then zeros */
+    PAYLOAD_RANDOM,
+    PAYLOAD_NONE            /* left as it was */
+};
+
+static const char *payload_names[] = { "index", "random", "none", NULL };
+
+struct generate_state {
+    enum distribution dist;
+    enum payload payload;
+    uint64_t records;       /* 0 for no end */
+    uint32_t reclen;
+    uint64_t seed;
+    double mean;
+    double stddev;
+    double lambda;
+    double skew;
+    uint64_t keys;          /* distinct keys, for zipf and duplicates */
+
+    uint64_t next;          /* index of the next record */
+};
+
+/* an optional numeric parameter */
+static double param_double(FG_stage *stage, const char *name, double dflt)
+{
+    char *v = fg_stage_get_param(stage, name);
+
+    return v ? strtod(v, NULL) : dflt;
+}
+
+static uint64_t param_u64(FG_stage *stage, const char *name, uint64_t dflt)
+{
+    char *v = fg_stage_get_param(stage, name);
+
+    return v ? strtoull(v, NULL, 0) : dflt;
+}
+
+/* index of name in a NULL-terminated list; -1 if absent */
+static int lookup(const char **names, const char *name)
+{
+    int i;
+
+    for(i = 0; names[i]; i++)
+        if(strcmp(names[i], name) == 0)
+            return i;
+
+    return -1;
+}
+
+int generate_init(FG_stage *stage)
+{
+    struct generate_state *s;
+    char *v;
+    int i;
+
+    s = (struct generate_state *) calloc(1, sizeof(struct generate_state));
+
+    v = fg_stage_get_param(stage, "distribution");
+    i = v ? lookup(distribution_names, v) : DIST_UNIFORM;
+    if(i < 0) {
+        fprintf(stderr, "%s> unknown distribution %s\n", stage->name, v);
+        free(s);
+        return -1;
+    }
+    s->dist = (enum distribution) i;
+
+    v = fg_stage_get_param(stage, "payload");
+    i = v ? lookup(payload_names, v) : PAYLOAD_INDEX;
+    if(i < 0) {
+        fprintf(stderr, "%s> unknown payload %s\n", stage->name, v);
+        free(s);
+        return -1;
+    }
+    s->payload = (enum payload) i;
+
+    s->records = param_u64(stage, "records", 0);
+    s->reclen = param_u64(stage, "reclen", 64);
+    s->seed = param_u64(stage, "seed", 1);
+    s->mean = param_double(stage, "mean", 0);
+    s->stddev = param_double(stage, "stddev", 1e15);
+    s->lambda = param_double(stage, "lambda", 4);
+    s->skew = param_double(stage, "skew", 1);
+    s->keys = param_u64(stage, "keys", s->dist == DIST_ZIPF ? 1 << 20 : 1024);
+
+    if(s->reclen < KEYLEN || s->keys == 0 || s->lambda < 0
+            || s->skew <= 0) {
+        fprintf(stderr, "%s> invalid parameters\n", stage->name);
+        free(s);
+        return -1;
+    }
+
+    stage->data = s;
+
+    return 0;
+}
+
+void generate_fini(FG_stage *stage)
+{
+    free(stage->data);
+}
+
+/* Keys for records first to first + n - 1.  Each depends only on the seed
+ * and its record's index. */
+static void generate_keys(struct generate_state *s, uint64_t first, int n,
+        int64_t *keys)
+{
+    int j;
+
+    switch(s->dist) {
+        case DIST_UNIFORM:
+            for(j = 0; j < n; j++)
+                keys[j] = (int64_t) fg_rand_u64(s->seed, first + j);
+            break;
+        case DIST_NORMAL:
+            for(j = 0; j < n; j++)
+                keys[j] = (int64_t) (s->mean + s->stddev
+                        * fg_rand_normal(s->seed, first + j));
+            break;
+        case DIST_POISSON:
+            for(j = 0; j < n; j++)
+                keys[j] = fg_rand_poisson(s->seed, first + j, s->lambda);
+            break;
+        case DIST_ZIPF:
+            /* rank 1 is the commonest key; hashing the rank spreads the keys
+             * out so the common ones aren't all small */
+            for(j = 0; j < n; j++)
+                keys[j] = (int64_t) fg_rand_mix(s->seed ^ fg_rand_zipf(
+                            s->seed, first + j, s->keys, s->skew));
+            break;
+        case DIST_SORTED:
+            for(j = 0; j < n; j++)
+                keys[j] = (int64_t) (first + j);
+            break;
+        case DIST_REVERSE:
+            for(j = 0; j < n; j++)
+                keys[j] = -(int64_t) (first + j);
+            break;
+        case DIST_DUPLICATES:
+            for(j = 0; j < n; j++)
+                keys[j] = (int64_t) fg_rand_mix(s->seed
+                        ^ (fg_rand_u64(s->seed, first + j) % s->keys));
+            break;
+    }
+}
+
+int generate_func(FG_stage *stage)
+{
+    struct generate_state *s = (struct generate_state *) stage->data;
+    int64_t keys[GEN_BLOCK];
+    uint64_t n, i, k, w, words, len, stream, r;
+    char *rec;
+    FG_pin *pin;
+    FG_buf *buf;
+    int j, block;
+
+    if(s->records && s->next >= s->records)
+        return FG_STAGE_TERMINATE;
+
+    pin = fg_stage_pin_get_by_name(stage, "buf_in");
+    buf = fg_pin_accept_buffer(pin);
+    if(!buf)
+        return FG_STAGE_TERMINATE;
+
+    n = buf->size / s->reclen;
+    if(n == 0) {
+        fprintf(stderr, "%s> records of %u bytes do not fit in buffers of "
+                "%llu\n", stage->name, s->reclen,
+                (unsigned long long) buf->size);
+        return FG_STAGE_TERMINATE;
+    }
+    if(s->records && n > s->records - s->next)
+        n = s->records - s->next;
+
+    for(i = 0; i < n; i += block) {
+        block = n - i < GEN_BLOCK ? n - i : GEN_BLOCK;
+        generate_keys(s, s->next + i, block, keys);
+
+        for(j = 0; j < block; j++) {
+            k = s->next + i + j;
+            rec = buf->data + (i + j) * s->reclen;
+            memcpy(rec, &keys[j], KEYLEN);
+
+            switch(s->payload) {
+                case PAYLOAD_INDEX:
+                    memset(rec + KEYLEN, 0, s->reclen - KEYLEN);
+                    if(s->reclen >= KEYLEN + sizeof(k))
+                        memcpy(rec + KEYLEN, &k, sizeof(k));
+                    break;
+                case PAYLOAD_RANDOM:
+                    /* words from a stream per record, apart from the keys',
+                     * the last cut short if the payload is; as in
+                     * experiments/gen_dist_data.c */
+                    len = s->reclen - KEYLEN;
+                    words = (len + sizeof(r) - 1) / sizeof(r);
+                    stream = fg_rand_substream(~s->seed, k);
+                    for(w = 0; w < words; w++) {
+                        r = fg_rand_u64(stream, w);
+                        memcpy(rec + KEYLEN + w * sizeof(r), &r,
+                                len - w * sizeof(r) < sizeof(r)
+                                ? len - w * sizeof(r) : sizeof(r));
+                    }
+                    break;
+                case PAYLOAD_NONE:
+                    break;
+            }
+        }
+    }
+
+    buf->datalen = n * s->reclen;
+    s->next += n;
+
+    fg_log(FG_LOG_DATA, "%s> generated %llu records (%llu total)\n",
+            stage->name, (unsigned long long) n,
+            (unsigned long long) s->next);
+
+    pin = fg_stage_pin_get_by_name(stage, "data_out");
+    fg_pin_convey_buffer(pin, buf);
+
+    return FG_STAGE_SUCCESS;
+}
@@ -2,11 +2,24 @@
  * io_module.c
  */
 
+#define _GNU_SOURCE /* for O_DIRECT */
 #include <stdio.h>
 #include <string.h>
 #include <malloc.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <glob.h>
 
 #include "fg_internal.h"
+#include "fg_runfile.h"
+#include "aio.h"
 
 /* read stage definition prototypes */
 char read_name[] = "read-file";
@@ -19,6 +32,12 @@ FG_pin read_pins[] = { { "buf_in",   PIN_IN  },
                        { NULL }
                      };
 const char *read_params[] = { "filename",
+                              "o_direct",
+                              "fadvise",
+                              "readahead",
+                              "offset",
+                              "length",
+                              "reclen",
                               NULL
                             };
 
@@ -32,6 +51,9 @@ FG_pin write_pins[] = { { "data_in", PIN_IN  },
                         { NULL }
                       };
 const char *write_params[] = { "filename",
+                               "o_direct",
+                               "fadvise",
+                               "write_behind",
                                NULL
                              };
 
@@ -45,6 +67,7 @@ FG_pin multiwrite_pins[] = { { "data_in", PIN_IN  },
                              { NULL }
                            };
 const char *multiwrite_params[] = { "filename_fmt",
+                                    "o_direct",
                                     NULL
                                   };
 
@@ -57,6 +80,159 @@ FG_pin combine_pins[] = { { "data_in",  PIN_ARRAY_IN },
                           { NULL }
                         };
 
+/* replay stage definition prototypes */
+char replay_name[] = "replay";
+char replay_doc[] = "conveys the buffers of a pin capture again";
+int replay_init(FG_stage *stage);
+int replay_func(FG_stage *stage);
+void replay_fini(FG_stage *stage);
+FG_pin replay_pins[] = { { "buf_in",   PIN_IN  },
+                         { "data_out", PIN_OUT },
+                         { NULL }
+                       };
+const char *replay_params[] = { "filename",
+                                "timing",
+                                "repeat",
+                                NULL
+                              };
+
+/* asynchronous read stage definition prototypes */
+char aread_name[] = "aread-file";
+char aread_doc[] = "reads a file with several buffers in flight";
+int aread_init(FG_stage *stage);
+int aread_func(FG_stage *stage);
+void async_io_fini(FG_stage *stage);
+FG_pin aread_pins[] = { { "buf_in",   PIN_IN  },
+                        { "data_out", PIN_OUT },
+                        { NULL }
+                      };
+const char *aread_params[] = { "filename",
+                               "depth",
+                               "engine",
+                               "fadvise",
+                               "readahead",
+                               NULL
+                             };
+
+/* asynchronous write stage definition prototypes */
+char awrite_name[] = "awrite-file";
+char awrite_doc[] = "writes a file with several buffers in flight";
+int awrite_init(FG_stage *stage);
+int awrite_func(FG_stage *stage);
+FG_pin awrite_pins[] = { { "data_in", PIN_IN  },
+                         { "buf_out", PIN_OUT },
+                         { NULL }
+                       };
+const char *awrite_params[] = { "filename",
+                                "depth",
+                                "engine",
+                                "fadvise",
+                                "write_behind",
+                                NULL
+                              };
+
+/* memory-mapped read stage definition prototypes */
+char mmap_read_name[] = "mmap-read-file";
+char mmap_read_doc[] = "conveys windows of a file mapped into memory";
+int mmap_read_init(FG_stage *stage);
+int mmap_read_func(FG_stage *stage);
+void mmap_read_fini(FG_stage *stage);
+FG_pin mmap_read_pins[] = { { "buf_in",   PIN_IN  },
+                            { "data_out", PIN_OUT },
+                            { NULL }
+                          };
+const char *mmap_read_params[] = { "filename",
+                                   "reclen",
+                                   "private",
+                                   NULL
+                                 };
+
+/* range read stage definition prototypes */
+char range_read_name[] = "range-read-file";
+char range_read_doc[] = "reads ranges of a file with several concurrent streams";
+int range_read_init(FG_stage *stage);
+int range_read_func(FG_stage *stage);
+void range_read_fini(FG_stage *stage);
+FG_pin range_read_pins[] = { { "buf_in",   PIN_IN  },
+                             { "data_out", PIN_OUT },
+                             { NULL }
+                           };
+const char *range_read_params[] = { "filename",
+                                    "streams",
+                                    "range",
+                                    "reclen",
+                                    NULL
+                                  };
+
+/* run writer stage definition prototypes */
+char run_writer_name[] = "run-writer";
+char run_writer_doc[] = "appends each buffer accepted to a run file as a run";
+int run_writer_init(FG_stage *stage);
+int run_writer_func(FG_stage *stage);
+void run_writer_fini(FG_stage *stage);
+FG_pin run_writer_pins[] = { { "data_in", PIN_IN  },
+                             { "buf_out", PIN_OUT },
+                             { NULL }
+                           };
+const char *run_writer_params[] = { "filename",
+                                    "preallocate",
+                                    NULL
+                                  };
+
+/* run reader stage definition prototypes */
+char run_reader_name[] = "run-reader";
+char run_reader_doc[] = "reads each run of a run file to a connection of its own";
+int run_reader_init(FG_stage *stage);
+int run_reader_func(FG_stage *stage);
+void run_reader_fini(FG_stage *stage);
+FG_pin run_reader_pins[] = { { "buf_in",   PIN_IN        },
+                             { "data_out", PIN_ARRAY_OUT },
+                             { NULL }
+                           };
+const char *run_reader_params[] = { "filename",
+                                    "reclen",
+                                    NULL
+                                  };
+
+/* write-behind stage definition prototypes */
+char write_behind_name[] = "write-behind-file";
+char write_behind_doc[] = "writes a file from a flusher thread, returning buffers early";
+int write_behind_init(FG_stage *stage);
+int write_behind_func(FG_stage *stage);
+void write_behind_fini(FG_stage *stage);
+FG_pin write_behind_pins[] = { { "data_in", PIN_IN  },
+                               { "buf_out", PIN_OUT },
+                               { NULL }
+                             };
+const char *write_behind_params[] = { "filename",
+                                      "depth",
+                                      "copy",
+                                      "sync",
+                                      "fadvise",
+                                      "write_behind",
+                                      NULL
+                                    };
+
+/* multi-file read stage definition prototypes */
+char read_files_name[] = "read-files";
+char read_files_doc[] = "reads the files of a glob, list or directory";
+int read_files_init(FG_stage *stage);
+int read_files_func(FG_stage *stage);
+void read_files_fini(FG_stage *stage);
+FG_pin read_files_pins[] = { { "buf_in",   PIN_IN  },
+                             { "data_out", PIN_OUT },
+                             { NULL }
+                           };
+const char *read_files_params[] = { "glob",
+                                    "list",
+                                    "dir",
+                                    "mode",
+                                    "streams",
+                                    "open_ahead",
+                                    "reclen",
+                                    NULL
+                                  };
+
 /* module defs */
 char *fg_module_name = "i/o operations";
 FG_stage_def fg_module_export[] = {
@@ -64,30 +240,368 @@ FG_stage_def fg_module_export[] = {
     { write_name, write_doc, write_init, write_func, file_io_fini, write_pins, write_params },
     { multiwrite_name, multiwrite_doc, multiwrite_init, multiwrite_func, NULL, multiwrite_pins, multiwrite_params },
     { combine_name, combine_doc, NULL, combine_func, NULL, combine_pins, NULL },
+    { replay_name, replay_doc, replay_init, replay_func, replay_fini, replay_pins, replay_params },
+    { aread_name, aread_doc, aread_init, aread_func, async_io_fini, aread_pins, aread_params },
+    { awrite_name, awrite_doc, awrite_init, awrite_func, async_io_fini, awrite_pins, awrite_params },
+    { mmap_read_name, mmap_read_doc, mmap_read_init, mmap_read_func, mmap_read_fini, mmap_read_pins, mmap_read_params },
+    { range_read_name, range_read_doc, range_read_init, range_read_func, range_read_fini, range_read_pins, range_read_params },
+    { run_writer_name, run_writer_doc, run_writer_init, run_writer_func, run_writer_fini, run_writer_pins, run_writer_params },
+    { run_reader_name, run_reader_doc, run_reader_init, run_reader_func, run_reader_fini, run_reader_pins, run_reader_params },
+    { write_behind_name, write_behind_doc, write_behind_init, write_behind_func, write_behind_fini, write_behind_pins, write_behind_params },
+    { read_files_name, read_files_doc, read_files_init, read_files_func, read_files_fini, read_files_pins, read_files_params },
     { NULL }
 };
 
+/* Access pattern hints, from the params of the stages that stream files:
+ *
+ *   fadvise       comma-separated posix_fadvise() advice for the whole
+ *                 file: normal, sequential, random, noreuse
+ *   readahead     buffers to have the kernel fetch ahead of the one just
+ *                 read, so the disk works while downstream stages do
+ *   write_behind  bytes: each time this many more have been written,
+ *                 writeback of them is started, and the previous lot is
+ *                 waited for and dropped from the page cache, so dirty pages
+ *                 never pile up behind a stream */
+struct file_hints {
+    int fd;
+    int advice[4];
+    int nadvice;
+    int readahead;
+    off_t ra_end;           /* fetched up to here */
+    off_t write_behind;
+    off_t wb_start;         /* writeback not yet started from here */
+};
+
 struct file_io_state {
     char *filename;
     FILE *file;
-    int bytes_so_far;
+    uint64_t bytes_so_far;
+    struct file_hints hints;
+
+    /* o_direct: fd bypasses the page cache, and the writers use it in
+     * place of stdio */
+    int direct;
+    int fd;
+    char *bounce;           /* see direct_write() */
+    size_t carry;
+
+    /* read-file reads [pos, end) of fd with pread, a whole number of
+     * records of reclen bytes at a time */
+    off_t pos;
+    off_t end;
+    unsigned int reclen;
 };
 
+/* writes are copied through a bounce buffer this size once the stream is
+ * no longer aligned */
+#define DIRECT_BOUNCE (1024 * 1024)
+
+static int param_flag(FG_stage *stage, const char *name)
+{
+    char *v = fg_stage_get_param(stage, name);
+
+    return v && atoi(v) != 0;
+}
+
+/* Opens s->filename for direct I/O.  Filesystems that can't do it (tmpfs,
+ * for one) get the page cache after all, with a warning; s->direct is
+ * cleared and the caller falls back to stdio. */
+static int direct_open(FG_stage *stage, struct file_io_state *s, int flags)
+{
+    s->fd = open(s->filename, flags | O_DIRECT, 0666);
+    if(s->fd < 0 && errno == EINVAL) {
+        fprintf(stderr, "%s> %s does not support o_direct, using the page "
+                "cache\n", stage->name, s->filename);
+        s->direct = 0;
+        return 0;
+    }
+
+    return s->fd < 0 ? -1 : 0;
+}
+
+static int pwrite_full(int fd, const char *data, size_t len, off_t offset)
+{
+    ssize_t n;
+
+    while(len > 0) {
+        n = pwrite(fd, data, len, offset);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n <= 0)
+            return -1;
+        data += n;
+        len -= n;
+        offset += n;
+    }
+
+    return 0;
+}
+
+/* all of len from offset, unless the end of the file comes first */
+static ssize_t pread_full(int fd, char *data, size_t len, off_t offset)
+{
+    size_t done = 0;
+    ssize_t n;
+
+    while(done < len) {
+        n = pread(fd, data + done, len - done, offset + done);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n < 0)
+            return -1;
+        if(n == 0)
+            break;
+        done += n;
+    }
+
+    return done;
+}
+
+static int write_full(int fd, const char *data, size_t len)
+{
+    ssize_t n;
+
+    while(len > 0) {
+        n = write(fd, data, len);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n <= 0)
+            return -1;
+        data += n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+/* Writes an unaligned tail, which O_DIRECT can't; whatever follows on fd
+ * goes through the page cache too. */
+static int write_unaligned_tail(int fd, const char *data, size_t len)
+{
+    if(fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_DIRECT) < 0)
+        return -1;
+
+    return write_full(fd, data, len);
+}
+
+/* O_DIRECT writes must be whole blocks, from aligned memory, at aligned
+ * offsets.  Buffers are aligned (see FG_BUF_ALIGN), so while the file is
+ * too, whole blocks are written straight from them.  A partial block left
+ * over is held in s->bounce, and data after it is copied in behind it and
+ * written a bounce buffer at a time. */
+static int direct_write(struct file_io_state *s, const char *data, size_t len)
+{
+    size_t n;
+
+    if(s->carry == 0) {
+        n = len / FG_BUF_ALIGN * FG_BUF_ALIGN;
+        if(n > 0 && write_full(s->fd, data, n) < 0)
+            return -1;
+        data += n;
+        len -= n;
+    }
+
+    while(len > 0) {
+        n = DIRECT_BOUNCE - s->carry < len ? DIRECT_BOUNCE - s->carry : len;
+        memcpy(s->bounce + s->carry, data, n);
+        s->carry += n;
+        data += n;
+        len -= n;
+
+        if(s->carry == DIRECT_BOUNCE) {
+            if(write_full(s->fd, s->bounce, s->carry) < 0)
+                return -1;
+            s->carry = 0;
+        }
+    }
+
+    return 0;
+}
+
+/* the rest of the bounce buffer, at the end of the stream */
+static int direct_write_finish(struct file_io_state *s)
+{
+    size_t n = s->carry / FG_BUF_ALIGN * FG_BUF_ALIGN;
+
+    if(n > 0 && write_full(s->fd, s->bounce, n) < 0)
+        return -1;
+    if(s->carry > n && write_unaligned_tail(s->fd, s->bounce + n,
+                s->carry - n) < 0)
+        return -1;
+    s->carry = 0;
+
+    return 0;
+}
+
+static int hints_parse(FG_stage *stage, struct file_hints *h)
+{
+    static const char *names[] = { "normal", "sequential", "random",
+                                   "noreuse", NULL };
+    static const int advice[] = { POSIX_FADV_NORMAL, POSIX_FADV_SEQUENTIAL,
+                                  POSIX_FADV_RANDOM, POSIX_FADV_NOREUSE };
+    char *v, *list, *tok, *save;
+    int i;
+
+    memset(h, 0, sizeof(*h));
+    h->fd = -1;
+
+    v = fg_stage_get_param(stage, "readahead");
+    h->readahead = v ? atoi(v) : 0;
+    v = fg_stage_get_param(stage, "write_behind");
+    h->write_behind = v ? strtoll(v, NULL, 0) : 0;
+
+    v = fg_stage_get_param(stage, "fadvise");
+    if(!v)
+        return 0;
+
+    list = strdup(v);
+    for(tok = strtok_r(list, ",", &save); tok;
+            tok = strtok_r(NULL, ",", &save)) {
+        for(i = 0; names[i] && strcmp(names[i], tok) != 0; i++)
+            ;
+        if(!names[i] || h->nadvice == 4) {
+            fprintf(stderr, "%s> fadvise takes normal, sequential, random "
+                    "or noreuse, not %s\n", stage->name, tok);
+            free(list);
+            return -1;
+        }
+        h->advice[h->nadvice++] = advice[i];
+    }
+    free(list);
+
+    return 0;
+}
+
+/* gives the advice for the file just opened */
+static void hints_apply(struct file_hints *h, int fd)
+{
+    int i;
+
+    h->fd = fd;
+    for(i = 0; i < h->nadvice; i++)
+        posix_fadvise(fd, 0, 0, h->advice[i]);
+}
+
+/* after reading up to offset with buffers of bufsize bytes */
+static void hints_read(struct file_hints *h, off_t offset, size_t bufsize)
+{
+    off_t end = offset + (off_t) h->readahead * bufsize;
+
+    if(h->readahead <= 0 || end <= h->ra_end)
+        return;
+
+    if(h->ra_end < offset)
+        h->ra_end = offset;
+    posix_fadvise(h->fd, h->ra_end, end - h->ra_end, POSIX_FADV_WILLNEED);
+    h->ra_end = end;
+}
+
+/* after the file has been written up to offset */
+static void hints_written(struct file_hints *h, off_t offset)
+{
+    off_t n = h->write_behind;
+
+    if(n <= 0)
+        return;
+
+    while(offset - h->wb_start >= n) {
+        sync_file_range(h->fd, h->wb_start, n, SYNC_FILE_RANGE_WRITE);
+        if(h->wb_start >= n) {
+            sync_file_range(h->fd, h->wb_start - n, n,
+                    SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE
+                    | SYNC_FILE_RANGE_WAIT_AFTER);
+            posix_fadvise(h->fd, h->wb_start - n, n, POSIX_FADV_DONTNEED);
+        }
+        h->wb_start += n;
+    }
+}
+
+/* at the end of the stream, starts writeback of the rest */
+static void hints_write_finish(struct file_hints *h, off_t offset)
+{
+    if(h->write_behind > 0 && offset > h->wb_start)
+        sync_file_range(h->fd, h->wb_start, offset - h->wb_start,
+                SYNC_FILE_RANGE_WRITE);
+}
+
 /* read stage definition
  *************************************************************/
+
+/* Reads the bytes from param offset (default 0) for param length (default
+ * the rest of the file), with pread, so the file's size bounds the stream
+ * and the stage terminates on conveying the buffer that reaches the end of
+ * the range.  Every buffer but the last holds as many whole records of
+ * param reclen bytes (default 1) as fit; the last holds what is left.  With
+ * param o_direct set, reads bypass the page cache; the offset must then be
+ * a multiple of FG_BUF_ALIGN, and each buffer must hold at least one block
+ * of whole records. */
 int read_init(FG_stage *stage)
 {
     struct file_io_state *s;
+    struct stat st;
+    char *offset, *length, *reclen;
+    off_t len;
 
-    s = (struct file_io_state *) malloc(sizeof(struct file_io_state));
+    s = (struct file_io_state *) calloc(1, sizeof(struct file_io_state));
 
     s->filename = fg_stage_get_param(stage, "filename");
-    s->file = fopen(s->filename, "r");
-    s->bytes_so_far = 0;
+    s->direct = param_flag(stage, "o_direct");
+    s->fd = -1;
+
+    offset = fg_stage_get_param(stage, "offset");
+    length = fg_stage_get_param(stage, "length");
+    reclen = fg_stage_get_param(stage, "reclen");
+    s->pos = offset ? (off_t) strtoull(offset, NULL, 0) : 0;
+    len = length ? (off_t) strtoull(length, NULL, 0) : -1;
+    s->reclen = reclen ? atoi(reclen) : 1;
+
+    if(s->pos < 0 || (length && len < 0) || s->reclen < 1) {
+        fprintf(stderr, "%s> invalid offset, length or reclen\n",
+                stage->name);
+        free(s);
+        return -1;
+    }
+
+    if(hints_parse(stage, &s->hints) < 0) {
+        free(s);
+        return -1;
+    }
+
+    if(s->direct && s->pos % FG_BUF_ALIGN != 0) {
+        fprintf(stderr, "%s> o_direct needs an offset that is a multiple of "
+                "%d bytes\n", stage->name, FG_BUF_ALIGN);
+        free(s);
+        return -1;
+    }
+
+    if(s->direct && direct_open(stage, s, O_RDONLY) < 0)
+        s->fd = -1;
+    else if(!s->direct)
+        s->fd = open(s->filename, O_RDONLY);
+
+    if(s->fd < 0 || fstat(s->fd, &st) < 0) {
+        fprintf(stderr, "%s> cannot open %s: %s\n", stage->name, s->filename,
+                strerror(errno));
+        if(s->fd >= 0)
+            close(s->fd);
+        free(s);
+        return -1;
+    }
+
+    /* a range that runs past the end of the file stops there */
+    s->end = st.st_size;
+    if(s->pos > s->end)
+        s->pos = s->end;
+    if(len >= 0 && len < s->end - s->pos)
+        s->end = s->pos + len;
+
+    hints_apply(&s->hints, s->fd);
 
     stage->data = s;
 
-    printf("%s> opened %s for reading\n", stage->name, s->filename);
+    fg_log(FG_LOG_STAGE, "%s> opened %s for reading bytes %lld to %lld%s\n",
+            stage->name, s->filename, (long long) s->pos, (long long) s->end,
+            s->direct ? " (o_direct)" : "");
 
     return 0;
 }
@@ -96,38 +610,97 @@ void file_io_fini(FG_stage *stage)
 {
     struct file_io_state *s = (struct file_io_state *) stage->data;
 
-    fclose(s->file);
+    if(s->file)
+        fclose(s->file);
+    if(s->fd >= 0)
+        close(s->fd);
+    free(s->bounce);
     free(s->filename);
     free(s);
 
-    printf("%s> closed file\n", stage->name);
+    fg_log(FG_LOG_STAGE, "%s> closed file\n", stage->name);
+}
+
+/* The buffer goes on empty, so it finds its way back to buf_in rather than
+ * being lost with the stage. */
+static int read_fail(FG_stage *stage, FG_buf *buf)
+{
+    buf->datalen = 0;
+    buf->offset = 0;
+    fg_pin_convey_buffer(fg_stage_pin_get_by_name(stage, "data_out"), buf);
+
+    return FG_STAGE_ERROR;
 }
 
 int read_func(FG_stage *stage)
 {
     struct file_io_state *s = (struct file_io_state *) stage->data;
+    uint64_t unit, want, len;
     FG_pin *pin;
     FG_buf *buf;
-    int n;
-    int c;
+    ssize_t n;
+
+    /* an empty range sends nothing at all */
+    if(s->pos >= s->end) {
+        fg_log(FG_LOG_STAGE, "%s> EOF reached\n", stage->name);
+        return FG_STAGE_TERMINATE;
+    }
 
     pin = fg_stage_pin_get_by_name(stage, "buf_in");
     buf = fg_pin_accept_buffer(pin);
+    if(!buf)
+        return FG_STAGE_TERMINATE;
+
+    /* O_DIRECT reads must also keep the offset aligned */
+    unit = s->reclen;
+    if(s->direct)
+        while(unit % FG_BUF_ALIGN != 0)
+            unit += s->reclen;
+
+    want = buf->size / unit * unit;
+    if(want == 0 || (s->direct && buf->size % FG_BUF_ALIGN != 0)) {
+        fprintf(stderr, "%s> buffers of %llu bytes cannot hold reads of "
+                "%llu%s\n", stage->name, (unsigned long long) buf->size,
+                (unsigned long long) unit, s->direct ? " (o_direct needs "
+                "buffer sizes a multiple of 4096)" : "");
+        return read_fail(stage, buf);
+    }
+
+    /* the short last read still asks for whole blocks under O_DIRECT;
+     * the file ends within them */
+    if(want > (uint64_t) (s->end - s->pos))
+        want = s->end - s->pos;
+    len = want;
+    if(s->direct)
+        len = (want + FG_BUF_ALIGN - 1) / FG_BUF_ALIGN * FG_BUF_ALIGN;
+
+    n = pread_full(s->fd, buf->data, len, s->pos);
+    if(n < 0) {
+        fprintf(stderr, "%s> read of %s failed: %s\n", stage->name,
+                s->filename, strerror(errno));
+        return read_fail(stage, buf);
+    }
+    if((uint64_t) n > want)
+        n = want;
 
-    n = fread(buf->data, 1, buf->size, s->file);
     buf->datalen = n;
+    buf->offset = s->pos;
+    s->pos += n;
     s->bytes_so_far += n;
-    printf("%s> read %d bytes (%d total)\n", stage->name, n, s->bytes_so_far);
+    hints_read(&s->hints, s->pos, buf->size);
+    fg_log(FG_LOG_DATA, "%s> read %llu bytes (%llu total)\n", stage->name,
+            (unsigned long long) n, (unsigned long long) s->bytes_so_far);
+
+    /* a file cut short since it was opened ends the range early */
+    if((uint64_t) n < want)
+        s->end = s->pos;
 
     pin = fg_stage_pin_get_by_name(stage, "data_out");
     fg_pin_convey_buffer(pin, buf);
 
-    c = fgetc(s->file);
-    if(c == EOF) {
-        printf("%s> EOF reached\n", stage->name);
+    if(s->pos >= s->end) {
+        fg_log(FG_LOG_STAGE, "%s> EOF reached\n", stage->name);
         return FG_STAGE_TERMINATE;
-    } else {
-        ungetc(c, s->file);
     }
 
     return FG_STAGE_SUCCESS;
@@ -136,19 +709,49 @@ int read_func(FG_stage *stage)
 /* write stage definition
  ***************************************************************/
 
+/* With param o_direct set, writes bypass the page cache; see
+ * direct_write(). */
 int write_init(FG_stage *stage)
 {
     struct file_io_state *s;
 
-    s = (struct file_io_state *) malloc(sizeof(struct file_io_state));
+    s = (struct file_io_state *) calloc(1, sizeof(struct file_io_state));
 
     s->filename = fg_stage_get_param(stage, "filename");
-    s->file = fopen(s->filename, "w");
-    s->bytes_so_far = 0;
+    s->direct = param_flag(stage, "o_direct");
+    s->fd = -1;
+
+    if(hints_parse(stage, &s->hints) < 0) {
+        free(s);
+        return -1;
+    }
+
+    if(s->direct && direct_open(stage, s, O_WRONLY | O_CREAT | O_TRUNC) == 0
+            && s->direct) {
+        if(posix_memalign((void **) &s->bounce, FG_BUF_ALIGN,
+                    DIRECT_BOUNCE) != 0) {
+            fprintf(stderr, "%s> out of memory\n", stage->name);
+            close(s->fd);
+            free(s);
+            return -1;
+        }
+    } else if(!s->direct) {
+        s->file = fopen(s->filename, "w");
+    }
+
+    if(!s->file && s->fd < 0) {
+        fprintf(stderr, "%s> cannot open %s: %s\n", stage->name, s->filename,
+                strerror(errno));
+        free(s);
+        return -1;
+    }
+
+    hints_apply(&s->hints, s->file ? fileno(s->file) : s->fd);
 
     stage->data = s;
 
-    printf("%s> opened %s for writing\n", stage->name, s->filename);
+    fg_log(FG_LOG_STAGE, "%s> opened %s for writing%s\n", stage->name,
+            s->filename, s->direct ? " (o_direct)" : "");
 
     return 0;
 }
@@ -158,19 +761,38 @@ int write_func(FG_stage *stage)
     struct file_io_state *s = (struct file_io_state *) stage->data;
     FG_pin *pin;
     FG_buf *buf;
-    int n;
+    size_t n;
 
     pin = fg_stage_pin_get_by_name(stage, "data_in");
     buf = fg_pin_accept_buffer(pin);
 
     if(!buf) {
+        if(s->direct && direct_write_finish(s) < 0)
+            fprintf(stderr, "%s> write of %s failed: %s\n", stage->name,
+                    s->filename, strerror(errno));
+        if(s->file)
+            fflush(s->file);
+        hints_write_finish(&s->hints, s->bytes_so_far);
         return FG_STAGE_TERMINATE;
     }
 
-    n = fwrite(buf->data, 1, buf->datalen, s->file);
+    if(s->direct) {
+        if(direct_write(s, buf->data, buf->datalen) < 0) {
+            fprintf(stderr, "%s> write of %s failed: %s\n", stage->name,
+                    s->filename, strerror(errno));
+            return FG_STAGE_TERMINATE;
+        }
+        n = buf->datalen;
+    } else {
+        n = fwrite(buf->data, 1, buf->datalen, s->file);
+        /* write-behind can only see what stdio has handed over */
+        if(s->hints.write_behind > 0)
+            fflush(s->file);
+    }
     s->bytes_so_far += n;
-    printf("%s> wrote %d bytes (%d total)\n", stage->name, n,
-            s->bytes_so_far);
+    hints_written(&s->hints, s->bytes_so_far);
+    fg_log(FG_LOG_DATA, "%s> wrote %llu bytes (%llu total)\n", stage->name,
+            (unsigned long long) n, (unsigned long long) s->bytes_so_far);
 
     pin = fg_stage_pin_get_by_name(stage, "buf_out");
     fg_pin_convey_buffer(pin, buf);
@@ -184,6 +806,7 @@ int write_func(FG_stage *stage)
 struct multiwrite_state {
     char *filename_fmt;
     int i;
+    int direct;
 };
 
 int multiwrite_init(FG_stage *stage)
@@ -196,12 +819,44 @@ int multiwrite_init(FG_stage *stage)
 
     s->filename_fmt = fg_stage_get_param(stage, "filename_fmt");
     s->i = 0;
+    s->direct = param_flag(stage, "o_direct");
 
     stage->data = s;
 
     return 0;
 }
 
+/* Each buffer is a whole file, so with o_direct its blocks go straight from
+ * the buffer and only the tail through the page cache. */
+static int multiwrite_direct(FG_stage *stage, struct multiwrite_state *s,
+        const char *filename, FG_buf *buf)
+{
+    size_t n = buf->datalen / FG_BUF_ALIGN * FG_BUF_ALIGN;
+    int fd;
+
+    fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT, 0666);
+    if(fd < 0 && errno == EINVAL) {
+        fprintf(stderr, "%s> %s does not support o_direct, using the page "
+                "cache\n", stage->name, filename);
+        s->direct = 0;
+        return 1;
+    }
+
+    if(fd < 0 || (n > 0 && write_full(fd, buf->data, n) < 0)
+            || (buf->datalen > n && write_unaligned_tail(fd, buf->data + n,
+                    buf->datalen - n) < 0)) {
+        fprintf(stderr, "%s> cannot write %s: %s\n", stage->name, filename,
+                strerror(errno));
+        if(fd >= 0)
+            close(fd);
+        return -1;
+    }
+
+    close(fd);
+
+    return 0;
+}
+
 int multiwrite_func(FG_stage *stage)
 {
     FG_pin *pin;
@@ -209,6 +864,7 @@ int multiwrite_func(FG_stage *stage)
     struct multiwrite_state *s;
     FILE *f;
     char filename[BUFSIZ];
+    int rc = 1;
 
     s = (struct multiwrite_state *) stage->data;
 
@@ -221,11 +877,20 @@ int multiwrite_func(FG_stage *stage)
     snprintf(filename, BUFSIZ, s->filename_fmt, s->i);
     s->i++;
 
-    f = fopen(filename, "w");
-    fwrite(buf->data, buf->datalen, 1, f);
-    fclose(f);
+    if(s->direct)
+        rc = multiwrite_direct(stage, s, filename, buf);
+    if(rc < 0)
+        return FG_STAGE_TERMINATE;
 
-    printf("%s> wrote %d bytes to %s\n", stage->name, buf->datalen, filename);
+    /* not o_direct, or the filesystem can't do it */
+    if(rc > 0) {
+        f = fopen(filename, "w");
+        fwrite(buf->data, buf->datalen, 1, f);
+        fclose(f);
+    }
+
+    fg_log(FG_LOG_DATA, "%s> wrote %llu bytes to %s\n", stage->name,
+            (unsigned long long) buf->datalen, filename);
 
     pin = fg_stage_pin_get_by_name(stage, "buf_out");
     fg_pin_convey_buffer(pin, buf);
@@ -263,3 +928,2192 @@ int combine_func(FG_stage *stage) {
         return FG_STAGE_SUCCESS;
 }
 
+
+/* replay stage definition
+ ***************************************************************/
+
+/* Timing "original" conveys each buffer when it crossed the captured pin,
+ * relative to the start of the replay; "fast", the default, conveys them as
+ * quickly as they're taken.  repeat plays the capture that many times. */
+struct replay_state {
+    char *filename;
+    FILE *file;
+    int original_timing;
+    int repeat;
+    uint64_t start_ns;          /* of the replay */
+    int new_pass;               /* next buffer is the capture's first */
+    uint64_t first_ts_ns;       /* of the capture's first buffer */
+    uint64_t offset_ns;         /* capture time of earlier repeats */
+    uint64_t last_ts_ns;
+};
+
+int replay_init(FG_stage *stage)
+{
+    struct replay_state *s;
+    struct fg_capture_header h;
+    char *timing, *repeat;
+
+    s = (struct replay_state *) calloc(1, sizeof(struct replay_state));
+
+    s->filename = fg_stage_get_param(stage, "filename");
+    timing = fg_stage_get_param(stage, "timing");
+    repeat = fg_stage_get_param(stage, "repeat");
+
+    s->original_timing = timing && strcmp(timing, "original") == 0;
+    if(timing && !s->original_timing && strcmp(timing, "fast") != 0) {
+        fprintf(stderr, "%s> timing must be original or fast, not %s\n",
+                stage->name, timing);
+        free(s);
+        return -1;
+    }
+    s->repeat = repeat ? atoi(repeat) : 1;
+    s->new_pass = 1;
+
+    if(!s->filename || !(s->file = fopen(s->filename, "r"))) {
+        fprintf(stderr, "%s> cannot open %s: %s\n", stage->name,
+                s->filename ? s->filename : "(no filename)",
+                strerror(errno));
+        free(s);
+        return -1;
+    }
+
+    if(fread(&h, sizeof(h), 1, s->file) != 1
+            || memcmp(h.magic, FG_CAPTURE_MAGIC, sizeof(h.magic)) != 0) {
+        fprintf(stderr, "%s> %s is not a pin capture\n", stage->name,
+                s->filename);
+        fclose(s->file);
+        free(s);
+        return -1;
+    }
+
+    h.pin[sizeof(h.pin) - 1] = '\0';
+    fg_log(FG_LOG_STAGE, "%s> replaying capture of %s from %s\n",
+            stage->name, h.pin, s->filename);
+
+    stage->data = s;
+
+    return 0;
+}
+
+void replay_fini(FG_stage *stage)
+{
+    struct replay_state *s = (struct replay_state *) stage->data;
+
+    fclose(s->file);
+    free(s->filename);
+    free(s);
+}
+
+/* sleeps until the given time on the monotonic clock */
+static void sleep_until_ns(uint64_t ns)
+{
+    struct timespec ts;
+
+    ts.tv_sec = ns / 1000000000ULL;
+    ts.tv_nsec = ns % 1000000000ULL;
+    while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+        ;
+}
+
+int replay_func(FG_stage *stage)
+{
+    struct replay_state *s = (struct replay_state *) stage->data;
+    struct fg_capture_record r;
+    FG_pin *pin;
+    FG_buf *buf;
+
+    if(s->start_ns == 0)
+        s->start_ns = fg_now_ns();
+
+    while(fread(&r, sizeof(r), 1, s->file) != 1) {
+        if(--s->repeat <= 0) {
+            fg_log(FG_LOG_STAGE, "%s> end of capture\n", stage->name);
+            return FG_STAGE_TERMINATE;
+        }
+
+        /* play it again, starting where the last play left off */
+        s->offset_ns += s->last_ts_ns - s->first_ts_ns;
+        s->new_pass = 1;
+        fseek(s->file, sizeof(struct fg_capture_header), SEEK_SET);
+    }
+
+    if(s->new_pass)
+        s->first_ts_ns = r.ts_ns;
+    s->new_pass = 0;
+    s->last_ts_ns = r.ts_ns;
+
+    pin = fg_stage_pin_get_by_name(stage, "buf_in");
+    buf = fg_pin_accept_buffer(pin);
+    if(!buf)
+        return FG_STAGE_TERMINATE;
+
+    if(r.datalen > buf->size) {
+        fprintf(stderr, "%s> captured buffer of %llu bytes does not fit in "
+                "buffers of %llu\n", stage->name,
+                (unsigned long long) r.datalen,
+                (unsigned long long) buf->size);
+        return FG_STAGE_TERMINATE;
+    }
+
+    if(fread(buf->data, 1, r.datalen, s->file) != r.datalen) {
+        fprintf(stderr, "%s> %s is truncated\n", stage->name, s->filename);
+        return FG_STAGE_TERMINATE;
+    }
+
+    buf->datalen = r.datalen;
+    buf->round_num = r.round_num;
+
+    if(s->original_timing)
+        sleep_until_ns(s->start_ns + s->offset_ns + r.ts_ns - s->first_ts_ns);
+
+    fg_log(FG_LOG_DATA, "%s> replaying %llu bytes\n", stage->name,
+            (unsigned long long) r.datalen);
+
+    pin = fg_stage_pin_get_by_name(stage, "data_out");
+    fg_pin_convey_buffer(pin, buf);
+
+    return FG_STAGE_SUCCESS;
+}
+
+
+/* asynchronous read and write stage definitions
+ ***************************************************************/
+
+/* Up to depth buffers are read or written at once, through io_uring or a
+ * pool of threads (see aio.c); engine picks which, "auto" (the default)
+ * preferring io_uring.  Buffers are conveyed in file order whatever order
+ * their I/O finishes in.  The stage only waits for an input buffer when it
+ * has nothing in flight; otherwise it finishes what it has, so a network
+ * with fewer buffers than depth still flows. */
+struct async_io {
+    FG_buf *buf;
+    off_t offset;
+    size_t len;
+    ssize_t res;
+    int done;
+};
+
+struct async_io_state {
+    char *filename;
+    int fd;
+    int write;
+    aio *aio;
+    int depth;
+    off_t size;                 /* of the file being read */
+    off_t offset;               /* of the next buffer */
+    int eof;                    /* no more buffers to start */
+    struct async_io *ios;       /* in flight, oldest at head */
+    int head;
+    int count;
+    uint64_t bytes_so_far;
+    struct file_hints hints;
+};
+
+static int async_io_init(FG_stage *stage, int write)
+{
+    struct async_io_state *s;
+    char *depth, *engine;
+    enum aio_engine e = AIO_AUTO;
+
+    s = (struct async_io_state *) calloc(1, sizeof(struct async_io_state));
+
+    s->filename = fg_stage_get_param(stage, "filename");
+    depth = fg_stage_get_param(stage, "depth");
+    engine = fg_stage_get_param(stage, "engine");
+    s->write = write;
+    s->depth = depth ? atoi(depth) : 8;
+
+    if(engine && strcmp(engine, "io_uring") == 0)
+        e = AIO_URING;
+    else if(engine && strcmp(engine, "threads") == 0)
+        e = AIO_THREADS;
+    else if(engine && strcmp(engine, "auto") != 0) {
+        fprintf(stderr, "%s> engine must be auto, io_uring or threads, not "
+                "%s\n", stage->name, engine);
+        free(s);
+        return -1;
+    }
+
+    if(s->depth < 1) {
+        fprintf(stderr, "%s> depth must be at least 1\n", stage->name);
+        free(s);
+        return -1;
+    }
+
+    if(hints_parse(stage, &s->hints) < 0) {
+        free(s);
+        return -1;
+    }
+
+    if(!s->filename) {
+        fprintf(stderr, "%s> no filename\n", stage->name);
+        free(s);
+        return -1;
+    }
+
+    s->fd = write ? open(s->filename, O_WRONLY | O_CREAT | O_TRUNC, 0666)
+        : open(s->filename, O_RDONLY);
+    if(s->fd < 0) {
+        fprintf(stderr, "%s> cannot open %s: %s\n", stage->name, s->filename,
+                strerror(errno));
+        free(s);
+        return -1;
+    }
+
+    /* reads are positioned, so the file must be one that has positions */
+    if(!write && (s->size = lseek(s->fd, 0, SEEK_END)) < 0) {
+        fprintf(stderr, "%s> cannot read %s asynchronously: %s\n",
+                stage->name, s->filename, strerror(errno));
+        close(s->fd);
+        free(s);
+        return -1;
+    }
+
+    s->aio = aio_create(s->fd, s->depth, e);
+    if(!s->aio) {
+        fprintf(stderr, "%s> cannot start %s i/o\n", stage->name,
+                engine ? engine : "asynchronous");
+        close(s->fd);
+        free(s);
+        return -1;
+    }
+
+    s->ios = (struct async_io *) calloc(s->depth, sizeof(struct async_io));
+    hints_apply(&s->hints, s->fd);
+
+    stage->data = s;
+
+    fg_log(FG_LOG_STAGE, "%s> opened %s for %s, %d deep with %s\n",
+            stage->name, s->filename, write ? "writing" : "reading",
+            s->depth, aio_engine_name(s->aio));
+
+    return 0;
+}
+
+int aread_init(FG_stage *stage)
+{
+    return async_io_init(stage, 0);
+}
+
+int awrite_init(FG_stage *stage)
+{
+    return async_io_init(stage, 1);
+}
+
+void async_io_fini(FG_stage *stage)
+{
+    struct async_io_state *s = (struct async_io_state *) stage->data;
+
+    /* waits for anything an error left in flight */
+    aio_destroy(s->aio);
+    close(s->fd);
+    free(s->ios);
+    free(s->filename);
+    free(s);
+
+    fg_log(FG_LOG_STAGE, "%s> closed file\n", stage->name);
+}
+
+static int async_io_start(FG_stage *stage, struct async_io_state *s,
+        FG_buf *buf, size_t len)
+{
+    struct async_io *io = &s->ios[(s->head + s->count) % s->depth];
+
+    io->buf = buf;
+    io->offset = s->offset;
+    io->len = len;
+    io->res = 0;
+    io->done = 0;
+
+    if(aio_submit(s->aio, s->write, buf->data, len, s->offset, io) < 0) {
+        fprintf(stderr, "%s> cannot start i/o on %s\n", stage->name,
+                s->filename);
+        return -1;
+    }
+
+    s->offset += len;
+    s->count++;
+
+    return 0;
+}
+
+/* Transfers can come back short; the rest is done here, synchronously.  A
+ * read is only finished at the end of the file. */
+static ssize_t async_io_finish(struct async_io_state *s, struct async_io *io)
+{
+    ssize_t done = io->res, n;
+
+    while(done >= 0 && (size_t) done < io->len
+            && (s->write || io->offset + done < s->size)) {
+        if(s->write)
+            n = pwrite(s->fd, io->buf->data + done, io->len - done,
+                    io->offset + done);
+        else
+            n = pread(s->fd, io->buf->data + done, io->len - done,
+                    io->offset + done);
+
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n < 0)
+            return -errno;
+        if(n == 0)
+            break;
+        done += n;
+    }
+
+    return done;
+}
+
+/* Collects finished I/O, waiting for some if block, then conveys the
+ * buffers at the head that are done, in order.  -1 on an I/O error. */
+static int async_io_retire(FG_stage *stage, struct async_io_state *s,
+        int block)
+{
+    struct async_io *io;
+    FG_pin *pin;
+    void *tag;
+    ssize_t res;
+    int r;
+
+    while((r = aio_complete(s->aio, block, &tag, &res)) > 0) {
+        io = (struct async_io *) tag;
+        io->res = res;
+        io->res = async_io_finish(s, io);
+        io->done = 1;
+        block = 0;
+    }
+    if(r < 0) {
+        fprintf(stderr, "%s> lost track of i/o on %s\n", stage->name,
+                s->filename);
+        return -1;
+    }
+
+    pin = fg_stage_pin_get_by_name(stage, s->write ? "buf_out" : "data_out");
+
+    while(s->count > 0 && s->ios[s->head].done) {
+        io = &s->ios[s->head];
+        s->head = (s->head + 1) % s->depth;
+        s->count--;
+
+        if(io->res < 0) {
+            fprintf(stderr, "%s> %s of %s failed: %s\n", stage->name,
+                    s->write ? "write" : "read", s->filename,
+                    strerror(-io->res));
+            return -1;
+        }
+
+        s->bytes_so_far += io->res;
+        if(!s->write)
+            io->buf->datalen = io->res;
+        else
+            hints_written(&s->hints, io->offset + io->res);
+
+        fg_log(FG_LOG_DATA, "%s> %s %ld bytes (%llu total)\n", stage->name,
+                s->write ? "wrote" : "read", (long) io->res,
+                (unsigned long long) s->bytes_so_far);
+
+        fg_pin_convey_buffer(pin, io->buf);
+    }
+
+    return 0;
+}
+
+int aread_func(FG_stage *stage)
+{
+    struct async_io_state *s = (struct async_io_state *) stage->data;
+    FG_pin *pin;
+    FG_buf *buf;
+
+    if(async_io_retire(stage, s, 0) < 0)
+        return FG_STAGE_TERMINATE;
+
+    if(s->offset >= s->size)
+        s->eof = 1;
+
+    pin = fg_stage_pin_get_by_name(stage, "buf_in");
+    if(!s->eof && s->count < s->depth
+            && (s->count == 0 || fg_pin_buffer_ready(pin))) {
+        buf = fg_pin_accept_buffer(pin);
+        if(!buf || async_io_start(stage, s, buf, buf->size) < 0)
+            return FG_STAGE_TERMINATE;
+        hints_read(&s->hints, s->offset, buf->size);
+        return FG_STAGE_SUCCESS;
+    }
+
+    if(s->count == 0) {
+        fg_log(FG_LOG_STAGE, "%s> EOF reached\n", stage->name);
+        return FG_STAGE_TERMINATE;
+    }
+
+    return async_io_retire(stage, s, 1) < 0 ? FG_STAGE_TERMINATE
+        : FG_STAGE_SUCCESS;
+}
+
+int awrite_func(FG_stage *stage)
+{
+    struct async_io_state *s = (struct async_io_state *) stage->data;
+    FG_pin *pin;
+    FG_buf *buf;
+
+    if(async_io_retire(stage, s, 0) < 0)
+        return FG_STAGE_TERMINATE;
+
+    pin = fg_stage_pin_get_by_name(stage, "data_in");
+    if(!s->eof && s->count < s->depth
+            && (s->count == 0 || fg_pin_buffer_ready(pin))) {
+        buf = fg_pin_accept_buffer(pin);
+        if(!buf) {
+            s->eof = 1;
+        } else if(buf->datalen == 0) {
+            pin = fg_stage_pin_get_by_name(stage, "buf_out");
+            fg_pin_convey_buffer(pin, buf);
+        } else if(async_io_start(stage, s, buf, buf->datalen) < 0) {
+            return FG_STAGE_TERMINATE;
+        }
+        return FG_STAGE_SUCCESS;
+    }
+
+    if(s->count == 0) {
+        hints_write_finish(&s->hints, s->offset);
+        return FG_STAGE_TERMINATE;
+    }
+
+    return async_io_retire(stage, s, 1) < 0 ? FG_STAGE_TERMINATE
+        : FG_STAGE_SUCCESS;
+}
+
+/* memory-mapped read stage definition
+ ***************************************************************/
+
+/* Rather than copying the file into buffers, the stage maps it and points
+ * each buffer's data at the next window of the mapping: as many whole
+ * records (of param reclen bytes, default 1) as fit in the buffer.  A file
+ * in the page cache is then conveyed without being copied at all.
+ *
+ * The mapping is read-only unless param private is set, in which case it
+ * is a private copy-on-write mapping that stages downstream may modify in
+ * place, as sort does; the file itself is never changed.  Windows are
+ * released when their buffers come back, so a private mapping holds no more
+ * copied pages than there are buffers.  Stages must not write beyond a
+ * buffer's datalen. */
+struct mmap_read_state {
+    char *filename;
+    int fd;
+    char *map;
+    size_t size;
+    size_t offset;          /* of the next window */
+    unsigned int reclen;
+    size_t page;
+};
+
+int mmap_read_init(FG_stage *stage)
+{
+    struct mmap_read_state *s;
+    struct stat st;
+    char *reclen;
+    int priv;
+
+    s = (struct mmap_read_state *) calloc(1, sizeof(struct mmap_read_state));
+
+    s->filename = fg_stage_get_param(stage, "filename");
+    reclen = fg_stage_get_param(stage, "reclen");
+    s->reclen = reclen ? atoi(reclen) : 1;
+    priv = param_flag(stage, "private");
+    s->page = sysconf(_SC_PAGESIZE);
+
+    if(s->reclen < 1) {
+        fprintf(stderr, "%s> reclen must be at least 1\n", stage->name);
+        free(s);
+        return -1;
+    }
+
+    s->fd = s->filename ? open(s->filename, O_RDONLY) : -1;
+    if(s->fd < 0 || fstat(s->fd, &st) < 0) {
+        fprintf(stderr, "%s> cannot open %s: %s\n", stage->name,
+                s->filename ? s->filename : "(no filename)",
+                strerror(errno));
+        if(s->fd >= 0)
+            close(s->fd);
+        free(s);
+        return -1;
+    }
+
+    s->size = st.st_size;
+
+    /* an empty file has nothing to map */
+    if(s->size > 0) {
+        s->map = (char *) mmap(NULL, s->size,
+                priv ? PROT_READ | PROT_WRITE : PROT_READ,
+                priv ? MAP_PRIVATE : MAP_SHARED, s->fd, 0);
+        if(s->map == MAP_FAILED) {
+            fprintf(stderr, "%s> cannot map %s: %s\n", stage->name,
+                    s->filename, strerror(errno));
+            close(s->fd);
+            free(s);
+            return -1;
+        }
+
+        madvise(s->map, s->size, MADV_SEQUENTIAL);
+    }
+
+    stage->data = s;
+
+    fg_log(FG_LOG_STAGE, "%s> mapped %s (%llu bytes%s)\n", stage->name,
+            s->filename, (unsigned long long) s->size,
+            priv ? ", private" : "");
+
+    return 0;
+}
+
+void mmap_read_fini(FG_stage *stage)
+{
+    struct mmap_read_state *s = (struct mmap_read_state *) stage->data;
+
+    if(s->map)
+        munmap(s->map, s->size);
+    close(s->fd);
+    free(s->filename);
+    free(s);
+}
+
+/* hints about the pages from start to end, rounded inwards to whole pages
+ * so a window's neighbours, still in use, are left alone */
+static void mmap_read_advise(struct mmap_read_state *s, size_t start,
+        size_t end, int advice)
+{
+    start = (start + s->page - 1) / s->page * s->page;
+    end = end > s->size ? s->size : end;
+    if(end == s->size)
+        end = (end + s->page - 1) / s->page * s->page;
+    else
+        end = end / s->page * s->page;
+
+    if(start < end)
+        madvise(s->map + start, end - start, advice);
+}
+
+int mmap_read_func(FG_stage *stage)
+{
+    struct mmap_read_state *s = (struct mmap_read_state *) stage->data;
+    FG_pin *pin;
+    FG_buf *buf;
+    size_t window, len;
+
+    /* an empty file sends nothing at all */
+    if(s->offset >= s->size) {
+        fg_log(FG_LOG_STAGE, "%s> EOF reached\n", stage->name);
+        return FG_STAGE_TERMINATE;
+    }
+
+    pin = fg_stage_pin_get_by_name(stage, "buf_in");
+    buf = fg_pin_accept_buffer(pin);
+    if(!buf)
+        return FG_STAGE_TERMINATE;
+
+    window = buf->size / s->reclen * s->reclen;
+    if(window == 0) {
+        fprintf(stderr, "%s> records of %u bytes do not fit in buffers of "
+                "%llu\n", stage->name, s->reclen,
+                (unsigned long long) buf->size);
+        return FG_STAGE_TERMINATE;
+    }
+
+    /* a buffer back from a trip downstream gives up its window */
+    if(buf->data != buf->alloc && s->map)
+        mmap_read_advise(s, buf->data - s->map, buf->data - s->map + window,
+                MADV_DONTNEED);
+
+    len = s->size - s->offset < window ? s->size - s->offset : window;
+    buf->data = s->map ? s->map + s->offset : buf->alloc;
+    buf->datalen = len;
+    s->offset += len;
+
+    /* start reading the window after this one while this one is used */
+    if(s->offset < s->size)
+        mmap_read_advise(s, s->offset, s->offset + window, MADV_WILLNEED);
+
+    fg_log(FG_LOG_DATA, "%s> mapped %llu bytes (%llu total)\n", stage->name,
+            (unsigned long long) len, (unsigned long long) s->offset);
+
+    pin = fg_stage_pin_get_by_name(stage, "data_out");
+    fg_pin_convey_buffer(pin, buf);
+
+    if(s->offset >= s->size) {
+        fg_log(FG_LOG_STAGE, "%s> EOF reached\n", stage->name);
+        return FG_STAGE_TERMINATE;
+    }
+
+    return FG_STAGE_SUCCESS;
+}
+
+/* range read stage definition
+ ***************************************************************/
+
+/* One sequential stream can't keep a striped filesystem busy.  This stage
+ * splits its file into ranges of param range bytes (default 64M, rounded
+ * down to whole records of param reclen bytes) and reads them with param
+ * streams threads (default 4), each doing pread() into buffers.  A thread
+ * takes the next range when it finishes one, so faster streams read more of
+ * the file.  Each buffer holds whole records and is conveyed as soon as it
+ * is full, so the file comes out of order; buf->offset says where in the
+ * file each buffer's data came from.
+ *
+ * Only the stage's own thread touches pins: it hands empty buffers to the
+ * readers through a free list and conveys what they fill, in the order they
+ * finish.  It accepts exactly as many buffers as the file needs, so none is
+ * left over at the end. */
+struct range_read_state {
+    char *filename;
+    int fd;
+    off_t size;
+    off_t range;
+    unsigned int reclen;
+    int streams;
+    pthread_t *threads;
+    int nthreads;
+
+    pthread_mutex_t mutex;
+    pthread_cond_t free_cv;     /* readers wait here for empty buffers */
+    pthread_cond_t full_cv;     /* and the stage for full ones */
+    FG_buf *free;               /* linked through next, which is only used
+                                   while a buffer sits in a queue */
+    FG_buf *full, *full_tail;
+    off_t next_range;
+    uint64_t pieces;            /* buffers the whole file takes */
+    uint64_t accepted;
+    uint64_t outstanding;       /* accepted but not yet conveyed */
+    int readers_done;
+    int error;                  /* errno of a failed read */
+    int stop;
+};
+
+static void *range_reader(void *data);
+
+int range_read_init(FG_stage *stage)
+{
+    struct range_read_state *s;
+    char *streams, *range, *reclen;
+    int i;
+
+    s = (struct range_read_state *) calloc(1,
+            sizeof(struct range_read_state));
+
+    s->filename = fg_stage_get_param(stage, "filename");
+    streams = fg_stage_get_param(stage, "streams");
+    range = fg_stage_get_param(stage, "range");
+    reclen = fg_stage_get_param(stage, "reclen");
+    s->streams = streams ? atoi(streams) : 4;
+    s->range = range ? strtoll(range, NULL, 0) : 64 * 1024 * 1024;
+    s->reclen = reclen ? atoi(reclen) : 1;
+
+    if(s->streams < 1 || s->reclen < 1 || s->range < s->reclen) {
+        fprintf(stderr, "%s> streams and reclen must be at least 1, and "
+                "range at least reclen\n", stage->name);
+        free(s);
+        return -1;
+    }
+    s->range = s->range / s->reclen * s->reclen;
+
+    s->fd = s->filename ? open(s->filename, O_RDONLY) : -1;
+    if(s->fd < 0 || (s->size = lseek(s->fd, 0, SEEK_END)) < 0) {
+        fprintf(stderr, "%s> cannot read %s: %s\n", stage->name,
+                s->filename ? s->filename : "(no filename)",
+                strerror(errno));
+        if(s->fd >= 0)
+            close(s->fd);
+        free(s);
+        return -1;
+    }
+
+    pthread_mutex_init(&s->mutex, NULL);
+    pthread_cond_init(&s->free_cv, NULL);
+    pthread_cond_init(&s->full_cv, NULL);
+
+    stage->data = s;
+
+    s->threads = (pthread_t *) calloc(s->streams, sizeof(pthread_t));
+    for(i = 0; i < s->streams; i++) {
+        if(pthread_create(&s->threads[i], NULL, range_reader, s) != 0) {
+            fprintf(stderr, "%s> cannot start reader %d\n", stage->name, i);
+            range_read_fini(stage);
+            stage->data = NULL;
+            return -1;
+        }
+        s->nthreads++;
+    }
+
+    fg_log(FG_LOG_STAGE, "%s> reading %s in ranges of %lld bytes, %d "
+            "streams\n", stage->name, s->filename, (long long) s->range,
+            s->streams);
+
+    return 0;
+}
+
+void range_read_fini(FG_stage *stage)
+{
+    struct range_read_state *s = (struct range_read_state *) stage->data;
+    int i;
+
+    pthread_mutex_lock(&s->mutex);
+    s->stop = 1;
+    pthread_cond_broadcast(&s->free_cv);
+    pthread_mutex_unlock(&s->mutex);
+
+    for(i = 0; i < s->nthreads; i++)
+        pthread_join(s->threads[i], NULL);
+
+    pthread_mutex_destroy(&s->mutex);
+    pthread_cond_destroy(&s->free_cv);
+    pthread_cond_destroy(&s->full_cv);
+    close(s->fd);
+    free(s->threads);
+    free(s->filename);
+    free(s);
+}
+
+/* the most of a buffer that holds whole records */
+static size_t range_window(struct range_read_state *s, FG_buf *buf)
+{
+    return buf->size / s->reclen * s->reclen;
+}
+
+static void *range_reader(void *data)
+{
+    struct range_read_state *s = (struct range_read_state *) data;
+    off_t pos, end;
+    ssize_t n, done;
+    size_t len;
+    FG_buf *buf;
+
+    pthread_mutex_lock(&s->mutex);
+
+    while(!s->stop && s->next_range < s->size) {
+        pos = s->next_range;
+        end = pos + s->range < s->size ? pos + s->range : s->size;
+        s->next_range = end;
+
+        while(pos < end) {
+            while(!s->free && !s->stop)
+                pthread_cond_wait(&s->free_cv, &s->mutex);
+            if(s->stop)
+                break;
+
+            buf = s->free;
+            s->free = buf->next;
+            pthread_mutex_unlock(&s->mutex);
+
+            len = range_window(s, buf);
+            if((off_t) len > end - pos)
+                len = end - pos;
+
+            for(done = 0; done < (ssize_t) len; done += n) {
+                n = pread(s->fd, buf->data + done, len - done, pos + done);
+                if(n < 0 && errno == EINTR)
+                    n = 0;
+                else if(n <= 0)
+                    break;
+            }
+
+            pthread_mutex_lock(&s->mutex);
+            if(done < (ssize_t) len && !s->error)
+                s->error = n < 0 ? errno : EIO;
+
+            buf->datalen = done;
+            buf->offset = pos;
+            buf->next = NULL;
+            if(s->full_tail)
+                s->full_tail->next = buf;
+            else
+                s->full = buf;
+            s->full_tail = buf;
+            pthread_cond_signal(&s->full_cv);
+
+            pos += len;
+        }
+    }
+
+    s->readers_done++;
+    pthread_cond_signal(&s->full_cv);
+    pthread_mutex_unlock(&s->mutex);
+
+    return NULL;
+}
+
+int range_read_func(FG_stage *stage)
+{
+    struct range_read_state *s = (struct range_read_state *) stage->data;
+    FG_pin *in, *out;
+    FG_buf *buf;
+    size_t window;
+    int ready;
+
+    in = fg_stage_pin_get_by_name(stage, "buf_in");
+    out = fg_stage_pin_get_by_name(stage, "data_out");
+    ready = fg_pin_buffer_ready(in);
+
+    pthread_mutex_lock(&s->mutex);
+
+    if(s->error) {
+        pthread_mutex_unlock(&s->mutex);
+        fprintf(stderr, "%s> read of %s failed: %s\n", stage->name,
+                s->filename, strerror(s->error));
+        return FG_STAGE_TERMINATE;
+    }
+
+    if(s->full) {
+        buf = s->full;
+        s->full = buf->next;
+        if(!s->full)
+            s->full_tail = NULL;
+        s->outstanding--;
+        pthread_mutex_unlock(&s->mutex);
+
+        fg_log(FG_LOG_DATA, "%s> read %llu bytes at %llu\n", stage->name,
+                (unsigned long long) buf->datalen,
+                (unsigned long long) buf->offset);
+        fg_pin_convey_buffer(out, buf);
+        return FG_STAGE_SUCCESS;
+    }
+
+    if(s->readers_done == s->nthreads) {
+        pthread_mutex_unlock(&s->mutex);
+        fg_log(FG_LOG_STAGE, "%s> EOF reached\n", stage->name);
+        return FG_STAGE_TERMINATE;
+    }
+
+    /* never wait for an empty buffer while holding some: they may be what
+     * downstream needs to give one back */
+    if((s->accepted == 0 && s->size > 0) || (s->accepted < s->pieces
+                && (s->outstanding == 0 || ready))) {
+        pthread_mutex_unlock(&s->mutex);
+        buf = fg_pin_accept_buffer(in);
+        if(!buf)
+            return FG_STAGE_TERMINATE;
+
+        window = range_window(s, buf);
+        if(window == 0) {
+            fprintf(stderr, "%s> records of %u bytes do not fit in buffers "
+                    "of %llu\n", stage->name, s->reclen,
+                    (unsigned long long) buf->size);
+            return FG_STAGE_TERMINATE;
+        }
+
+        pthread_mutex_lock(&s->mutex);
+        if(s->accepted == 0)
+            s->pieces = s->size / s->range * ((s->range + window - 1) / window)
+                + (s->size % s->range + window - 1) / window;
+        s->accepted++;
+        s->outstanding++;
+        buf->next = s->free;
+        s->free = buf;
+        pthread_cond_signal(&s->free_cv);
+        pthread_mutex_unlock(&s->mutex);
+        return FG_STAGE_SUCCESS;
+    }
+
+    while(!s->full && !s->error && s->readers_done < s->nthreads)
+        pthread_cond_wait(&s->full_cv, &s->mutex);
+    pthread_mutex_unlock(&s->mutex);
+
+    return FG_STAGE_SUCCESS;
+}
+
+/* run writer stage definition
+ *************************************************************/
+
+/* Each buffer accepted is a run, appended to one run file (see
+ * lib/fg_runfile.h) in place of a file of its own.  The file is grown with
+ * fallocate() param preallocate bytes at a time (default 1G, 0 for not at
+ * all), so the filesystem can lay the runs out contiguously, and cut back
+ * to what was written at the end. */
+#define RUN_WRITER_PREALLOCATE (1024 * 1024 * 1024)
+
+struct run_writer_state {
+    char *filename;
+    int fd;
+    off_t preallocate;
+    off_t allocated;        /* fallocate()d up to here */
+    off_t pos;              /* where the next run goes */
+    struct fg_runfile_entry *dir;
+    uint64_t runs;
+    uint64_t capacity;
+};
+
+int run_writer_init(FG_stage *stage)
+{
+    struct run_writer_state *s;
+    char *v;
+
+    s = (struct run_writer_state *) calloc(1, sizeof(struct run_writer_state));
+
+    s->filename = fg_stage_get_param(stage, "filename");
+    v = fg_stage_get_param(stage, "preallocate");
+    s->preallocate = v ? strtoll(v, NULL, 0) : RUN_WRITER_PREALLOCATE;
+    s->pos = FG_RUNFILE_ALIGN;
+
+    s->fd = open(s->filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if(s->fd < 0) {
+        fprintf(stderr, "%s> cannot open %s: %s\n", stage->name, s->filename,
+                strerror(errno));
+        free(s);
+        return -1;
+    }
+
+    stage->data = s;
+
+    fg_log(FG_LOG_STAGE, "%s> opened %s for runs\n", stage->name,
+            s->filename);
+
+    return 0;
+}
+
+void run_writer_fini(FG_stage *stage)
+{
+    struct run_writer_state *s = (struct run_writer_state *) stage->data;
+
+    close(s->fd);
+    free(s->dir);
+    free(s);
+
+    fg_log(FG_LOG_STAGE, "%s> closed file\n", stage->name);
+}
+
+/* Space for len more bytes at s->pos.  Filesystems that can't preallocate
+ * just grow the file as it is written. */
+static void run_writer_reserve(struct run_writer_state *s, off_t len)
+{
+    off_t n;
+
+    if(s->preallocate <= 0 || s->pos + len <= s->allocated)
+        return;
+
+    n = s->pos + len - s->allocated;
+    if(n < s->preallocate)
+        n = s->preallocate;
+    if(fallocate(s->fd, 0, s->allocated, n) == 0)
+        s->allocated += n;
+    else
+        s->preallocate = 0;
+}
+
+/* the directory, the header, and the file cut to length */
+static int run_writer_finish(FG_stage *stage, struct run_writer_state *s)
+{
+    struct fg_runfile_header h;
+    size_t len = s->runs * sizeof(struct fg_runfile_entry);
+
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, FG_RUNFILE_MAGIC, sizeof(h.magic));
+    h.runs = s->runs;
+    h.dir_offset = s->pos;
+
+    if(pwrite_full(s->fd, (char *) s->dir, len, s->pos) < 0
+            || ftruncate(s->fd, s->pos + len) < 0
+            || pwrite_full(s->fd, (char *) &h, sizeof(h), 0) < 0) {
+        fprintf(stderr, "%s> cannot finish %s: %s\n", stage->name,
+                s->filename, strerror(errno));
+        return -1;
+    }
+
+    fg_log(FG_LOG_STAGE, "%s> wrote %llu runs to %s\n", stage->name,
+            (unsigned long long) s->runs, s->filename);
+
+    return 0;
+}
+
+int run_writer_func(FG_stage *stage)
+{
+    struct run_writer_state *s = (struct run_writer_state *) stage->data;
+    struct fg_runfile_entry *dir;
+    FG_pin *pin;
+    FG_buf *buf;
+    off_t padded;
+
+    pin = fg_stage_pin_get_by_name(stage, "data_in");
+    buf = fg_pin_accept_buffer(pin);
+
+    if(!buf)
+        return run_writer_finish(stage, s) < 0 ? FG_STAGE_ERROR
+            : FG_STAGE_TERMINATE;
+
+    if(s->runs == s->capacity) {
+        dir = (struct fg_runfile_entry *) realloc(s->dir,
+                (s->capacity * 2 + 64) * sizeof(struct fg_runfile_entry));
+        if(!dir) {
+            fprintf(stderr, "%s> out of memory\n", stage->name);
+            return FG_STAGE_ERROR;
+        }
+        s->dir = dir;
+        s->capacity = s->capacity * 2 + 64;
+    }
+
+    /* the next run starts aligned too */
+    padded = (buf->datalen + FG_RUNFILE_ALIGN - 1) / FG_RUNFILE_ALIGN
+        * FG_RUNFILE_ALIGN;
+    run_writer_reserve(s, padded);
+
+    if(pwrite_full(s->fd, buf->data, buf->datalen, s->pos) < 0) {
+        fprintf(stderr, "%s> write to %s failed: %s\n", stage->name,
+                s->filename, strerror(errno));
+        return FG_STAGE_ERROR;
+    }
+
+    s->dir[s->runs].offset = s->pos;
+    s->dir[s->runs].length = buf->datalen;
+    s->runs++;
+    s->pos += padded;
+
+    fg_log(FG_LOG_DATA, "%s> wrote run %llu, %llu bytes\n", stage->name,
+            (unsigned long long) s->runs - 1,
+            (unsigned long long) buf->datalen);
+
+    pin = fg_stage_pin_get_by_name(stage, "buf_out");
+    fg_pin_convey_buffer(pin, buf);
+
+    return FG_STAGE_SUCCESS;
+}
+
+/* run reader stage definition
+ *************************************************************/
+
+/* Run i of a run file goes out on connection i of data_out, which needs a
+ * connection per run, in a buffer at a time of as many whole records of
+ * param reclen bytes (default 1) as fit.  Every buffer of a run but its last
+ * is full.  When a run has all been conveyed its connection is deactivated,
+ * so the stage reading it gets NULL, as if a stage of its own had ended.
+ *
+ * Reading is driven by demand: a buffer that comes back (each buffer's
+ * offset says where its data came from) is refilled from the same run, so
+ * the runs a merge is consuming are the ones read.  Buffers that come back
+ * from a finished run, and those not yet used, go to the runs round robin.
+ * A merge takes a buffer of every run before it gives any back, so buf_in
+ * must have at least one buffer per run; two or more let reading overlap
+ * merging. */
+struct run_reader_state {
+    char *filename;
+    int fd;
+    struct fg_runfile_entry *dir;
+    off_t *next;            /* of each run, still to be read */
+    int runs;
+    int left;               /* runs with data still to be conveyed */
+    int rr;
+    unsigned int reclen;
+    int started;
+};
+
+int run_reader_init(FG_stage *stage)
+{
+    struct run_reader_state *s;
+    FG_pin *pin;
+    uint32_t bufcount;
+    int64_t runs;
+    char *reclen;
+    int i, width;
+
+    s = (struct run_reader_state *) calloc(1, sizeof(struct run_reader_state));
+
+    s->filename = fg_stage_get_param(stage, "filename");
+    reclen = fg_stage_get_param(stage, "reclen");
+    s->reclen = reclen ? atoi(reclen) : 1;
+    if(s->reclen < 1) {
+        fprintf(stderr, "%s> reclen must be at least 1\n", stage->name);
+        free(s);
+        return -1;
+    }
+
+    s->fd = open(s->filename, O_RDONLY);
+    if(s->fd < 0) {
+        fprintf(stderr, "%s> cannot open %s: %s\n", stage->name, s->filename,
+                strerror(errno));
+        free(s);
+        return -1;
+    }
+
+    runs = fg_runfile_read_dir(s->fd, &s->dir);
+    if(runs < 0) {
+        fprintf(stderr, "%s> %s is not a complete run file\n", stage->name,
+                s->filename);
+        close(s->fd);
+        free(s);
+        return -1;
+    }
+    s->runs = runs;
+
+    s->next = (off_t *) calloc(s->runs + 1, sizeof(off_t));
+    for(i = 0; i < s->runs; i++) {
+        s->next[i] = s->dir[i].offset;
+        if(s->dir[i].length > 0)
+            s->left++;
+    }
+
+    pin = fg_stage_pin_get_by_name(stage, "data_out");
+    width = fg_pin_array_get_width(pin);
+    pin = fg_stage_pin_get_by_name(stage, "buf_in");
+    bufcount = pin->bufcount ? pin->bufcount : stage->nw->default_bufcount;
+
+    if(width < s->runs || bufcount < (uint32_t) s->left) {
+        fprintf(stderr, "%s> %s holds %d runs: data_out needs as many "
+                "connections (has %d) and buf_in at least %d buffers (has "
+                "%u)\n", stage->name, s->filename, s->runs, width, s->left,
+                bufcount);
+        stage->data = s;
+        run_reader_fini(stage);
+        stage->data = NULL;
+        return -1;
+    }
+
+    stage->data = s;
+
+    fg_log(FG_LOG_STAGE, "%s> opened %s, %d runs\n", stage->name,
+            s->filename, s->runs);
+
+    return 0;
+}
+
+void run_reader_fini(FG_stage *stage)
+{
+    struct run_reader_state *s = (struct run_reader_state *) stage->data;
+
+    if(!s)
+        return;
+
+    close(s->fd);
+    free(s->dir);
+    free(s->next);
+    free(s);
+
+    fg_log(FG_LOG_STAGE, "%s> closed file\n", stage->name);
+}
+
+/* the run whose data a buffer held, or -1 for a buffer not used yet (run
+ * data never starts at offset 0) */
+static int run_reader_find(struct run_reader_state *s, FG_buf *buf)
+{
+    int lo = 0, hi = s->runs - 1, mid;
+
+    if(buf->offset == 0)
+        return -1;
+
+    while(lo <= hi) {
+        mid = (lo + hi) / 2;
+        if(buf->offset < s->dir[mid].offset)
+            hi = mid - 1;
+        else if(buf->offset >= s->dir[mid].offset + s->dir[mid].length)
+            lo = mid + 1;
+        else
+            return mid;
+    }
+
+    return -1;
+}
+
+static int run_reader_has_data(struct run_reader_state *s, int i)
+{
+    return (uint64_t) s->next[i] < s->dir[i].offset + s->dir[i].length;
+}
+
+int run_reader_func(FG_stage *stage)
+{
+    struct run_reader_state *s = (struct run_reader_state *) stage->data;
+    uint64_t want, end;
+    FG_pin *in, *out;
+    FG_buf *buf;
+    ssize_t n;
+    int i, width;
+
+    in = fg_stage_pin_get_by_name(stage, "buf_in");
+    out = fg_stage_pin_get_by_name(stage, "data_out");
+
+    /* empty runs and spare connections have nothing to wait for */
+    if(!s->started) {
+        width = fg_pin_array_get_width(out);
+        for(i = 0; i < width; i++)
+            if(i >= s->runs || !run_reader_has_data(s, i))
+                fg_pin_array_deactivate(out, i);
+        s->started = 1;
+    }
+
+    if(s->left == 0) {
+        fg_log(FG_LOG_STAGE, "%s> EOF reached\n", stage->name);
+        return FG_STAGE_TERMINATE;
+    }
+
+    buf = fg_pin_accept_buffer(in);
+    if(!buf)
+        return FG_STAGE_TERMINATE;
+
+    i = run_reader_find(s, buf);
+    if(i < 0 || !run_reader_has_data(s, i)) {
+        while(!run_reader_has_data(s, s->rr))
+            s->rr = (s->rr + 1) % s->runs;
+        i = s->rr;
+        s->rr = (s->rr + 1) % s->runs;
+    }
+
+    want = buf->size / s->reclen * s->reclen;
+    if(want == 0) {
+        fprintf(stderr, "%s> records of %u bytes do not fit in buffers of "
+                "%llu\n", stage->name, s->reclen,
+                (unsigned long long) buf->size);
+        return FG_STAGE_TERMINATE;
+    }
+
+    end = s->dir[i].offset + s->dir[i].length;
+    if(want > end - s->next[i])
+        want = end - s->next[i];
+
+    n = pread_full(s->fd, buf->data, want, s->next[i]);
+    if(n < 0 || (uint64_t) n < want) {
+        fprintf(stderr, "%s> read of run %d of %s failed: %s\n", stage->name,
+                i, s->filename, n < 0 ? strerror(errno) : "file too short");
+        return FG_STAGE_TERMINATE;
+    }
+
+    buf->datalen = n;
+    buf->offset = s->next[i];
+    s->next[i] += n;
+
+    fg_log(FG_LOG_DATA, "%s> read %llu bytes of run %d\n", stage->name,
+            (unsigned long long) n, i);
+
+    fg_pin_array_convey_buffer(out, i, buf);
+
+    if(!run_reader_has_data(s, i)) {
+        fg_pin_array_deactivate(out, i);
+        s->left--;
+    }
+
+    return FG_STAGE_SUCCESS;
+}
+
+/* write-behind stage definition
+ *************************************************************/
+
+/* Writes are made by a flusher thread, so the stage upstream never waits
+ * on the device, only for its buffers to come back.  Up to param depth
+ * writes (default 4) are outstanding.  A buffer comes back once the flusher
+ * has written it or, with param copy set to 1, as soon as it has been
+ * copied into memory of the stage's own, at the cost of a copy and depth
+ * buffers' worth of memory.  Param sync is when the data is made durable:
+ * "end" (the default) with one fdatasync() once the last buffer is written,
+ * "each" before a buffer comes back, with one fdatasync() for all the
+ * writes the flusher made together, or "none". */
+enum write_behind_sync {
+    WB_SYNC_END,
+    WB_SYNC_EACH,
+    WB_SYNC_NONE
+};
+
+static const char *write_behind_sync_names[] = { "end", "each", "none", NULL };
+
+struct write_behind_item {
+    FG_buf *buf;            /* the buffer written, unless copied */
+    char *data;
+    uint64_t len;
+    off_t offset;
+    char *copy;             /* with param copy, memory of the item's own */
+    uint64_t copy_size;
+    struct write_behind_item *next;
+};
+
+struct write_behind_state {
+    char *filename;
+    int fd;
+    int depth;
+    int copy;
+    enum write_behind_sync sync;
+    struct file_hints hints;
+    off_t offset;           /* of the next buffer */
+    int eof;
+
+    pthread_t thread;
+    int started;
+
+    /* items go free -> pending -> (flusher) -> done, or straight back to
+     * free when copied; all guarded by mutex */
+    pthread_mutex_t mutex;
+    pthread_cond_t work_cv;
+    pthread_cond_t done_cv;
+    struct write_behind_item *items;
+    struct write_behind_item *free;
+    struct write_behind_item *pending, *pending_tail;
+    struct write_behind_item *done, *done_tail;
+    int outstanding;        /* items not free */
+    uint64_t written;
+    int error;              /* errno of a failed write */
+    int stop;
+};
+
+static void *write_behind_flusher(void *data);
+
+int write_behind_init(FG_stage *stage)
+{
+    struct write_behind_state *s;
+    char *depth, *sync;
+    int i;
+
+    s = (struct write_behind_state *) calloc(1,
+            sizeof(struct write_behind_state));
+
+    s->filename = fg_stage_get_param(stage, "filename");
+    depth = fg_stage_get_param(stage, "depth");
+    sync = fg_stage_get_param(stage, "sync");
+    s->depth = depth ? atoi(depth) : 4;
+    s->copy = param_flag(stage, "copy");
+
+    for(i = 0; sync && write_behind_sync_names[i]; i++)
+        if(strcmp(sync, write_behind_sync_names[i]) == 0)
+            break;
+    if(sync && !write_behind_sync_names[i]) {
+        fprintf(stderr, "%s> sync must be end, each or none, not %s\n",
+                stage->name, sync);
+        free(s);
+        return -1;
+    }
+    s->sync = sync ? (enum write_behind_sync) i : WB_SYNC_END;
+
+    if(s->depth < 1) {
+        fprintf(stderr, "%s> depth must be at least 1\n", stage->name);
+        free(s);
+        return -1;
+    }
+
+    if(hints_parse(stage, &s->hints) < 0) {
+        free(s);
+        return -1;
+    }
+
+    s->fd = open(s->filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if(s->fd < 0) {
+        fprintf(stderr, "%s> cannot open %s: %s\n", stage->name, s->filename,
+                strerror(errno));
+        free(s);
+        return -1;
+    }
+    hints_apply(&s->hints, s->fd);
+
+    s->items = (struct write_behind_item *) calloc(s->depth,
+            sizeof(struct write_behind_item));
+    for(i = 0; i < s->depth; i++) {
+        s->items[i].next = s->free;
+        s->free = s->items + i;
+    }
+
+    pthread_mutex_init(&s->mutex, NULL);
+    pthread_cond_init(&s->work_cv, NULL);
+    pthread_cond_init(&s->done_cv, NULL);
+
+    stage->data = s;
+
+    if(pthread_create(&s->thread, NULL, write_behind_flusher, s) != 0) {
+        fprintf(stderr, "%s> cannot start the flusher thread\n", stage->name);
+        write_behind_fini(stage);
+        stage->data = NULL;
+        return -1;
+    }
+    s->started = 1;
+
+    fg_log(FG_LOG_STAGE, "%s> opened %s for writing, depth %d%s\n",
+            stage->name, s->filename, s->depth, s->copy ? ", copying" : "");
+
+    return 0;
+}
+
+void write_behind_fini(FG_stage *stage)
+{
+    struct write_behind_state *s = (struct write_behind_state *) stage->data;
+    int i;
+
+    if(!s)
+        return;
+
+    if(s->started) {
+        pthread_mutex_lock(&s->mutex);
+        s->stop = 1;
+        pthread_cond_signal(&s->work_cv);
+        pthread_mutex_unlock(&s->mutex);
+        pthread_join(s->thread, NULL);
+    }
+
+    pthread_mutex_destroy(&s->mutex);
+    pthread_cond_destroy(&s->work_cv);
+    pthread_cond_destroy(&s->done_cv);
+    for(i = 0; i < s->depth; i++)
+        free(s->items[i].copy);
+    free(s->items);
+    close(s->fd);
+    free(s);
+
+    fg_log(FG_LOG_STAGE, "%s> closed file\n", stage->name);
+}
+
+/* Writes whatever is pending, all of it at a time, so that with sync "each"
+ * one fdatasync() covers every write made together. */
+static void *write_behind_flusher(void *data)
+{
+    struct write_behind_state *s = (struct write_behind_state *) data;
+    struct write_behind_item *batch, *item, *next;
+    uint64_t written;
+    int error = 0;
+
+    pthread_mutex_lock(&s->mutex);
+    for(;;) {
+        while(!s->pending && !s->stop)
+            pthread_cond_wait(&s->work_cv, &s->mutex);
+        if(!s->pending)
+            break;
+
+        batch = s->pending;
+        s->pending = s->pending_tail = NULL;
+        pthread_mutex_unlock(&s->mutex);
+
+        written = 0;
+        for(item = batch; item && !error; item = item->next) {
+            if(pwrite_full(s->fd, item->data, item->len, item->offset) < 0) {
+                error = errno;
+            } else {
+                written += item->len;
+                hints_written(&s->hints, item->offset + item->len);
+            }
+        }
+        if(!error && s->sync == WB_SYNC_EACH && fdatasync(s->fd) < 0)
+            error = errno;
+
+        pthread_mutex_lock(&s->mutex);
+        s->written += written;
+        for(item = batch; item; item = next) {
+            next = item->next;
+            item->next = NULL;
+            if(item->buf) {
+                if(s->done_tail)
+                    s->done_tail->next = item;
+                else
+                    s->done = item;
+                s->done_tail = item;
+            } else {
+                item->next = s->free;
+                s->free = item;
+                s->outstanding--;
+            }
+        }
+        if(error)
+            s->error = error;
+        pthread_cond_signal(&s->done_cv);
+    }
+    pthread_mutex_unlock(&s->mutex);
+
+    return NULL;
+}
+
+/* Waits, with mutex held, until the flusher has finished something since
+ * the caller last looked.  What it finished before the wait began is
+ * already on the done list, so a signal missed while the mutex was
+ * released is not waited for again. */
+static void write_behind_wait(struct write_behind_state *s)
+{
+    int outstanding = s->outstanding;
+
+    while(!s->done && !s->error && s->outstanding == outstanding)
+        pthread_cond_wait(&s->done_cv, &s->mutex);
+}
+
+/* once everything has been written */
+static int write_behind_finish(FG_stage *stage, struct write_behind_state *s)
+{
+    hints_write_finish(&s->hints, s->offset);
+
+    if(s->sync != WB_SYNC_NONE && fdatasync(s->fd) < 0) {
+        fprintf(stderr, "%s> fdatasync of %s failed: %s\n", stage->name,
+                s->filename, strerror(errno));
+        return -1;
+    }
+
+    fg_log(FG_LOG_STAGE, "%s> wrote %llu bytes\n", stage->name,
+            (unsigned long long) s->written);
+
+    return 0;
+}
+
+int write_behind_func(FG_stage *stage)
+{
+    struct write_behind_state *s = (struct write_behind_state *) stage->data;
+    struct write_behind_item *done, *item, *last = NULL;
+    FG_pin *in, *out;
+    FG_buf *buf;
+    char *copy;
+    int n = 0;
+
+    in = fg_stage_pin_get_by_name(stage, "data_in");
+    out = fg_stage_pin_get_by_name(stage, "buf_out");
+
+    pthread_mutex_lock(&s->mutex);
+    done = s->done;
+    s->done = s->done_tail = NULL;
+    pthread_mutex_unlock(&s->mutex);
+
+    /* buffers written come back in the order they were accepted */
+    for(item = done; item; item = item->next) {
+        fg_pin_convey_buffer(out, item->buf);
+        item->buf = NULL;
+        last = item;
+        n++;
+    }
+
+    pthread_mutex_lock(&s->mutex);
+    if(last) {
+        last->next = s->free;
+        s->free = done;
+        s->outstanding -= n;
+    }
+
+    if(s->error) {
+        pthread_mutex_unlock(&s->mutex);
+        fprintf(stderr, "%s> write of %s failed: %s\n", stage->name,
+                s->filename, strerror(s->error));
+        return FG_STAGE_ERROR;
+    }
+
+    if(s->eof) {
+        if(s->outstanding == 0) {
+            pthread_mutex_unlock(&s->mutex);
+            return write_behind_finish(stage, s) < 0 ? FG_STAGE_ERROR
+                : FG_STAGE_TERMINATE;
+        }
+        write_behind_wait(s);
+        pthread_mutex_unlock(&s->mutex);
+        return FG_STAGE_SUCCESS;
+    }
+
+    /* Buffers being written must not be held while waiting for another:
+     * they may be what upstream is waiting for.  Copies hold none. */
+    if(!s->copy && s->outstanding > 0
+            && (!s->free || !fg_pin_buffer_ready(in))) {
+        write_behind_wait(s);
+        pthread_mutex_unlock(&s->mutex);
+        return FG_STAGE_SUCCESS;
+    }
+    pthread_mutex_unlock(&s->mutex);
+
+    buf = fg_pin_accept_buffer(in);
+    if(!buf) {
+        s->eof = 1;
+        return FG_STAGE_SUCCESS;
+    }
+
+    pthread_mutex_lock(&s->mutex);
+    while(!s->free && !s->error)
+        pthread_cond_wait(&s->done_cv, &s->mutex);
+    item = s->free;
+    if(item) {
+        s->free = item->next;
+        item->next = NULL;
+        s->outstanding++;
+    }
+    pthread_mutex_unlock(&s->mutex);
+
+    if(!item) {
+        fg_pin_convey_buffer(out, buf);
+        return FG_STAGE_SUCCESS;
+    }
+
+    item->len = buf->datalen;
+    item->offset = s->offset;
+    s->offset += buf->datalen;
+
+    if(s->copy) {
+        if(item->copy_size < buf->datalen) {
+            if(posix_memalign((void **) &copy, FG_BUF_ALIGN,
+                        buf->datalen) != 0) {
+                fprintf(stderr, "%s> out of memory\n", stage->name);
+                fg_pin_convey_buffer(out, buf);
+                return FG_STAGE_ERROR;
+            }
+            free(item->copy);
+            item->copy = copy;
+            item->copy_size = buf->datalen;
+        }
+        memcpy(item->copy, buf->data, buf->datalen);
+        item->data = item->copy;
+        item->buf = NULL;
+        fg_pin_convey_buffer(out, buf);
+    } else {
+        item->data = buf->data;
+        item->buf = buf;
+    }
+
+    fg_log(FG_LOG_DATA, "%s> queued %llu bytes at %llu\n", stage->name,
+            (unsigned long long) item->len,
+            (unsigned long long) item->offset);
+
+    pthread_mutex_lock(&s->mutex);
+    if(s->pending_tail)
+        s->pending_tail->next = item;
+    else
+        s->pending = item;
+    s->pending_tail = item;
+    pthread_cond_signal(&s->work_cv);
+    pthread_mutex_unlock(&s->mutex);
+
+    return FG_STAGE_SUCCESS;
+}
+
+/* multi-file read stage definition
+ *************************************************************/
+
+/* Reads every file named by param glob, by the lines of the file param list
+ * or in the directory param dir, in the order of the glob, the list or the
+ * directory's names sorted, so that one stage reads what would otherwise
+ * need a read-file stage, and a thread, per file.  Each buffer holds data
+ * of one file only, as many whole records of param reclen bytes (default 1)
+ * as fit, with tag set to the file's place in that order and offset to
+ * where in the file the data lies.
+ *
+ * Param mode "sequential" (the default) reads the files one after another;
+ * "concurrent" reads param streams files (default 4) at once, each with a
+ * reader thread of its own making pread() into buffers, and conveys
+ * buffers as they are filled, so downstream tells the files apart by tag.
+ * A reader done with one file takes the next.  Ahead of them, another
+ * thread opens up to param open_ahead files (default 2) before they are
+ * needed and asks the kernel to start reading them, so moving on to the
+ * next file waits on neither open() nor the first read.
+ *
+ * As in range-read-file, only the stage's own thread touches pins.  It
+ * accepts an empty buffer only when a reader is waiting for one, so none
+ * is left over at the end, and on an error it conveys every buffer it
+ * holds, empty or not, before terminating. */
+
+/* asked for of each file opened ahead */
+#define READ_FILES_PREFETCH (4 * 1024 * 1024)
+
+struct read_files_state {
+    const char *name;       /* the stage's, for the readers' messages */
+    char **names;
+    int nfiles;
+    unsigned int reclen;
+    int streams;
+    int ahead;
+
+    pthread_t opener;
+    int opener_started;
+    pthread_t *readers;
+    int nreaders;
+    int started;            /* mutex and conditions are initialized */
+
+    /* all below guarded by mutex */
+    pthread_mutex_t mutex;
+    pthread_cond_t opened_cv;   /* readers wait here for the opener */
+    pthread_cond_t taken_cv;    /* and the opener for readers */
+    pthread_cond_t free_cv;     /* readers wait here for empty buffers */
+    pthread_cond_t full_cv;     /* and the stage for full ones */
+    int *fds;               /* -1 once taken by a reader */
+    off_t *sizes;
+    int *errs;
+    int opened;             /* files the opener is done with */
+    int next;               /* the next file a reader will take */
+    FG_buf *free;           /* linked through next, as in range-read-file */
+    FG_buf *full, *full_tail;
+    int nfree;
+    int wanting;            /* readers waiting for an empty buffer */
+    uint64_t outstanding;   /* accepted but not yet conveyed */
+    int readers_done;
+    int error;              /* errno of a failed open or read */
+    int error_file;
+    int stop;
+    uint64_t bytes_so_far;
+};
+
+static void *read_files_reader(void *data);
+
+static int read_files_add(struct read_files_state *s, const char *name)
+{
+    char **names;
+
+    names = (char **) realloc(s->names, (s->nfiles + 1) * sizeof(char *));
+    if(!names)
+        return -1;
+    s->names = names;
+    s->names[s->nfiles++] = strdup(name);
+
+    return 0;
+}
+
+static int read_files_glob(FG_stage *stage, struct read_files_state *s,
+        const char *pattern)
+{
+    glob_t g;
+    size_t i;
+    int rc;
+
+    rc = glob(pattern, 0, NULL, &g);
+    if(rc == GLOB_NOMATCH) {
+        fprintf(stderr, "%s> %s matches no files\n", stage->name, pattern);
+        return -1;
+    }
+    if(rc != 0) {
+        fprintf(stderr, "%s> cannot expand %s\n", stage->name, pattern);
+        return -1;
+    }
+
+    for(i = 0; i < g.gl_pathc; i++)
+        read_files_add(s, g.gl_pathv[i]);
+    globfree(&g);
+
+    return 0;
+}
+
+/* a name per line; blank lines are skipped */
+static int read_files_list(FG_stage *stage, struct read_files_state *s,
+        const char *filename)
+{
+    FILE *f;
+    char *line = NULL;
+    size_t cap = 0;
+    ssize_t len;
+
+    f = fopen(filename, "r");
+    if(!f) {
+        fprintf(stderr, "%s> cannot open %s: %s\n", stage->name, filename,
+                strerror(errno));
+        return -1;
+    }
+
+    while((len = getline(&line, &cap, f)) >= 0) {
+        while(len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+            line[--len] = '\0';
+        if(len > 0)
+            read_files_add(s, line);
+    }
+
+    free(line);
+    fclose(f);
+
+    return 0;
+}
+
+/* the regular files in dir, by name */
+static int read_files_dir(FG_stage *stage, struct read_files_state *s,
+        const char *dir)
+{
+    struct dirent **entries;
+    struct stat sbuf;
+    char *path;
+    int n, i;
+
+    n = scandir(dir, &entries, NULL, alphasort);
+    if(n < 0) {
+        fprintf(stderr, "%s> cannot read directory %s: %s\n", stage->name,
+                dir, strerror(errno));
+        return -1;
+    }
+
+    for(i = 0; i < n; i++) {
+        path = (char *) malloc(strlen(dir) + strlen(entries[i]->d_name) + 2);
+        sprintf(path, "%s/%s", dir, entries[i]->d_name);
+        if(stat(path, &sbuf) == 0 && S_ISREG(sbuf.st_mode))
+            read_files_add(s, path);
+        free(path);
+        free(entries[i]);
+    }
+    free(entries);
+
+    return 0;
+}
+
+static void *read_files_opener(void *data)
+{
+    struct read_files_state *s = (struct read_files_state *) data;
+    struct stat sbuf;
+    int i, fd, err;
+    off_t size;
+
+    pthread_mutex_lock(&s->mutex);
+    while(s->opened < s->nfiles) {
+        while(s->opened - s->next >= s->ahead && !s->stop)
+            pthread_cond_wait(&s->taken_cv, &s->mutex);
+        if(s->stop)
+            break;
+        i = s->opened;
+        pthread_mutex_unlock(&s->mutex);
+
+        err = 0;
+        size = 0;
+        fd = open(s->names[i], O_RDONLY);
+        if(fd < 0 || fstat(fd, &sbuf) < 0) {
+            err = errno;
+            if(fd >= 0)
+                close(fd);
+            fd = -1;
+        } else {
+            size = sbuf.st_size;
+            posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+            posix_fadvise(fd, 0, size < READ_FILES_PREFETCH ? size
+                    : READ_FILES_PREFETCH, POSIX_FADV_WILLNEED);
+        }
+
+        pthread_mutex_lock(&s->mutex);
+        s->fds[i] = fd;
+        s->sizes[i] = size;
+        s->errs[i] = err;
+        s->opened++;
+        pthread_cond_broadcast(&s->opened_cv);
+    }
+    pthread_mutex_unlock(&s->mutex);
+
+    return NULL;
+}
+
+int read_files_init(FG_stage *stage)
+{
+    struct read_files_state *s;
+    char *glob_param, *list, *dir, *mode, *v;
+    int rc, i;
+
+    glob_param = fg_stage_get_param(stage, "glob");
+    list = fg_stage_get_param(stage, "list");
+    dir = fg_stage_get_param(stage, "dir");
+    if((glob_param != NULL) + (list != NULL) + (dir != NULL) != 1) {
+        fprintf(stderr, "%s> exactly one of glob, list and dir must be "
+                "set\n", stage->name);
+        return -1;
+    }
+
+    s = (struct read_files_state *) calloc(1, sizeof(struct read_files_state));
+    s->name = stage->name;
+
+    v = fg_stage_get_param(stage, "reclen");
+    s->reclen = v ? strtoul(v, NULL, 0) : 1;
+    v = fg_stage_get_param(stage, "open_ahead");
+    s->ahead = v ? atoi(v) : 2;
+    v = fg_stage_get_param(stage, "streams");
+    s->streams = v ? atoi(v) : 4;
+
+    mode = fg_stage_get_param(stage, "mode");
+    if(!mode || strcmp(mode, "sequential") == 0) {
+        s->streams = 1;
+    } else if(strcmp(mode, "concurrent") != 0) {
+        fprintf(stderr, "%s> mode must be sequential or concurrent, not "
+                "%s\n", stage->name, mode);
+        free(s);
+        return -1;
+    }
+
+    if(s->reclen == 0 || s->ahead < 1 || s->streams < 1) {
+        fprintf(stderr, "%s> reclen, open_ahead and streams must be at "
+                "least 1\n", stage->name);
+        free(s);
+        return -1;
+    }
+
+    if(glob_param)
+        rc = read_files_glob(stage, s, glob_param);
+    else if(list)
+        rc = read_files_list(stage, s, list);
+    else
+        rc = read_files_dir(stage, s, dir);
+
+    stage->data = s;
+
+    if(rc < 0) {
+        read_files_fini(stage);
+        stage->data = NULL;
+        return -1;
+    }
+
+    s->fds = (int *) malloc((s->nfiles + 1) * sizeof(int));
+    s->sizes = (off_t *) malloc((s->nfiles + 1) * sizeof(off_t));
+    s->errs = (int *) malloc((s->nfiles + 1) * sizeof(int));
+    for(i = 0; i < s->nfiles; i++)
+        s->fds[i] = -1;
+
+    pthread_mutex_init(&s->mutex, NULL);
+    pthread_cond_init(&s->opened_cv, NULL);
+    pthread_cond_init(&s->taken_cv, NULL);
+    pthread_cond_init(&s->free_cv, NULL);
+    pthread_cond_init(&s->full_cv, NULL);
+    s->started = 1;
+
+    if(pthread_create(&s->opener, NULL, read_files_opener, s) != 0) {
+        fprintf(stderr, "%s> cannot start the opener thread\n", stage->name);
+        read_files_fini(stage);
+        stage->data = NULL;
+        return -1;
+    }
+    s->opener_started = 1;
+
+    /* no more readers than files */
+    if(s->streams > s->nfiles)
+        s->streams = s->nfiles;
+    s->readers = (pthread_t *) calloc(s->streams + 1, sizeof(pthread_t));
+    for(i = 0; i < s->streams; i++) {
+        if(pthread_create(&s->readers[i], NULL, read_files_reader, s) != 0) {
+            fprintf(stderr, "%s> cannot start reader %d\n", stage->name, i);
+            read_files_fini(stage);
+            stage->data = NULL;
+            return -1;
+        }
+        s->nreaders++;
+    }
+
+    fg_log(FG_LOG_STAGE, "%s> reading %d files, %d at a time\n",
+            stage->name, s->nfiles, s->streams);
+
+    return 0;
+}
+
+void read_files_fini(FG_stage *stage)
+{
+    struct read_files_state *s = (struct read_files_state *) stage->data;
+    int i;
+
+    if(!s)
+        return;
+
+    if(s->started) {
+        pthread_mutex_lock(&s->mutex);
+        s->stop = 1;
+        pthread_cond_broadcast(&s->opened_cv);
+        pthread_cond_broadcast(&s->taken_cv);
+        pthread_cond_broadcast(&s->free_cv);
+        pthread_mutex_unlock(&s->mutex);
+
+        for(i = 0; i < s->nreaders; i++)
+            pthread_join(s->readers[i], NULL);
+        if(s->opener_started)
+            pthread_join(s->opener, NULL);
+
+        pthread_mutex_destroy(&s->mutex);
+        pthread_cond_destroy(&s->opened_cv);
+        pthread_cond_destroy(&s->taken_cv);
+        pthread_cond_destroy(&s->free_cv);
+        pthread_cond_destroy(&s->full_cv);
+
+        /* opened ahead but never read */
+        for(i = 0; i < s->opened; i++)
+            if(s->fds[i] >= 0)
+                close(s->fds[i]);
+    }
+
+    for(i = 0; i < s->nfiles; i++)
+        free(s->names[i]);
+    free(s->names);
+    free(s->fds);
+    free(s->sizes);
+    free(s->errs);
+    free(s->readers);
+    free(s);
+
+    fg_log(FG_LOG_STAGE, "%s> closed files\n", stage->name);
+}
+
+/* Reads one file after another, as the opener hands them out, into
+ * buffers from the free list, and queues them full for the stage.  Empty
+ * files are passed over. */
+static void *read_files_reader(void *data)
+{
+    struct read_files_state *s = (struct read_files_state *) data;
+    off_t pos, end;
+    size_t len;
+    ssize_t n;
+    FG_buf *buf;
+    int i, fd, err;
+
+    pthread_mutex_lock(&s->mutex);
+
+    while(!s->stop && !s->error && s->next < s->nfiles) {
+        /* another reader may take the file this one was woken for */
+        while(s->opened <= s->next && s->next < s->nfiles && !s->stop)
+            pthread_cond_wait(&s->opened_cv, &s->mutex);
+        if(s->stop || s->next >= s->nfiles)
+            break;
+
+        i = s->next++;
+        pthread_cond_signal(&s->taken_cv);
+        fd = s->fds[i];
+        s->fds[i] = -1;
+
+        if(fd < 0) {
+            if(!s->error) {
+                s->error = s->errs[i];
+                s->error_file = i;
+            }
+            pthread_cond_signal(&s->full_cv);
+            break;
+        }
+
+        pos = 0;
+        end = s->sizes[i];
+        while(pos < end) {
+            s->wanting++;
+            pthread_cond_signal(&s->full_cv);
+            while(!s->free && !s->stop)
+                pthread_cond_wait(&s->free_cv, &s->mutex);
+            s->wanting--;
+            if(s->stop)
+                break;
+
+            buf = s->free;
+            s->free = buf->next;
+            s->nfree--;
+            pthread_mutex_unlock(&s->mutex);
+
+            len = buf->size / s->reclen * s->reclen;
+            if((off_t) len > end - pos)
+                len = end - pos;
+            n = pread_full(fd, buf->data, len, pos);
+            err = errno;
+
+            pthread_mutex_lock(&s->mutex);
+            if(n < 0) {
+                if(!s->error) {
+                    s->error = err;
+                    s->error_file = i;
+                }
+                buf->datalen = 0;
+                buf->next = s->free;
+                s->free = buf;
+                s->nfree++;
+                pthread_cond_signal(&s->full_cv);
+                break;
+            }
+
+            buf->datalen = n;
+            buf->offset = pos;
+            buf->tag = i;
+            buf->next = NULL;
+            if(s->full_tail)
+                s->full_tail->next = buf;
+            else
+                s->full = buf;
+            s->full_tail = buf;
+            pthread_cond_signal(&s->full_cv);
+
+            pos += n;
+
+            /* short: the file has shrunk since the opener took its size */
+            if((size_t) n < len)
+                break;
+        }
+
+        fg_log(FG_LOG_STAGE, "%s> file %d is %s, read %llu bytes\n",
+                s->name, i, s->names[i], (unsigned long long) pos);
+        close(fd);
+    }
+
+    s->readers_done++;
+    pthread_cond_signal(&s->full_cv);
+    pthread_mutex_unlock(&s->mutex);
+
+    return NULL;
+}
+
+/* Stops the readers and conveys every buffer the stage holds, filled or
+ * not, so that none is kept from its origin when the stage terminates. */
+static int read_files_drain(FG_stage *stage, struct read_files_state *s)
+{
+    FG_pin *out;
+    FG_buf *full, *free_bufs, *buf, *next;
+
+    out = fg_stage_pin_get_by_name(stage, "data_out");
+
+    pthread_mutex_lock(&s->mutex);
+    s->stop = 1;
+    pthread_cond_broadcast(&s->opened_cv);
+    pthread_cond_broadcast(&s->free_cv);
+    while(s->readers_done < s->nreaders)
+        pthread_cond_wait(&s->full_cv, &s->mutex);
+    full = s->full;
+    free_bufs = s->free;
+    s->full = s->full_tail = s->free = NULL;
+    s->nfree = 0;
+    pthread_mutex_unlock(&s->mutex);
+
+    for(buf = full; buf; buf = next) {
+        next = buf->next;
+        fg_pin_convey_buffer(out, buf);
+    }
+    for(buf = free_bufs; buf; buf = next) {
+        next = buf->next;
+        buf->datalen = 0;
+        fg_pin_convey_buffer(out, buf);
+    }
+
+    return FG_STAGE_TERMINATE;
+}
+
+int read_files_func(FG_stage *stage)
+{
+    struct read_files_state *s = (struct read_files_state *) stage->data;
+    FG_pin *in, *out;
+    FG_buf *buf;
+    int ready;
+
+    in = fg_stage_pin_get_by_name(stage, "buf_in");
+    out = fg_stage_pin_get_by_name(stage, "data_out");
+    ready = fg_pin_buffer_ready(in);
+
+    pthread_mutex_lock(&s->mutex);
+
+    if(s->error) {
+        pthread_mutex_unlock(&s->mutex);
+        fprintf(stderr, "%s> cannot read %s: %s\n", stage->name,
+                s->names[s->error_file], strerror(s->error));
+        return read_files_drain(stage, s);
+    }
+
+    if(s->full) {
+        buf = s->full;
+        s->full = buf->next;
+        if(!s->full)
+            s->full_tail = NULL;
+        s->outstanding--;
+        s->bytes_so_far += buf->datalen;
+        pthread_mutex_unlock(&s->mutex);
+
+        fg_log(FG_LOG_DATA, "%s> read %llu bytes of file %u (%llu total)\n",
+                stage->name, (unsigned long long) buf->datalen, buf->tag,
+                (unsigned long long) s->bytes_so_far);
+        fg_pin_convey_buffer(out, buf);
+        return FG_STAGE_SUCCESS;
+    }
+
+    /* no files, or only empty ones, send nothing at all */
+    if(s->readers_done == s->nreaders) {
+        pthread_mutex_unlock(&s->mutex);
+        fg_log(FG_LOG_STAGE, "%s> EOF reached\n", stage->name);
+        return read_files_drain(stage, s);
+    }
+
+    /* never wait for an empty buffer while holding some: they may be what
+     * downstream needs to give one back */
+    if(s->wanting > s->nfree && (s->outstanding == 0 || ready)) {
+        pthread_mutex_unlock(&s->mutex);
+        buf = fg_pin_accept_buffer(in);
+        if(!buf)
+            return read_files_drain(stage, s);
+
+        if(buf->size < s->reclen) {
+            fprintf(stderr, "%s> records of %u bytes do not fit in buffers "
+                    "of %llu\n", stage->name, s->reclen,
+                    (unsigned long long) buf->size);
+            buf->datalen = 0;
+            fg_pin_convey_buffer(out, buf);
+            return read_files_drain(stage, s);
+        }
+
+        pthread_mutex_lock(&s->mutex);
+        s->outstanding++;
+        buf->next = s->free;
+        s->free = buf;
+        s->nfree++;
+        pthread_cond_signal(&s->free_cv);
+        pthread_mutex_unlock(&s->mutex);
+        return FG_STAGE_SUCCESS;
+    }
+
+    while(!s->full && !s->error && s->readers_done < s->nreaders
+            && !(s->wanting > s->nfree && s->outstanding == 0))
+        pthread_cond_wait(&s->full_cv, &s->mutex);
+    pthread_mutex_unlock(&s->mutex);
+
+    return FG_STAGE_SUCCESS;
+}
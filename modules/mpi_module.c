@@ -5,6 +5,7 @@
 #include <mpi.h>
 #include <stdio.h>
 #include <string.h>
+#include <limits.h>
 #include <malloc.h>
 
 #include "fg_internal.h"
@@ -48,20 +49,23 @@ int recv_func(FG_stage *stage)
 
     pin = fg_stage_pin_get_by_name(stage, "buf_in");
     buf = fg_pin_accept_buffer(pin);
+    if(!buf)
+        return FG_STAGE_TERMINATE;
 
-    rc = MPI_Recv(buf->data, buf->size, MPI_CHAR, MPI_ANY_SOURCE, MPI_ANY_TAG,
-            MPI_COMM_WORLD, &status);
+    /* MPI counts are ints; a buffer may be bigger than a message can be */
+    rc = MPI_Recv(buf->data, buf->size < INT_MAX ? (int) buf->size : INT_MAX,
+            MPI_CHAR, MPI_ANY_SOURCE, MPI_ANY_TAG, MPI_COMM_WORLD, &status);
     if(rc != MPI_SUCCESS)
         return FG_STAGE_TERMINATE;
 
-    printf("%s> received %d bytes from %d (tag: %d)\n",
+    fg_log(FG_LOG_DATA, "%s> received %d bytes from %d (tag: %d)\n",
             stage->name, status.count, status.MPI_SOURCE, status.MPI_TAG);
 
     pin = fg_stage_pin_get_by_name(stage, "data_out");
 
     if(status.MPI_TAG == MPI_TAG_TX_END) {
         buf->datalen = 0;
-        printf("%s> received tx end\n", stage->name);
+        fg_log(FG_LOG_STAGE, "%s> received tx end\n", stage->name);
     } else {
         buf->datalen = status.count;
     }
@@ -92,11 +96,20 @@ int send_func(FG_stage *stage)
     dst = (rank + 1) % size;
 
     if(buf) {
-        rc = MPI_Send(buf->data, buf->datalen, MPI_CHAR, dst, 0, MPI_COMM_WORLD);
+        /* each buffer is one message, whose count is an int */
+        if(buf->datalen > INT_MAX) {
+            fprintf(stderr, "%s> cannot send %llu bytes in one message\n",
+                    stage->name, (unsigned long long) buf->datalen);
+            return FG_STAGE_TERMINATE;
+        }
+
+        rc = MPI_Send(buf->data, (int) buf->datalen, MPI_CHAR, dst, 0,
+                MPI_COMM_WORLD);
         if(rc != MPI_SUCCESS)
             return FG_STAGE_TERMINATE;
 
-        printf("%s> sent %d bytes to %d\n", stage->name, buf->datalen, dst);
+        fg_log(FG_LOG_DATA, "%s> sent %llu bytes to %d\n", stage->name,
+                (unsigned long long) buf->datalen, dst);
 
         pin = fg_stage_pin_get_by_name(stage, "buf_out");
         fg_pin_convey_buffer(pin, buf);
@@ -104,7 +117,7 @@ int send_func(FG_stage *stage)
         return FG_STAGE_SUCCESS;
     } else {
         rc = MPI_Send(blah, 0, MPI_CHAR, dst, MPI_TAG_TX_END, MPI_COMM_WORLD);
-        printf("%s> sent tx end msg to %d\n", stage->name, dst);
+        fg_log(FG_LOG_STAGE, "%s> sent tx end msg to %d\n", stage->name, dst);
         return FG_STAGE_TERMINATE;
     }
 }